@@ -14,7 +14,6 @@ struct k_work button_press_work;
 struct k_work event_tx_work;
 struct k_work_delayable rx_led_off_work;
 struct k_work_delayable tx_led_off_work;
-static void send_next_sysex_chunk();
 
 /************************ App state ************************/
 struct sample_app_state_t {
@@ -25,8 +24,6 @@ struct sample_app_state_t {
 	uint8_t sysex_rx_bytes[CONFIG_SYSEX_ECHO_MAX_LENGTH];
 	int64_t sysex_rx_start_time;
 
-	int sysex_tx_is_echo;
-	int sysex_tx_byte_count;
 	int sysex_tx_msg_size;
 	int sysex_tx_in_progress;
 	int sysex_tx_cable_num;
@@ -37,9 +34,7 @@ static struct sample_app_state_t sample_app_state = {.usb_midi_is_available = 0,
 							 .sysex_rx_byte_count = 0,
 							 .sysex_tx_in_progress = 0,
 							 .sysex_rx_start_time = 0,
-						     .sysex_tx_byte_count = 0,
 							 .sysex_tx_start_time = 0,
-							 .sysex_tx_is_echo = 0,
 						     .sysex_tx_in_progress = 0,
 							 .sysex_tx_cable_num = 0,
 						     .tx_note_off = 0,
@@ -52,11 +47,9 @@ static void log_sysex_transfer_time(int is_tx, int cable_num, int num_bytes, int
 		num_bytes, (int)time_ms, (int)bytes_per_s);
 }
 
-static void sysex_tx_will_start(int is_echo, int msg_size, int cable_num) {
+static void sysex_tx_will_start(int msg_size, int cable_num) {
 	__ASSERT_NO_MSG(sample_app_state.sysex_tx_in_progress == 0);
 	sample_app_state.sysex_tx_in_progress = 1;
-	sample_app_state.sysex_tx_is_echo = is_echo;
-	sample_app_state.sysex_tx_byte_count = 0;
 	sample_app_state.sysex_tx_msg_size = msg_size;
 	sample_app_state.sysex_tx_cable_num = cable_num;
 	sample_app_state.sysex_tx_start_time = k_uptime_get();
@@ -112,11 +105,33 @@ void on_event_tx(struct k_work *item)
 	}
 }
 
+static void sysex_tx_test_msg_pull_cb(uint8_t *dest, uint32_t offset, uint32_t num_bytes)
+{
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		uint32_t byte_idx = offset + i;
+		if (byte_idx == 0) {
+			dest[i] = 0xf0;
+		}
+		else if (byte_idx == sample_app_state.sysex_tx_msg_size - 1) {
+			dest[i] = 0xf7;
+		}
+		else {
+			dest[i] = byte_idx % 100;
+		}
+	}
+}
+
 void on_button_press(struct k_work *item)
 {
 	if (sample_app_state.usb_midi_is_available && !sample_app_state.sysex_tx_in_progress) {
-		sysex_tx_will_start(0, CONFIG_SYSEX_TX_TEST_MSG_SIZE, CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM);
-		send_next_sysex_chunk();
+		sysex_tx_will_start(CONFIG_SYSEX_TX_TEST_MSG_SIZE, CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM);
+		flash_tx_led();
+		int rc = usb_midi_sysex_tx_pull(CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM, CONFIG_SYSEX_TX_TEST_MSG_SIZE,
+						sysex_tx_test_msg_pull_cb);
+		if (rc != 0) {
+			LOG_ERR("Failed to start sysex tx with error %d", rc);
+			sample_app_state.sysex_tx_in_progress = 0;
+		}
 	}
 }
 
@@ -200,9 +215,19 @@ static void sysex_end_cb(uint8_t cable_num)
 	log_sysex_transfer_time(0, cable_num, sample_app_state.sysex_rx_byte_count, dt_ms);
 	flash_rx_led();
 #ifdef CONFIG_SYSEX_ECHO_ENABLED
+	if (sample_app_state.sysex_tx_in_progress) {
+		LOG_WRN("Not echoing received sysex, sysex tx in progress");
+		return;
+	}
 	LOG_INF("Echoing received sysex");
-	sysex_tx_will_start(1, sample_app_state.sysex_rx_byte_count < CONFIG_SYSEX_ECHO_MAX_LENGTH ? sample_app_state.sysex_rx_byte_count : CONFIG_SYSEX_ECHO_MAX_LENGTH, cable_num);
-	send_next_sysex_chunk();
+	int echo_size = sample_app_state.sysex_rx_byte_count < CONFIG_SYSEX_ECHO_MAX_LENGTH ? sample_app_state.sysex_rx_byte_count : CONFIG_SYSEX_ECHO_MAX_LENGTH;
+	sysex_tx_will_start(echo_size, cable_num);
+	flash_tx_led();
+	int rc = usb_midi_sysex_tx(cable_num, sample_app_state.sysex_rx_bytes, echo_size);
+	if (rc != 0) {
+		LOG_ERR("Failed to echo sysex with error %d", rc);
+		sample_app_state.sysex_tx_in_progress = 0;
+	}
 #endif
 }
 
@@ -216,72 +241,14 @@ static void usb_midi_available_cb(int is_available)
 	}
 }
 
-static uint8_t get_next_sysex_tx_byte() {
-	if (sample_app_state.sysex_tx_is_echo) {
-		return sample_app_state.sysex_rx_bytes[sample_app_state.sysex_tx_byte_count];
-	} 
-	else {
-		if (sample_app_state.sysex_tx_byte_count == 0) {
-			return 0xf0;
-		}
-		else if (sample_app_state.sysex_tx_byte_count == sample_app_state.sysex_tx_msg_size - 1) {
-			return 0xf7;
-		} 
-		else {
-			return sample_app_state.sysex_tx_byte_count % 100;
-		}	
-	}
-}
-
-static void send_next_sysex_chunk() {
-	__ASSERT_NO_MSG(sample_app_state.sysex_tx_in_progress);
-	flash_tx_led();
-
-	while (1) {
-		if (usb_midi_tx_buffer_is_full()) {
-			// tx packet is full. send it. 
-			usb_midi_tx_buffer_send();
-			// nothing further for now. wait for tx done callback before
-			// filling the next packet.
-			break;
-		}
-
-		int sysex_msg_size = sample_app_state.sysex_tx_msg_size;
-
-		uint8_t chunk[3] = {0, 0, 0};
-		for (int i = 0; i < 3; i++) {
-			uint8_t next_sysex_byte = get_next_sysex_tx_byte();
-			chunk[i] = next_sysex_byte;
-			sample_app_state.sysex_tx_byte_count++;
-
-			if (sample_app_state.sysex_tx_byte_count == sysex_msg_size) {
-				break;
-			}
-		}
-
-		// Enqueue three byte sysex chunk for transmission
-		// TODO: check if this suceeds or not? Currently, this check is not needed
-		// since each MIDI message is put into a 4 byte packet and the tx buffer size
-		// is a multiple of 4. 
-		usb_midi_tx_buffer_add(sample_app_state.sysex_tx_cable_num, chunk);
-
-		if (sample_app_state.sysex_tx_byte_count == sysex_msg_size) {
-			// No more data to add to tx packet. Send it, then we're done.
-			usb_midi_tx_buffer_send();
-			flash_tx_led();
-			u_int64_t dt_ms = k_uptime_get() - sample_app_state.sysex_tx_start_time;
-			log_sysex_transfer_time(1, sample_app_state.sysex_tx_cable_num, sysex_msg_size, dt_ms);
-			sample_app_state.sysex_tx_in_progress = 0;
-			break;
-		}
-	}
-}
-
-static void usb_midi_tx_done_cb()
+static void usb_midi_sysex_tx_done_cb(uint8_t cable_num, int result)
 {
-	if (sample_app_state.sysex_tx_in_progress) {
-		send_next_sysex_chunk();
+	flash_tx_led();
+	if (result == 0) {
+		u_int64_t dt_ms = k_uptime_get() - sample_app_state.sysex_tx_start_time;
+		log_sysex_transfer_time(1, cable_num, sample_app_state.sysex_tx_msg_size, dt_ms);
 	}
+	sample_app_state.sysex_tx_in_progress = 0;
 }
 
 /****************** Sample app ******************/
@@ -301,11 +268,12 @@ void main(void)
 
 	/* Register USB MIDI callbacks */
 	struct usb_midi_cb_t callbacks = {.available_cb = usb_midi_available_cb,
-					  .tx_done_cb = usb_midi_tx_done_cb,
+					  .tx_done_cb = NULL,
 					  .midi_message_cb = midi_message_cb,
 					  .sysex_data_cb = sysex_data_cb,
 					  .sysex_end_cb = sysex_end_cb,
-					  .sysex_start_cb = sysex_start_cb};
+					  .sysex_start_cb = sysex_start_cb,
+					  .sysex_tx_done_cb = usb_midi_sysex_tx_done_cb};
 	usb_midi_register_callbacks(&callbacks);
 
 	/* Init USB */
@@ -0,0 +1 @@
+gcc -O2 usb_midi_packet_bench.c ../usb_midi/src/usb_midi_packet.c ../usb_midi/src/usb_midi_stream.c -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -o bench.out; ./bench.out bench_results.csv
\ No newline at end of file
@@ -0,0 +1,16 @@
+# Fuzzes the packet codec and the stream parser with address and undefined behavior sanitizers for 60 seconds,
+# starting from the seed corpus. Uses libFuzzer if clang is available, otherwise the
+# harness's standalone driver. Fails if the throughput is below MIN_EXECS_PER_S.
+# For AFL, build with afl-clang-fast -DUSB_MIDI_FUZZ_STANDALONE and run with
+# afl-fuzz -i fuzz_corpus -o fuzz_corpus_out -- ./fuzz.out @@
+MIN_EXECS_PER_S=50000
+SOURCES="usb_midi_packet_fuzz.c ../usb_midi/src/usb_midi_packet.c ../usb_midi/src/usb_midi_stream.c"
+if command -v clang > /dev/null; then
+  clang -g -O1 -fsanitize=fuzzer,address,undefined $SOURCES -o fuzz.out || exit 1
+  mkdir -p fuzz_corpus_out
+  ./fuzz.out -max_total_time=60 -print_final_stats=1 fuzz_corpus_out fuzz_corpus 2>&1 | tee fuzz_log.txt | tail -20
+  grep -q "^Done" fuzz_log.txt || exit 1
+  awk -v min=$MIN_EXECS_PER_S '/stat::average_exec_per_sec/ { if ($2 < min) { print "❌ Throughput below target of " min " execs/s"; exit 1 } }' fuzz_log.txt
+else
+  gcc -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all -DUSB_MIDI_FUZZ_STANDALONE $SOURCES -o fuzz.out && ./fuzz.out -t 60 -m $MIN_EXECS_PER_S fuzz_corpus/*
+fi
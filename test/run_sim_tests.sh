@@ -0,0 +1,14 @@
+# Runs the load tests with rx dispatch in the endpoint callback, in the app's work
+# queue and in the driver thread, all with rx timestamps, scheduled tx and the clock
+# generator, the first also with tx auto flush and the others also with tx coalescing,
+# rx rate limiting and sysex reassembly enabled, the last with a sysex data span
+# shorter than a transfer, and the DIN bridge tests and benchmarks with two ports
+# driven by emulated UARTs, plus a port on an output only cable, with rx dispatch
+# in the system work queue.
+SOURCES="usb_midi_sim_test.c sim/usb_midi_sim.c ../usb_midi/src/usb_midi.c ../usb_midi/src/usb_midi_clock.c ../usb_midi/src/usb_midi_packet.c ../usb_midi/src/usb_midi_stream.c"
+FLAGS="-O2 -pthread -Isim -I../usb_midi/include -I../usb_midi/src -DCONFIG_USB_MIDI_NUM_INPUTS=2 -DCONFIG_USB_MIDI_NUM_OUTPUTS=3 -DCONFIG_USB_MIDI_LOG_LEVEL=0 -DCONFIG_USB_MIDI_TX_RING_SIZE=64 -DCONFIG_USB_MIDI_TX_NUM_BUFFERS=2 -DCONFIG_USB_MIDI_TX_CABLE_SHARE=4 -DCONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN=48"
+gcc $FLAGS -DCONFIG_USB_MIDI_RX_DISPATCH_ISR -DCONFIG_USB_MIDI_TX_AUTO_FLUSH -DCONFIG_USB_MIDI_TX_AUTO_FLUSH_BUDGET_US=1000 -DCONFIG_USB_MIDI_RX_TIMESTAMPS -DCONFIG_USB_MIDI_TX_SCHEDULE -DCONFIG_USB_MIDI_TX_SCHEDULE_SIZE=16 -DCONFIG_USB_MIDI_CLOCK -DCONFIG_USB_MIDI_CLOCK_TEMPO=120000 -DCONFIG_USB_MIDI_TX_TIMED -DCONFIG_USB_MIDI_SOF $SOURCES -o sim.out && ./sim.out
+gcc $FLAGS -DCONFIG_USB_MIDI_RX_DISPATCH_WORKQ -DCONFIG_USB_MIDI_RX_DEFERRED -DCONFIG_USB_MIDI_RX_QUEUE_SIZE=64 -DCONFIG_USB_MIDI_RX_FLOW_CONTROL -DCONFIG_USB_MIDI_TX_COALESCE -DCONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS=16 -DCONFIG_USB_MIDI_RX_RATE_LIMIT -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BYTES_PER_SEC=0 -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BURST=32 -DCONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY -DCONFIG_USB_MIDI_RX_SYSEX_BLOCK_SIZE=56 -DCONFIG_USB_MIDI_RX_SYSEX_NUM_BLOCKS=64 -DCONFIG_USB_MIDI_RX_TIMESTAMPS -DCONFIG_USB_MIDI_TX_SCHEDULE -DCONFIG_USB_MIDI_TX_SCHEDULE_SIZE=16 -DCONFIG_USB_MIDI_CLOCK -DCONFIG_USB_MIDI_CLOCK_TEMPO=120000 -DCONFIG_USB_MIDI_TX_TIMED -DCONFIG_USB_MIDI_SOF $SOURCES -o sim.out && ./sim.out
+gcc $FLAGS -DCONFIG_USB_MIDI_RX_DISPATCH_THREAD -DCONFIG_USB_MIDI_RX_THREAD_PRIORITY=5 -DCONFIG_USB_MIDI_RX_THREAD_STACK_SIZE=1024 -UCONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN -DCONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN=16 -DCONFIG_USB_MIDI_RX_DEFERRED -DCONFIG_USB_MIDI_RX_QUEUE_SIZE=64 -DCONFIG_USB_MIDI_RX_FLOW_CONTROL -DCONFIG_USB_MIDI_TX_COALESCE -DCONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS=16 -DCONFIG_USB_MIDI_RX_RATE_LIMIT -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BYTES_PER_SEC=0 -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BURST=32 -DCONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY -DCONFIG_USB_MIDI_RX_SYSEX_BLOCK_SIZE=56 -DCONFIG_USB_MIDI_RX_SYSEX_NUM_BLOCKS=64 -DCONFIG_USB_MIDI_RX_TIMESTAMPS -DCONFIG_USB_MIDI_TX_SCHEDULE -DCONFIG_USB_MIDI_TX_SCHEDULE_SIZE=16 -DCONFIG_USB_MIDI_CLOCK -DCONFIG_USB_MIDI_CLOCK_TEMPO=120000 -DCONFIG_USB_MIDI_TX_TIMED -DCONFIG_USB_MIDI_SOF $SOURCES -o sim.out && ./sim.out
+DIN_SOURCES="usb_midi_din_test.c sim/usb_midi_sim.c sim/uart_sim.c ../usb_midi/src/usb_midi.c ../usb_midi/src/usb_midi_din.c ../usb_midi/src/usb_midi_packet.c ../usb_midi/src/usb_midi_stream.c"
+gcc $FLAGS -DCONFIG_USB_MIDI_RX_DISPATCH_SYSTEM_WORKQ -DCONFIG_USB_MIDI_RX_DEFERRED -DCONFIG_USB_MIDI_RX_QUEUE_SIZE=64 -DCONFIG_USB_MIDI_RX_FLOW_CONTROL -DCONFIG_USB_MIDI_RX_RATE_LIMIT -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BYTES_PER_SEC=3125 -DCONFIG_USB_MIDI_RX_RATE_LIMIT_BURST=32 -UCONFIG_USB_MIDI_NUM_OUTPUTS -DCONFIG_USB_MIDI_NUM_OUTPUTS=4 -DCONFIG_USB_MIDI_DIN_BRIDGE -DCONFIG_USB_MIDI_DIN_NUM_PORTS=3 -DCONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE=256 -DCONFIG_USB_MIDI_DIN_RX_BUFFER_SIZE=16 -DCONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS=4 -DCONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS $DIN_SOURCES -o din.out && ./din.out
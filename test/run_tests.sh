@@ -1 +1 @@
-gcc usb_midi_packet_test.c ../usb_midi/src/usb_midi_packet.c; ./a.out
+gcc usb_midi_packet_test.c ../usb_midi/src/usb_midi_packet.c ../usb_midi/src/usb_midi_stream.c; ./a.out
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <zephyr/kernel.h>
+#include "uart_sim.h"
+
+/* Thousandths of a byte, i.e baudrate / 10 bits per byte / 1000 frames per second. */
+#define CREDIT_PER_BYTE 1000
+
+void uart_sim_init(struct uart_sim_t *uart, void (*wire_rx_cb)(struct uart_sim_t *uart, uint8_t byte))
+{
+	memset(uart, 0, sizeof(*uart));
+	uart->dev.name = "uart_sim";
+	uart->dev.data = uart;
+	uart->wire_rx_cb = wire_rx_cb;
+}
+
+int uart_sim_wire_tx(struct uart_sim_t *uart, const uint8_t *bytes, uint32_t num_bytes)
+{
+	if (UART_SIM_MAX_WIRE_RX_BYTES - uart->wire_tx_count < num_bytes) {
+		return -ENOBUFS;
+	}
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		uint32_t idx = (uart->wire_tx_head + uart->wire_tx_count++) % UART_SIM_MAX_WIRE_RX_BYTES;
+		uart->wire_tx_bytes[idx] = bytes[i];
+	}
+	return 0;
+}
+
+uint32_t uart_sim_wire_tx_pending(struct uart_sim_t *uart)
+{
+	return uart->wire_tx_count;
+}
+
+static void emit(struct uart_sim_t *uart, struct uart_event *evt)
+{
+	if (uart->callback) {
+		uart->callback(&uart->dev, evt, uart->user_data);
+	}
+}
+
+static void emit_rx_rdy(struct uart_sim_t *uart)
+{
+	if (uart->rx_pos == uart->rx_reported) {
+		return;
+	}
+	struct uart_event evt = {.type = UART_RX_RDY};
+	evt.data.rx.buf = uart->rx_buf;
+	evt.data.rx.offset = uart->rx_reported;
+	evt.data.rx.len = uart->rx_pos - uart->rx_reported;
+	uart->rx_reported = uart->rx_pos;
+	emit(uart, &evt);
+}
+
+static void rx_start_buf(struct uart_sim_t *uart, uint8_t *buf, uint32_t len)
+{
+	uart->rx_buf = buf;
+	uart->rx_len = len;
+	uart->rx_pos = 0;
+	uart->rx_reported = 0;
+	struct uart_event evt = {.type = UART_RX_BUF_REQUEST};
+	emit(uart, &evt);
+}
+
+/* Called when rx_buf is full. Switches to the next buffer or disables receiving. */
+static void rx_buf_full(struct uart_sim_t *uart)
+{
+	emit_rx_rdy(uart);
+	struct uart_event evt = {.type = UART_RX_BUF_RELEASED};
+	evt.data.rx_buf.buf = uart->rx_buf;
+	emit(uart, &evt);
+	if (uart->rx_next_buf) {
+		uint8_t *buf = uart->rx_next_buf;
+		uart->rx_next_buf = NULL;
+		rx_start_buf(uart, buf, uart->rx_next_len);
+	} else {
+		uart->rx_enabled = 0;
+		uart->rx_buf = NULL;
+		evt.type = UART_RX_DISABLED;
+		emit(uart, &evt);
+	}
+}
+
+void uart_sim_run_frame(struct uart_sim_t *uart)
+{
+	uint32_t credit_per_frame = uart->baudrate / 10;
+
+	/* Idle time can't be used to send faster later. */
+	uart->tx_credit = MIN(uart->tx_credit + credit_per_frame,
+			      uart->tx_buf ? UINT32_MAX : credit_per_frame);
+	while (uart->tx_buf && uart->tx_credit >= CREDIT_PER_BYTE) {
+		uart->tx_credit -= CREDIT_PER_BYTE;
+		uart->wire_rx_cb(uart, uart->tx_buf[uart->tx_pos++]);
+		if (uart->tx_pos == uart->tx_len) {
+			struct uart_event evt = {.type = UART_TX_DONE};
+			evt.data.tx.buf = uart->tx_buf;
+			evt.data.tx.len = uart->tx_len;
+			uart->tx_buf = NULL;
+			/* The callback may start the next write. */
+			emit(uart, &evt);
+		}
+	}
+
+	uart->rx_credit = MIN(uart->rx_credit + credit_per_frame,
+			      uart->wire_tx_count ? UINT32_MAX : credit_per_frame);
+	while (uart->wire_tx_count > 0 && uart->rx_credit >= CREDIT_PER_BYTE) {
+		uart->rx_credit -= CREDIT_PER_BYTE;
+		uint8_t byte = uart->wire_tx_bytes[uart->wire_tx_head];
+		uart->wire_tx_head = (uart->wire_tx_head + 1) % UART_SIM_MAX_WIRE_RX_BYTES;
+		uart->wire_tx_count--;
+		if (!uart->rx_enabled) {
+			uart->num_rx_overruns++;
+			continue;
+		}
+		uart->rx_buf[uart->rx_pos++] = byte;
+		if (uart->rx_pos == uart->rx_len) {
+			rx_buf_full(uart);
+		}
+	}
+	/* The rx timeout expires when the line is idle for the rest of the frame. */
+	if (uart->rx_enabled && uart->wire_tx_count == 0) {
+		emit_rx_rdy(uart);
+	}
+}
+
+int uart_configure(const struct device *dev, const struct uart_config *cfg)
+{
+	struct uart_sim_t *uart = dev->data;
+	if (cfg->baudrate == 0 || cfg->parity != UART_CFG_PARITY_NONE ||
+	    cfg->data_bits != UART_CFG_DATA_BITS_8) {
+		return -ENOTSUP;
+	}
+	uart->baudrate = cfg->baudrate;
+	return 0;
+}
+
+int uart_callback_set(const struct device *dev, uart_callback_t callback, void *user_data)
+{
+	struct uart_sim_t *uart = dev->data;
+	uart->callback = callback;
+	uart->user_data = user_data;
+	return 0;
+}
+
+int uart_tx(const struct device *dev, const uint8_t *buf, size_t len, int32_t timeout)
+{
+	struct uart_sim_t *uart = dev->data;
+	if (uart->tx_buf) {
+		return -EBUSY;
+	}
+	if (len == 0) {
+		return -EINVAL;
+	}
+	uart->tx_buf = buf;
+	uart->tx_len = len;
+	uart->tx_pos = 0;
+	return 0;
+}
+
+int uart_rx_enable(const struct device *dev, uint8_t *buf, size_t len, int32_t timeout)
+{
+	struct uart_sim_t *uart = dev->data;
+	if (uart->rx_enabled) {
+		return -EBUSY;
+	}
+	uart->rx_enabled = 1;
+	uart->rx_next_buf = NULL;
+	rx_start_buf(uart, buf, len);
+	return 0;
+}
+
+int uart_rx_buf_rsp(const struct device *dev, uint8_t *buf, size_t len)
+{
+	struct uart_sim_t *uart = dev->data;
+	if (!uart->rx_enabled || uart->rx_next_buf) {
+		return -EBUSY;
+	}
+	uart->rx_next_buf = buf;
+	uart->rx_next_len = len;
+	return 0;
+}
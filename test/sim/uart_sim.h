@@ -0,0 +1,59 @@
+#ifndef UART_SIM_H_
+#define UART_SIM_H_
+
+#include <stdint.h>
+#include <zephyr/drivers/uart.h>
+
+/*
+ * An in-memory UART implementing the async API, for running the DIN bridge
+ * on a PC. Bytes are moved at the configured baud rate with 10 bits per byte,
+ * in steps of one 1 ms frame. Received bytes are reported when the line has
+ * been idle for the rest of a frame or the rx buffer is full.
+ */
+
+#define UART_SIM_MAX_WIRE_RX_BYTES 4096
+
+struct uart_sim_t {
+	struct device dev;
+	/* Called with each byte the UART sends on the wire. */
+	void (*wire_rx_cb)(struct uart_sim_t *uart, uint8_t byte);
+	uint32_t baudrate;
+	uart_callback_t callback;
+	void *user_data;
+
+	/* The write in progress, if any. */
+	const uint8_t *tx_buf;
+	uint32_t tx_len;
+	uint32_t tx_pos;
+	/* Bytes that can be sent in thousandths of a byte. */
+	uint32_t tx_credit;
+
+	/* Bytes sent to the UART on the wire, waiting to be received. */
+	uint8_t wire_tx_bytes[UART_SIM_MAX_WIRE_RX_BYTES];
+	uint32_t wire_tx_head;
+	uint32_t wire_tx_count;
+	uint32_t rx_credit;
+	int rx_enabled;
+	uint8_t *rx_buf;
+	uint32_t rx_len;
+	uint32_t rx_pos;
+	/* The number of bytes in rx_buf already reported with UART_RX_RDY. */
+	uint32_t rx_reported;
+	uint8_t *rx_next_buf;
+	uint32_t rx_next_len;
+	/* Bytes lost because receiving was disabled. */
+	uint32_t num_rx_overruns;
+};
+
+void uart_sim_init(struct uart_sim_t *uart, void (*wire_rx_cb)(struct uart_sim_t *uart, uint8_t byte));
+/**
+ * Sends bytes on the wire to the UART.
+ * @return 0 on success, -ENOBUFS if the bytes don't fit.
+ */
+int uart_sim_wire_tx(struct uart_sim_t *uart, const uint8_t *bytes, uint32_t num_bytes);
+/* The number of bytes sent on the wire to the UART not yet received. */
+uint32_t uart_sim_wire_tx_pending(struct uart_sim_t *uart);
+/* Moves one frame's worth of bytes in both directions and invokes the callback. */
+void uart_sim_run_frame(struct uart_sim_t *uart);
+
+#endif
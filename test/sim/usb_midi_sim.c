@@ -0,0 +1,328 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include "usb_midi_backend.h"
+#include "usb_midi_sim.h"
+
+#define MAX_HOST_TX_TRANSFERS 64
+#define MAX_WORK_ITEMS 4
+
+struct sim_transfer_t {
+	uint8_t data[EP_MAX_PACKET_SIZE];
+	uint32_t size;
+};
+
+static struct usb_midi_sim_config_t sim_config;
+static struct usb_midi_sim_stats_t sim_stats;
+static int sim_is_available = 0;
+static int sim_fail_next_write_error = 0;
+
+/* The IN transfer in flight, if any. */
+static struct sim_transfer_t in_transfer;
+static int in_in_flight = 0;
+
+/* Transfers queued by the host for the OUT endpoint. */
+static struct sim_transfer_t host_tx_transfers[MAX_HOST_TX_TRANSFERS];
+static int host_tx_head = 0;
+static int host_tx_count = 0;
+/* Set when the OUT endpoint is ready to receive a transfer. */
+static int out_armed = 0;
+/* Set while usb_midi_on_out_data may read the transfer at host_tx_head. */
+static int out_readable = 0;
+
+static struct k_work_delayable *pending_work[MAX_WORK_ITEMS];
+static int num_pending_work = 0;
+
+struct k_work_q k_sys_work_q;
+
+/* The thread defined with K_THREAD_DEFINE, if any. */
+static struct {
+	k_thread_entry_t entry;
+	void *params[3];
+	pthread_t pthread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* Set while the thread runs and the calling thread waits. */
+	int is_running;
+	/* The semaphore the thread is blocked on, if any, and until when. -1 means forever. */
+	struct k_sem *waiting_sem;
+	int64_t wake_ticks;
+} sim_thread = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* Not reset by usb_midi_sim_init, since time never goes backwards. */
+static int64_t sim_uptime_ticks = 0;
+static uint32_t sim_frame_start_cycles = 0;
+static uint32_t sim_cycles = 0;
+
+void usb_midi_sim_init(const struct usb_midi_sim_config_t *config)
+{
+	sim_config = *config;
+	if (sim_config.in_transfers_per_frame <= 0) {
+		sim_config.in_transfers_per_frame = 1;
+	}
+	if (sim_config.out_transfers_per_frame <= 0) {
+		sim_config.out_transfers_per_frame = 1;
+	}
+	if (sim_config.work_period_frames <= 0) {
+		sim_config.work_period_frames = 1;
+	}
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	sim_fail_next_write_error = 0;
+	in_in_flight = 0;
+	host_tx_head = 0;
+	host_tx_count = 0;
+	/* Work items scheduled before can be scheduled again. */
+	for (int i = 0; i < num_pending_work; i++) {
+		pending_work[i]->is_scheduled = 0;
+	}
+	num_pending_work = 0;
+}
+
+void usb_midi_sim_set_available(int is_available)
+{
+	sim_is_available = is_available;
+	in_in_flight = 0;
+	out_armed = is_available;
+	usb_midi_on_available(is_available);
+}
+
+void usb_midi_sim_fail_next_write(int error)
+{
+	sim_fail_next_write_error = error;
+}
+
+int usb_midi_sim_host_tx(const uint8_t *data, uint32_t num_bytes)
+{
+	if (host_tx_count == MAX_HOST_TX_TRANSFERS || num_bytes > EP_MAX_PACKET_SIZE) {
+		return -ENOBUFS;
+	}
+	struct sim_transfer_t *transfer =
+		&host_tx_transfers[(host_tx_head + host_tx_count) % MAX_HOST_TX_TRANSFERS];
+	memcpy(transfer->data, data, num_bytes);
+	transfer->size = num_bytes;
+	host_tx_count++;
+	return 0;
+}
+
+int usb_midi_sim_host_tx_pending()
+{
+	return host_tx_count;
+}
+
+/* Runs the work items whose delay has passed, in the order they were scheduled. */
+static void run_pending_work()
+{
+	int64_t now = k_uptime_ticks();
+	int num_to_check = num_pending_work;
+	for (int i = 0; i < num_to_check && i < num_pending_work;) {
+		struct k_work_delayable *dwork = pending_work[i];
+		if (dwork->due_ticks > now) {
+			i++;
+			continue;
+		}
+		num_pending_work--;
+		num_to_check--;
+		memmove(&pending_work[i], &pending_work[i + 1], (num_pending_work - i) * sizeof(pending_work[0]));
+		dwork->is_scheduled = 0;
+		dwork->queue->num_items_run++;
+		dwork->work.handler(&dwork->work);
+	}
+}
+
+/* Switches to the thread and waits until it blocks again. */
+static void switch_to_thread()
+{
+	pthread_mutex_lock(&sim_thread.mutex);
+	sim_thread.is_running = 1;
+	pthread_cond_broadcast(&sim_thread.cond);
+	while (sim_thread.is_running) {
+		pthread_cond_wait(&sim_thread.cond, &sim_thread.mutex);
+	}
+	pthread_mutex_unlock(&sim_thread.mutex);
+}
+
+/* Runs the thread while its semaphore has been given or its timeout has passed. */
+static void run_thread()
+{
+	while (sim_thread.waiting_sem &&
+	       (sim_thread.waiting_sem->count > 0 ||
+		(sim_thread.wake_ticks >= 0 && sim_thread.wake_ticks <= sim_uptime_ticks))) {
+		switch_to_thread();
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	pthread_mutex_lock(&sim_thread.mutex);
+	while (!sim_thread.is_running) {
+		pthread_cond_wait(&sim_thread.cond, &sim_thread.mutex);
+	}
+	pthread_mutex_unlock(&sim_thread.mutex);
+	sim_thread.entry(sim_thread.params[0], sim_thread.params[1], sim_thread.params[2]);
+	return NULL;
+}
+
+void usb_midi_sim_thread_create(k_thread_entry_t entry, void *p1, void *p2, void *p3)
+{
+	sim_thread.entry = entry;
+	sim_thread.params[0] = p1;
+	sim_thread.params[1] = p2;
+	sim_thread.params[2] = p3;
+	pthread_create(&sim_thread.pthread, NULL, thread_main, NULL);
+	/* Run it until it blocks, like a thread started without delay. */
+	switch_to_thread();
+}
+
+void k_sem_give(struct k_sem *sem)
+{
+	if (sem->count < sem->limit) {
+		sem->count++;
+	}
+}
+
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout)
+{
+	if (sem->count == 0 && timeout.ticks != 0) {
+		/* Block, i.e let the calling thread continue until run_thread resumes this one. */
+		pthread_mutex_lock(&sim_thread.mutex);
+		sim_thread.waiting_sem = sem;
+		sim_thread.wake_ticks = timeout.ticks < 0 ? -1 : sim_uptime_ticks + timeout.ticks;
+		sim_thread.is_running = 0;
+		pthread_cond_broadcast(&sim_thread.cond);
+		while (!sim_thread.is_running) {
+			pthread_cond_wait(&sim_thread.cond, &sim_thread.mutex);
+		}
+		sim_thread.waiting_sem = NULL;
+		pthread_mutex_unlock(&sim_thread.mutex);
+	}
+	if (sem->count == 0) {
+		return timeout.ticks == 0 ? -EBUSY : -EAGAIN;
+	}
+	sem->count--;
+	return 0;
+}
+
+void usb_midi_sim_run_frame()
+{
+	sim_stats.num_frames++;
+	sim_uptime_ticks += CONFIG_SYS_CLOCK_TICKS_PER_SEC / 1000;
+	sim_frame_start_cycles += USB_MIDI_SIM_CYCLES_PER_FRAME;
+	sim_cycles = sim_frame_start_cycles;
+	usb_midi_on_sof();
+
+	for (int i = 0; i < sim_config.in_transfers_per_frame && in_in_flight; i++) {
+		in_in_flight = 0;
+		sim_stats.num_in_transfers++;
+		sim_stats.num_in_bytes += in_transfer.size;
+		if (sim_config.host_rx_cb) {
+			sim_config.host_rx_cb(in_transfer.data, in_transfer.size);
+		}
+		usb_midi_on_in_done();
+	}
+
+	for (int i = 0; i < sim_config.out_transfers_per_frame && host_tx_count > 0; i++) {
+		if (!sim_is_available || !out_armed) {
+			sim_stats.num_out_naks++;
+			break;
+		}
+		out_armed = 0;
+		out_readable = 1;
+		sim_cycles = sim_frame_start_cycles + (i + 1) * USB_MIDI_SIM_OUT_CYCLES;
+		usb_midi_on_out_data();
+		out_readable = 0;
+		/* Like the thread preempting once the endpoint callback returns. */
+		run_thread();
+	}
+
+	if (sim_stats.num_frames % sim_config.work_period_frames == 0) {
+		run_pending_work();
+	}
+	run_thread();
+}
+
+int usb_midi_sim_in_flight()
+{
+	return in_in_flight;
+}
+
+const struct usb_midi_sim_stats_t *usb_midi_sim_stats()
+{
+	return &sim_stats;
+}
+
+int usb_midi_backend_write(const uint8_t *data, uint32_t num_bytes)
+{
+	if (!sim_is_available) {
+		return -EIO;
+	}
+	if (sim_fail_next_write_error) {
+		int error = sim_fail_next_write_error;
+		sim_fail_next_write_error = 0;
+		return error;
+	}
+	if (in_in_flight || (sim_config.busy_percent > 0 && rand() % 100 < sim_config.busy_percent)) {
+		sim_stats.num_busy_writes++;
+		return -EAGAIN;
+	}
+	if (num_bytes > EP_MAX_PACKET_SIZE) {
+		return -EINVAL;
+	}
+	memcpy(in_transfer.data, data, num_bytes);
+	in_transfer.size = num_bytes;
+	in_in_flight = 1;
+	return 0;
+}
+
+int usb_midi_backend_read_wait(uint8_t *data, uint32_t max_num_bytes, uint32_t *num_read_bytes)
+{
+	if (!out_readable || host_tx_count == 0) {
+		*num_read_bytes = 0;
+		return -EIO;
+	}
+	struct sim_transfer_t *transfer = &host_tx_transfers[host_tx_head];
+	uint32_t num_bytes = MIN(max_num_bytes, transfer->size);
+	memcpy(data, transfer->data, num_bytes);
+	*num_read_bytes = num_bytes;
+	host_tx_head = (host_tx_head + 1) % MAX_HOST_TX_TRANSFERS;
+	host_tx_count--;
+	out_readable = 0;
+	sim_stats.num_out_transfers++;
+	return 0;
+}
+
+int usb_midi_backend_read_continue()
+{
+	out_armed = 1;
+	return 0;
+}
+
+int k_work_schedule(struct k_work_delayable *dwork, k_timeout_t delay)
+{
+	return k_work_schedule_for_queue(&k_sys_work_q, dwork, delay);
+}
+
+int k_work_schedule_for_queue(struct k_work_q *queue, struct k_work_delayable *dwork,
+			      k_timeout_t delay)
+{
+	if (dwork->is_scheduled) {
+		return 0;
+	}
+	dwork->queue = queue;
+	if (num_pending_work == MAX_WORK_ITEMS) {
+		return -ENOMEM;
+	}
+	dwork->is_scheduled = 1;
+	dwork->due_ticks = sim_uptime_ticks + delay.ticks;
+	pending_work[num_pending_work++] = dwork;
+	return 1;
+}
+
+int64_t k_uptime_ticks()
+{
+	return sim_uptime_ticks;
+}
+
+uint32_t k_cycle_get_32()
+{
+	return sim_cycles;
+}
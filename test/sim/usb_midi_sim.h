@@ -0,0 +1,68 @@
+#ifndef USB_MIDI_SIM_H_
+#define USB_MIDI_SIM_H_
+
+#include <stdint.h>
+
+/*
+ * An in-memory stand-in for the USB MIDI endpoint backend, for running the
+ * driver on a PC. Everything runs in the calling thread, or in lockstep with
+ * it, see K_THREAD_DEFINE in zephyr/kernel.h. Endpoint completions are invoked
+ * from usb_midi_sim_run_frame, like the USB stack would invoke them from its
+ * endpoint callbacks.
+ */
+
+/*
+ * k_cycle_get_32 advances by USB_MIDI_SIM_CYCLES_PER_FRAME per frame. The n:th
+ * OUT transfer delivered in a frame, counting from zero, arrives
+ * (n + 1) * USB_MIDI_SIM_OUT_CYCLES cycles after the start of the frame.
+ */
+/* I.e 64 MHz, as returned by sys_clock_hw_cycles_per_sec. */
+#define USB_MIDI_SIM_CYCLES_PER_FRAME 64000
+#define USB_MIDI_SIM_OUT_CYCLES 1000
+
+struct usb_midi_sim_config_t {
+	/* Max number of IN transfers completed per 1 ms frame. */
+	int in_transfers_per_frame;
+	/* Max number of OUT transfers delivered per 1 ms frame. */
+	int out_transfers_per_frame;
+	/* Probability in percent that a write to an idle IN endpoint fails with -EAGAIN. */
+	int busy_percent;
+	/* Pending work items are run every work_period_frames frames. */
+	int work_period_frames;
+	/* Called with each IN transfer received by the host. */
+	void (*host_rx_cb)(const uint8_t *data, uint32_t num_bytes);
+};
+
+struct usb_midi_sim_stats_t {
+	uint32_t num_frames;
+	uint32_t num_in_transfers;
+	uint32_t num_in_bytes;
+	/* Writes failing with -EAGAIN, because of a transfer in flight or busy_percent. */
+	uint32_t num_busy_writes;
+	uint32_t num_out_transfers;
+	/* Frames in which the host had an OUT transfer to send but was NAKed. */
+	uint32_t num_out_naks;
+};
+
+void usb_midi_sim_init(const struct usb_midi_sim_config_t *config);
+/* Makes the device available/unavailable. A transfer in flight is lost when unavailable. */
+void usb_midi_sim_set_available(int is_available);
+/* Makes the next write to the IN endpoint fail with the given error. */
+void usb_midi_sim_fail_next_write(int error);
+/**
+ * Queues a transfer for the host to send on the OUT endpoint.
+ * @return 0 on success, -ENOBUFS if the host's queue is full.
+ */
+int usb_midi_sim_host_tx(const uint8_t *data, uint32_t num_bytes);
+/* The number of transfers queued by usb_midi_sim_host_tx not yet delivered. */
+int usb_midi_sim_host_tx_pending();
+/**
+ * Runs one frame: completes IN transfers, delivers OUT transfers if the
+ * endpoint is ready and runs pending work items.
+ */
+void usb_midi_sim_run_frame();
+/* Indicates if an IN transfer is in flight. */
+int usb_midi_sim_in_flight();
+const struct usb_midi_sim_stats_t *usb_midi_sim_stats();
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef USB_MIDI_SIM_ZEPHYR_DEVICE_H_
+#define USB_MIDI_SIM_ZEPHYR_DEVICE_H_
+
+#include <stdbool.h>
+
+/* Stand-in for the Zephyr device model. Devices are implemented by the sim, see uart_sim.h. */
+
+struct device {
+	const char *name;
+	/* State of the device implementation. */
+	void *data;
+};
+
+static inline bool device_is_ready(const struct device *dev)
+{
+	return dev != NULL && dev->data != NULL;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef USB_MIDI_SIM_ZEPHYR_KERNEL_H_
+#define USB_MIDI_SIM_ZEPHYR_KERNEL_H_
+
+/*
+ * Stand-ins for the parts of the Zephyr kernel API used by the USB MIDI
+ * driver core, for building it on a PC together with usb_midi_sim.c.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BUILD_ASSERT(cond, msg) _Static_assert(cond, msg)
+#define IS_POWER_OF_TWO(x) (((x) != 0) && (((x) & ((x) - 1)) == 0))
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define BIT(n) (1UL << (n))
+#define ROUND_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+/* LISTIFY for up to 16 items. The separator is given in parentheses, like in Zephyr. */
+#define SIM_DEBRACKET(...) __VA_ARGS__
+#define LISTIFY(n, F, sep, ...) SIM_LISTIFY(n, F, sep, __VA_ARGS__)
+#define SIM_LISTIFY(n, F, sep, ...) SIM_LISTIFY_##n(F, sep, __VA_ARGS__)
+#define SIM_LISTIFY_0(F, sep, ...)
+#define SIM_LISTIFY_1(F, sep, ...) F(0, __VA_ARGS__)
+#define SIM_LISTIFY_2(F, sep, ...) SIM_LISTIFY_1(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(1, __VA_ARGS__)
+#define SIM_LISTIFY_3(F, sep, ...) SIM_LISTIFY_2(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(2, __VA_ARGS__)
+#define SIM_LISTIFY_4(F, sep, ...) SIM_LISTIFY_3(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(3, __VA_ARGS__)
+#define SIM_LISTIFY_5(F, sep, ...) SIM_LISTIFY_4(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(4, __VA_ARGS__)
+#define SIM_LISTIFY_6(F, sep, ...) SIM_LISTIFY_5(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(5, __VA_ARGS__)
+#define SIM_LISTIFY_7(F, sep, ...) SIM_LISTIFY_6(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(6, __VA_ARGS__)
+#define SIM_LISTIFY_8(F, sep, ...) SIM_LISTIFY_7(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(7, __VA_ARGS__)
+#define SIM_LISTIFY_9(F, sep, ...) SIM_LISTIFY_8(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(8, __VA_ARGS__)
+#define SIM_LISTIFY_10(F, sep, ...) SIM_LISTIFY_9(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(9, __VA_ARGS__)
+#define SIM_LISTIFY_11(F, sep, ...) SIM_LISTIFY_10(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(10, __VA_ARGS__)
+#define SIM_LISTIFY_12(F, sep, ...) SIM_LISTIFY_11(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(11, __VA_ARGS__)
+#define SIM_LISTIFY_13(F, sep, ...) SIM_LISTIFY_12(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(12, __VA_ARGS__)
+#define SIM_LISTIFY_14(F, sep, ...) SIM_LISTIFY_13(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(13, __VA_ARGS__)
+#define SIM_LISTIFY_15(F, sep, ...) SIM_LISTIFY_14(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(14, __VA_ARGS__)
+#define SIM_LISTIFY_16(F, sep, ...) SIM_LISTIFY_15(F, sep, __VA_ARGS__) SIM_DEBRACKET sep F(15, __VA_ARGS__)
+
+typedef long atomic_t;
+#define ATOMIC_INIT(i) (i)
+
+static inline atomic_t atomic_get(const atomic_t *target)
+{
+	return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+
+static inline atomic_t atomic_set(atomic_t *target, atomic_t value)
+{
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+static inline atomic_t atomic_clear(atomic_t *target)
+{
+	return atomic_set(target, 0);
+}
+
+static inline bool atomic_cas(atomic_t *target, atomic_t old_value, atomic_t new_value)
+{
+	return __atomic_compare_exchange_n(target, &old_value, new_value, false, __ATOMIC_SEQ_CST,
+					   __ATOMIC_SEQ_CST);
+}
+
+/* Spins on an atomic flag, so the tx producers can run in threads of their own in tests. */
+struct k_spinlock {
+	atomic_t locked;
+};
+typedef int k_spinlock_key_t;
+
+static inline k_spinlock_key_t k_spin_lock(struct k_spinlock *lock)
+{
+	while (!atomic_cas(&lock->locked, 0, 1)) {
+	}
+	return 0;
+}
+
+static inline void k_spin_unlock(struct k_spinlock *lock, k_spinlock_key_t key)
+{
+	atomic_clear(&lock->locked);
+}
+
+/* Time advances by one millisecond per usb_midi_sim_run_frame call. */
+#ifndef CONFIG_SYS_CLOCK_TICKS_PER_SEC
+#define CONFIG_SYS_CLOCK_TICKS_PER_SEC 10000
+#endif
+
+typedef struct {
+	int64_t ticks;
+} k_timeout_t;
+
+#define K_NO_WAIT ((k_timeout_t){0})
+#define K_FOREVER ((k_timeout_t){-1})
+#define K_TICKS(t) ((k_timeout_t){(t)})
+#define K_MSEC(ms) ((k_timeout_t){(ms) * CONFIG_SYS_CLOCK_TICKS_PER_SEC / 1000})
+#define K_USEC(us) ((k_timeout_t){((us) * CONFIG_SYS_CLOCK_TICKS_PER_SEC + 999999) / 1000000})
+#define SYS_FOREVER_US (-1)
+
+int64_t k_uptime_ticks();
+/* Runs at USB_MIDI_SIM_CYCLES_PER_FRAME cycles per frame, see usb_midi_sim.h. */
+uint32_t k_cycle_get_32();
+static inline uint32_t sys_clock_hw_cycles_per_sec()
+{
+	return 64000000;
+}
+
+/* Work items are run by usb_midi_sim_run_frame once their delay has passed. */
+struct k_work;
+typedef void (*k_work_handler_t)(struct k_work *work);
+
+struct k_work {
+	k_work_handler_t handler;
+};
+
+/* Work queues only count the items run for them. */
+struct k_work_q {
+	uint32_t num_items_run;
+};
+
+extern struct k_work_q k_sys_work_q;
+
+struct k_work_delayable {
+	struct k_work work;
+	int is_scheduled;
+	int64_t due_ticks;
+	struct k_work_q *queue;
+};
+
+#define K_WORK_DELAYABLE_DEFINE(dwork, work_handler)                                               \
+	struct k_work_delayable dwork = {.work = {.handler = work_handler}}
+
+int k_work_schedule(struct k_work_delayable *dwork, k_timeout_t delay);
+int k_work_schedule_for_queue(struct k_work_q *queue, struct k_work_delayable *dwork,
+			      k_timeout_t delay);
+
+/*
+ * A thread runs in lockstep with the one calling usb_midi_sim_run_frame, i.e only
+ * one of them runs at a time. While blocked in k_sem_take, it's resumed after each
+ * delivered OUT transfer and at the end of each frame, if the semaphore was given
+ * or the timeout has passed. Only one thread can be defined.
+ */
+struct k_sem {
+	unsigned int count;
+	unsigned int limit;
+};
+
+#define K_SEM_DEFINE(name, initial_count, count_limit)                                             \
+	struct k_sem name = {.count = (initial_count), .limit = (count_limit)}
+
+void k_sem_give(struct k_sem *sem);
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout);
+
+typedef void (*k_thread_entry_t)(void *p1, void *p2, void *p3);
+void usb_midi_sim_thread_create(k_thread_entry_t entry, void *p1, void *p2, void *p3);
+
+#define K_THREAD_DEFINE(name, stack_size, entry, p1, p2, p3, prio, options, delay)                 \
+	static void __attribute__((constructor)) name##_create(void)                               \
+	{                                                                                          \
+		usb_midi_sim_thread_create(entry, p1, p2, p3);                                     \
+	}
+
+/* A pool of fixed size blocks. The free list is set up on the first allocation. */
+struct k_mem_slab {
+	char *buffer;
+	size_t block_size;
+	uint32_t num_blocks;
+	uint32_t num_used;
+	void *free_list;
+	int is_initialized;
+};
+
+#define K_MEM_SLAB_DEFINE_STATIC(name, slab_block_size, slab_num_blocks, slab_align)               \
+	static char __attribute__((aligned(slab_align)))                                           \
+	name##_buffer[(slab_block_size) * (slab_num_blocks)];                                      \
+	static struct k_mem_slab name = {                                                          \
+		.buffer = name##_buffer, .block_size = (slab_block_size), .num_blocks = (slab_num_blocks)}
+
+static inline int k_mem_slab_alloc(struct k_mem_slab *slab, void **mem, k_timeout_t timeout)
+{
+	if (!slab->is_initialized) {
+		slab->free_list = NULL;
+		for (uint32_t i = slab->num_blocks; i > 0; i--) {
+			char *block = slab->buffer + (i - 1) * slab->block_size;
+			*(void **)block = slab->free_list;
+			slab->free_list = block;
+		}
+		slab->is_initialized = 1;
+	}
+	if (!slab->free_list) {
+		*mem = NULL;
+		return -ENOMEM;
+	}
+	*mem = slab->free_list;
+	slab->free_list = *(void **)slab->free_list;
+	slab->num_used++;
+	return 0;
+}
+
+static inline void k_mem_slab_free(struct k_mem_slab *slab, void *mem)
+{
+	*(void **)mem = slab->free_list;
+	slab->free_list = mem;
+	slab->num_used--;
+}
+
+static inline uint32_t k_mem_slab_num_free_get(struct k_mem_slab *slab)
+{
+	return slab->num_blocks - slab->num_used;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef USB_MIDI_SIM_ZEPHYR_LOG_H_
+#define USB_MIDI_SIM_ZEPHYR_LOG_H_
+
+#include <stdio.h>
+
+/*
+ * Log messages are discarded, unless USB_MIDI_SIM_LOG is defined, in which
+ * case errors and warnings are printed.
+ */
+
+#define LOG_MODULE_REGISTER(name, level) extern int usb_midi_sim_log_module_##name
+#define LOG_MODULE_DECLARE(name, level) extern int usb_midi_sim_log_module_##name
+
+#ifdef USB_MIDI_SIM_LOG
+#define USB_MIDI_SIM_LOG_PRINT(level, ...)                                                         \
+	do {                                                                                       \
+		printf(level ": " __VA_ARGS__);                                                    \
+		printf("\n");                                                                      \
+	} while (0)
+#else
+#define USB_MIDI_SIM_LOG_PRINT(level, ...)                                                         \
+	do {                                                                                       \
+		if (0) {                                                                           \
+			printf(__VA_ARGS__);                                                       \
+		}                                                                                  \
+	} while (0)
+#endif
+
+#define LOG_ERR(...) USB_MIDI_SIM_LOG_PRINT("error", __VA_ARGS__)
+#define LOG_WRN(...) USB_MIDI_SIM_LOG_PRINT("warning", __VA_ARGS__)
+#define LOG_INF(...) USB_MIDI_SIM_LOG_PRINT("info", __VA_ARGS__)
+#define LOG_DBG(...)                                                                               \
+	do {                                                                                       \
+		if (0) {                                                                           \
+			printf(__VA_ARGS__);                                                       \
+		}                                                                                  \
+	} while (0)
+
+#endif
@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <usb_midi/usb_midi.h>
+#include <usb_midi/usb_midi_din.h>
+#include "../usb_midi/src/usb_midi_backend.h"
+#include "../usb_midi/src/usb_midi_din_hooks.h"
+#include "../usb_midi/src/usb_midi_packet.h"
+#include "../usb_midi/src/usb_midi_stream.h"
+#include "sim/uart_sim.h"
+#include "sim/usb_midi_sim.h"
+
+/*
+ * Tests and benchmarks of the DIN bridge, running the driver on top of the
+ * in-memory endpoint backend with each DIN port driven by an emulated UART.
+ * Measures throughput and latency per port in both directions, in 1 ms frames.
+ */
+
+int num_failed_assertions = 0;
+
+static void assert(int condition, const char *msg)
+{
+	if (!condition) {
+		num_failed_assertions++;
+		printf("❌ Assertion failed: %s\n", msg);
+	}
+}
+
+#define NUM_PORTS 2
+#define SEQ_MASK 0x3fff
+#define SYSEX_MSG_SIZE 200
+#define NOTES_PER_SYSEX 100
+#define DIN_BYTES_PER_SEC 3125
+
+static void seq_msg(uint32_t seq, uint8_t *msg)
+{
+	msg[0] = 0x90;
+	msg[1] = seq & 0x7f;
+	msg[2] = (seq >> 7) & 0x7f;
+}
+
+static uint32_t seq_from_msg(const uint8_t *msg)
+{
+	return msg[1] | (msg[2] << 7);
+}
+
+static uint8_t sysex_msg[SYSEX_MSG_SIZE];
+
+static void init_sysex_msg()
+{
+	sysex_msg[0] = 0xf0;
+	for (int i = 1; i < SYSEX_MSG_SIZE - 1; i++) {
+		sysex_msg[i] = (5 * i) % 128;
+	}
+	sysex_msg[SYSEX_MSG_SIZE - 1] = 0xf7;
+}
+
+/* Checks a stream of sequence numbered notes, sysex messages and clocks received on a port. */
+struct checker_t {
+	uint32_t next_seq;
+	uint32_t num_notes;
+	uint32_t num_clocks;
+	uint32_t num_sysex;
+	uint32_t num_errors;
+	int in_sysex;
+	uint32_t sysex_size;
+	/* Frame in which the last note was received. */
+	uint32_t last_note_frame;
+	/* Total MIDI bytes of received messages, without running status. */
+	uint32_t num_bytes;
+	/* The last non-realtime message received. */
+	uint8_t last_msg[3];
+};
+
+static struct uart_sim_t uarts[NUM_PORTS];
+/* Checkers of the bytes written by the DIN ports and of the messages received by the host. */
+static struct checker_t wire_rx[NUM_PORTS];
+static struct checker_t host_rx[NUM_PORTS];
+/* Never reset, since the ports keep their running status between tests. */
+static struct usb_midi_stream_parser_t wire_parsers[NUM_PORTS];
+static uint32_t num_wire_bytes[NUM_PORTS];
+/* The checkers message callbacks are invoked for. */
+static struct checker_t *checkers;
+
+static void check_message(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	struct checker_t *c = &checkers[cable_num];
+	if (bytes[0] == 0xf8) {
+		c->num_clocks++;
+		c->num_bytes++;
+		return;
+	}
+	memcpy(c->last_msg, bytes, num_bytes);
+	if (bytes[0] != 0x90 || num_bytes != 3 || seq_from_msg(bytes) != c->next_seq) {
+		c->num_errors++;
+	}
+	c->next_seq = (seq_from_msg(bytes) + 1) & SEQ_MASK;
+	c->num_notes++;
+	c->num_bytes += 3;
+	c->last_note_frame = usb_midi_sim_stats()->num_frames;
+}
+
+static void check_sysex_start(uint8_t cable_num)
+{
+	struct checker_t *c = &checkers[cable_num];
+	if (c->in_sysex) {
+		c->num_errors++;
+	}
+	c->in_sysex = 1;
+	c->sysex_size = 1;
+}
+
+static void check_sysex_data(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	struct checker_t *c = &checkers[cable_num];
+	for (int i = 0; i < num_data_bytes; i++) {
+		if (!c->in_sysex || c->sysex_size >= SYSEX_MSG_SIZE - 1 ||
+		    data_bytes[i] != sysex_msg[c->sysex_size]) {
+			c->num_errors++;
+		}
+		c->sysex_size++;
+	}
+}
+
+static void check_sysex_end(uint8_t cable_num)
+{
+	struct checker_t *c = &checkers[cable_num];
+	if (!c->in_sysex || c->sysex_size + 1 != SYSEX_MSG_SIZE) {
+		c->num_errors++;
+	}
+	c->in_sysex = 0;
+	c->num_sysex++;
+	c->num_bytes += SYSEX_MSG_SIZE;
+}
+
+static struct usb_midi_parse_cb_t check_cb = {.message_cb = check_message,
+						    .sysex_start_cb = check_sysex_start,
+						    .sysex_data_cb = check_sysex_data,
+						    .sysex_end_cb = check_sysex_end};
+
+static void wire_rx_cb(struct uart_sim_t *uart, uint8_t byte)
+{
+	int port = uart - uarts;
+	num_wire_bytes[port]++;
+	checkers = wire_rx;
+	usb_midi_stream_parse_byte(&wire_parsers[port], byte, port, &check_cb);
+}
+
+static void host_rx_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	uint8_t packets[EP_MAX_PACKET_SIZE];
+	memcpy(packets, data, num_bytes);
+	checkers = host_rx;
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		usb_midi_parse_packet(&packets[i], &check_cb);
+	}
+}
+
+/* Generates the packets or bytes of a stream of sequence numbered notes with sysex messages in between. */
+struct generator_t {
+	uint32_t next_seq;
+	/* The number of notes and sysex messages generated. */
+	uint32_t num_msgs;
+	/* The number of bytes of the current sysex message generated so far, 0 if none. */
+	uint32_t sysex_pos;
+};
+
+static struct generator_t generators[NUM_PORTS];
+
+static void next_packet(struct generator_t *g, uint8_t cable_num, uint8_t *packet)
+{
+	if (g->sysex_pos == 0 && g->num_msgs % (NOTES_PER_SYSEX + 1) != NOTES_PER_SYSEX) {
+		uint8_t msg[3];
+		seq_msg(g->next_seq, msg);
+		g->next_seq = (g->next_seq + 1) & SEQ_MASK;
+		g->num_msgs++;
+		struct usb_midi_packet_t p;
+		usb_midi_packet_from_midi_bytes(msg, cable_num, &p);
+		memcpy(packet, p.bytes, 4);
+		return;
+	}
+	uint32_t num_bytes = SYSEX_MSG_SIZE - g->sysex_pos < 3 ? SYSEX_MSG_SIZE - g->sysex_pos : 3;
+	uint8_t cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+	if (g->sysex_pos + num_bytes == SYSEX_MSG_SIZE) {
+		cin = num_bytes == 1 ? USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE :
+		      num_bytes == 2 ? USB_MIDI_CIN_SYSEX_END_2BYTE :
+				       USB_MIDI_CIN_SYSEX_END_3BYTE;
+	}
+	memset(packet, 0, 4);
+	packet[0] = (cable_num << 4) | cin;
+	memcpy(&packet[1], &sysex_msg[g->sysex_pos], num_bytes);
+	g->sysex_pos += num_bytes;
+	if (g->sysex_pos == SYSEX_MSG_SIZE) {
+		g->sysex_pos = 0;
+		g->num_msgs++;
+	}
+}
+
+/* Queues a transfer with packets for all ports for the host to send. */
+static int host_send_transfer()
+{
+	uint8_t transfer[EP_MAX_PACKET_SIZE];
+	struct generator_t saved[NUM_PORTS];
+	memcpy(saved, generators, sizeof(saved));
+	for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+		next_packet(&generators[i % NUM_PORTS], i % NUM_PORTS, &transfer[4 * i]);
+	}
+	int result = usb_midi_sim_host_tx(transfer, sizeof(transfer));
+	if (result != 0) {
+		memcpy(generators, saved, sizeof(saved));
+	}
+	return result;
+}
+
+static void run_frame()
+{
+	usb_midi_sim_run_frame();
+	for (int i = 0; i < NUM_PORTS; i++) {
+		uart_sim_run_frame(&uarts[i]);
+	}
+}
+
+static void run_frames(int num_frames)
+{
+	for (int i = 0; i < num_frames; i++) {
+		run_frame();
+	}
+}
+
+static void reset()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .out_transfers_per_frame = 1,
+					       .host_rx_cb = host_rx_cb};
+	usb_midi_sim_set_available(0);
+	usb_midi_sim_init(&config);
+	usb_midi_sim_set_available(1);
+	/* Let bytes from previous tests drain */
+	run_frames(1000);
+	memset(wire_rx, 0, sizeof(wire_rx));
+	memset(host_rx, 0, sizeof(host_rx));
+	memset(generators, 0, sizeof(generators));
+	memset(num_wire_bytes, 0, sizeof(num_wire_bytes));
+}
+
+static void print_port_stats(const char *name)
+{
+	for (int i = 0; i < NUM_PORTS; i++) {
+		struct usb_midi_din_stats_t stats;
+		usb_midi_din_port_stats(i, &stats);
+		printf("%s port %d: %u tx bytes (%u dropped), %u rx bytes (%u dropped), %u uart errors\n",
+		       name, i, stats.num_tx_bytes, stats.num_tx_dropped_bytes, stats.num_rx_bytes,
+		       stats.num_rx_dropped_bytes, stats.num_uart_errors);
+	}
+}
+
+static int ports_dropped_bytes()
+{
+	int num_dropped = 0;
+	for (int i = 0; i < NUM_PORTS; i++) {
+		struct usb_midi_din_stats_t stats;
+		usb_midi_din_port_stats(i, &stats);
+		num_dropped += stats.num_tx_dropped_bytes + stats.num_rx_dropped_bytes;
+	}
+	return num_dropped;
+}
+
+static void test_add_port()
+{
+	struct uart_sim_t uart;
+	uart_sim_init(&uart, wire_rx_cb);
+	assert(usb_midi_din_add_port(16, &uart.dev) == -EINVAL,
+	       "adding a port with an invalid cable number should fail");
+	assert(usb_midi_din_add_port(0, NULL) == -ENODEV, "adding a port without a uart should fail");
+	/* A UART that is already receiving fails to enable rx. */
+	uart_sim_init(&uarts[0], wire_rx_cb);
+	uarts[0].rx_enabled = 1;
+	assert(usb_midi_din_add_port(0, &uarts[0].dev) == -EBUSY,
+	       "adding a port should fail if the uart fails to enable rx");
+
+	for (int i = 0; i < NUM_PORTS; i++) {
+		uart_sim_init(&uarts[i], wire_rx_cb);
+		assert(usb_midi_din_add_port(i, &uarts[i].dev) == 0, "adding a port should succeed");
+		assert(uarts[i].baudrate == 31250, "the uart should be configured for MIDI");
+	}
+	assert(usb_midi_din_add_port(0, &uart.dev) == -EINVAL,
+	       "adding a port for a bridged cable should fail");
+	/* The cable after the ports is an output only, i.e its port only sends to the host. */
+	static struct uart_sim_t output_only_uart;
+	uart_sim_init(&output_only_uart, wire_rx_cb);
+	assert(usb_midi_din_add_port(NUM_PORTS, &output_only_uart.dev) == 0,
+	       "adding a port for an output only cable should succeed");
+	assert(usb_midi_din_add_port(NUM_PORTS, &uart.dev) == -EINVAL,
+	       "adding a port for a bridged output only cable should fail");
+	assert(usb_midi_din_add_port(NUM_PORTS + 1, &uart.dev) == -ENOMEM,
+	       "adding more ports than configured should fail");
+	struct usb_midi_din_stats_t stats;
+	assert(usb_midi_din_port_stats(NUM_PORTS + 1, &stats) == -EINVAL,
+	       "getting stats of a missing port should fail");
+}
+
+/* Has the host send notes and sysex messages to both ports as fast as they are accepted. */
+static void test_host_to_din_throughput()
+{
+	reset();
+	int num_frames = 20000;
+	for (int frame = 0; frame < num_frames; frame++) {
+		while (usb_midi_sim_host_tx_pending() < 4 && host_send_transfer() == 0) {
+		}
+		run_frame();
+	}
+	/* Finish sysex messages in progress */
+	for (int i = 0; i < NUM_PORTS; i++) {
+		while (generators[i].sysex_pos > 0) {
+			uint8_t packet[4];
+			next_packet(&generators[i], i, packet);
+			while (usb_midi_sim_host_tx(packet, 4) != 0) {
+				run_frame();
+			}
+		}
+	}
+	uint32_t num_bytes[NUM_PORTS];
+	for (int i = 0; i < NUM_PORTS; i++) {
+		num_bytes[i] = wire_rx[i].num_bytes;
+	}
+	run_frames(2000);
+
+	for (int i = 0; i < NUM_PORTS; i++) {
+		assert(wire_rx[i].num_notes + wire_rx[i].num_sysex == generators[i].num_msgs,
+		       "each port should write all messages sent by the host");
+		assert(wire_rx[i].num_errors == 0, "each port should write intact messages in order");
+		/* The host is paced by the rx rate limit, which counts full messages */
+		assert(num_bytes[i] > 0.95 * DIN_BYTES_PER_SEC * num_frames / 1000,
+		       "each port should write messages at the rate limit");
+		assert(num_wire_bytes[i] < num_bytes[i], "running status should save wire bytes");
+		printf("host to DIN port %d: %u notes, %u sysex, %.0f MIDI bytes/s in %.0f wire bytes/s\n", i,
+		       wire_rx[i].num_notes, wire_rx[i].num_sysex, 1000.0 * num_bytes[i] / num_frames,
+		       1000.0 * num_wire_bytes[i] / (num_frames + 2000));
+	}
+	assert(ports_dropped_bytes() == 0, "no bytes should be dropped when rate limited");
+	print_port_stats("host to DIN");
+}
+
+/* Injects notes with running status, clocks and sysex messages into both ports at line rate. */
+static void test_din_to_host_throughput()
+{
+	reset();
+	int num_frames = 20000;
+	uint32_t num_injected[NUM_PORTS] = {0};
+	int running_status[NUM_PORTS] = {0};
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int i = 0; i < NUM_PORTS; i++) {
+			while (uart_sim_wire_tx_pending(&uarts[i]) < 8) {
+				uint8_t packet[4];
+				next_packet(&generators[i], i, packet);
+				uint8_t *bytes = &packet[1];
+				uint8_t num_bytes = usb_midi_cin_num_midi_bytes(packet[0] & 0xf);
+				/* Running status for consecutive notes */
+				int is_note = packet[1] == 0x90;
+				if (is_note && running_status[i]) {
+					bytes++;
+					num_bytes--;
+				}
+				running_status[i] = is_note || (running_status[i] && packet[1] < 0x80);
+				if (rand() % 4 == 0) {
+					uint8_t clock = 0xf8;
+					uart_sim_wire_tx(&uarts[i], &clock, 1);
+					num_injected[i]++;
+				}
+				uart_sim_wire_tx(&uarts[i], bytes, num_bytes);
+				num_injected[i] += num_bytes;
+			}
+		}
+		run_frame();
+	}
+	for (int i = 0; i < NUM_PORTS; i++) {
+		while (generators[i].sysex_pos > 0) {
+			uint8_t packet[4];
+			next_packet(&generators[i], i, packet);
+			uart_sim_wire_tx(&uarts[i], &packet[1], usb_midi_cin_num_midi_bytes(packet[0] & 0xf));
+			run_frame();
+		}
+	}
+	run_frames(1000);
+
+	for (int i = 0; i < NUM_PORTS; i++) {
+		assert(host_rx[i].num_notes + host_rx[i].num_sysex == generators[i].num_msgs,
+		       "the host should receive all messages written to each port");
+		assert(host_rx[i].num_errors == 0, "the host should receive intact messages in order");
+		assert(host_rx[i].num_clocks > 0, "the host should receive clocks");
+		assert(uarts[i].num_rx_overruns == 0, "the uarts should always have an rx buffer");
+		printf("DIN port %d to host: %u notes, %u sysex, %u clocks, %.0f wire bytes/s\n", i,
+		       host_rx[i].num_notes, host_rx[i].num_sysex, host_rx[i].num_clocks,
+		       1000.0 * num_injected[i] / num_frames);
+	}
+	assert(ports_dropped_bytes() == 0, "no bytes should be dropped");
+	print_port_stats("DIN to host");
+}
+
+/*
+ * Measures the time from the host sending a note until the last byte leaves a
+ * DIN port, and from the last byte of a note arriving at a DIN port until the
+ * host receives it, with one note at a time.
+ */
+static void bench_latency()
+{
+	reset();
+	int num_notes = 200;
+	uint32_t total[2][NUM_PORTS] = {0};
+	uint32_t max[2][NUM_PORTS] = {0};
+	for (int n = 0; n < num_notes; n++) {
+		int port = n % NUM_PORTS;
+		struct generator_t *g = &generators[port];
+		uint8_t packet[4];
+		uint8_t msg[3];
+		seq_msg(g->next_seq++, msg);
+		struct usb_midi_packet_t p;
+		usb_midi_packet_from_midi_bytes(msg, port, &p);
+		memcpy(packet, p.bytes, 4);
+
+		/* Host to DIN */
+		uint32_t start = usb_midi_sim_stats()->num_frames;
+		usb_midi_sim_host_tx(packet, 4);
+		uint32_t num_notes_before = wire_rx[port].num_notes;
+		for (int i = 0; i < 20 && wire_rx[port].num_notes == num_notes_before; i++) {
+			run_frame();
+		}
+		uint32_t latency = wire_rx[port].last_note_frame - start;
+		total[0][port] += latency;
+		if (latency > max[0][port]) {
+			max[0][port] = latency;
+		}
+		run_frames(5);
+
+		/* DIN to host, always with the status byte since the port has been idle */
+		start = usb_midi_sim_stats()->num_frames;
+		uart_sim_wire_tx(&uarts[port], msg, 3);
+		num_notes_before = host_rx[port].num_notes;
+		for (int i = 0; i < 20 && host_rx[port].num_notes == num_notes_before; i++) {
+			run_frame();
+		}
+		latency = host_rx[port].last_note_frame - start;
+		total[1][port] += latency;
+		if (latency > max[1][port]) {
+			max[1][port] = latency;
+		}
+		run_frames(5);
+	}
+
+	for (int i = 0; i < NUM_PORTS; i++) {
+		assert(wire_rx[i].num_notes == num_notes / NUM_PORTS && wire_rx[i].num_errors == 0,
+		       "each port should write all notes");
+		assert(host_rx[i].num_notes == num_notes / NUM_PORTS && host_rx[i].num_errors == 0,
+		       "the host should receive all notes");
+		/* 3 bytes take a frame on the wire, plus a frame for the transfer and one for dispatching */
+		assert(max[0][i] <= 4 && max[1][i] <= 4, "latency should be a few ms");
+		printf("latency port %d: host to DIN %.1f ms (max %u), DIN to host %.1f ms (max %u)\n", i,
+		       (double)total[0][i] / (num_notes / NUM_PORTS), max[0][i],
+		       (double)total[1][i] / (num_notes / NUM_PORTS), max[1][i]);
+	}
+}
+
+/*
+ * Overflows the tx buffer of a port so a note off is dropped, and checks that
+ * the next note off is written with its status byte, since the one of the
+ * dropped message never went out.
+ */
+static void test_running_status_after_drop()
+{
+	reset();
+	uint8_t note_on[3] = {0x90, 0x40, 0x7f};
+	uint8_t note_off[3] = {0x80, 0x40, 0};
+	struct usb_midi_din_stats_t before;
+	usb_midi_din_port_stats(0, &before);
+	for (int i = 0; i < CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE; i++) {
+		usb_midi_din_on_rx_message(0, note_on, 3);
+	}
+	usb_midi_din_on_rx_message(0, note_off, 3);
+	struct usb_midi_din_stats_t after;
+	usb_midi_din_port_stats(0, &after);
+	assert(after.num_tx_dropped_bytes - before.num_tx_dropped_bytes >= 3,
+	       "messages should be dropped when the tx buffer is full");
+	run_frames(1000);
+
+	note_off[1] = 0x41;
+	usb_midi_din_on_rx_message(0, note_off, 3);
+	run_frames(10);
+	assert(memcmp(wire_rx[0].last_msg, note_off, 3) == 0,
+	       "the message after a dropped one should be written with its status byte");
+
+	/* Likewise after dropped sysex bytes */
+	for (int i = 0; i < CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE; i++) {
+		usb_midi_din_on_rx_message(0, note_on, 3);
+	}
+	uint8_t sysex[3] = {0xf0, 0x01, 0xf7};
+	usb_midi_din_on_rx_sysex(0, sysex, 3);
+	run_frames(1000);
+	usb_midi_din_on_rx_message(0, note_off, 3);
+	run_frames(10);
+	assert(memcmp(wire_rx[0].last_msg, note_off, 3) == 0,
+	       "the message after dropped sysex bytes should be written with its status byte");
+}
+
+int main(int argc, char *argv[])
+{
+	init_sysex_msg();
+	test_add_port();
+	test_host_to_din_throughput();
+	test_din_to_host_throughput();
+	bench_latency();
+	/* Last, since it drops bytes on purpose */
+	test_running_status_after_drop();
+
+	if (num_failed_assertions > 0) {
+		printf("❌ %d failed assertions.\n", num_failed_assertions);
+		return 1;
+	} else {
+		printf("✅ No failed assertions.\n");
+	}
+	return 0;
+}
@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../usb_midi/src/usb_midi_packet.h"
+#include "../usb_midi/src/usb_midi_stream.h"
+
+/*
+ * Compares the table driven usb_midi_packet_from_midi_bytes against the
+ * switch based implementation it replaced. The reference implementation
+ * below is a verbatim copy of the old encoder.
+ *
+ * Also times the packet codec functions and the parser the driver uses, i.e
+ * the stream parser for CIN 0xF packets, over a few realistic workloads and
+ * reports ns/packet and the number of heap allocations. If a file name is
+ * passed as the first argument, the results are written to it as CSV.
+ */
+
+#define SYSEX_START_BYTE 0xF0
+#define SYSEX_END_BYTE	 0xF7
+#define IS_DATA_BYTE(b) (b < 0x80)
+
+static enum usb_midi_error_t ref_channel_msg_cin(uint8_t first_byte, uint8_t *cin)
+{
+	uint8_t high_nibble = first_byte >> 4;
+
+	switch (high_nibble) {
+	case 0x8:
+	case 0x9:
+	case 0xa:
+	case 0xb:
+	case 0xe:
+		*cin = high_nibble;
+		break;
+	case 0xc:
+	case 0xd:
+		*cin = high_nibble;
+		break;
+	default:
+		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+static enum usb_midi_error_t ref_non_sysex_system_msg_cin(uint8_t first_byte, uint8_t *cin)
+{
+	switch (first_byte) {
+	case 0xf1:
+	case 0xf3:
+		*cin = USB_MIDI_CIN_SYSCOM_2BYTE;
+		break;
+	case 0xf2:
+		*cin = USB_MIDI_CIN_SYSCOM_3BYTE;
+		break;
+	case 0xf6:
+		*cin = USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE;
+		break;
+	case 0xf8:
+	case 0xfa:
+	case 0xfb:
+	case 0xfc:
+	case 0xfe:
+	case 0xff:
+		*cin = USB_MIDI_CIN_1BYTE_DATA;
+		break;
+	default:
+		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+static enum usb_midi_error_t ref_sysex_msg_cin(uint8_t *midi_bytes, uint8_t *cin)
+{
+	int is_data_byte[3] = {IS_DATA_BYTE(midi_bytes[0]), IS_DATA_BYTE(midi_bytes[1]), IS_DATA_BYTE(midi_bytes[2])};
+
+	if (midi_bytes[0] == SYSEX_START_BYTE) {
+		if (midi_bytes[1] == SYSEX_END_BYTE) {
+			*cin = USB_MIDI_CIN_SYSEX_END_2BYTE;
+		} else if (is_data_byte[1]) {
+			if (midi_bytes[2] == SYSEX_END_BYTE) {
+				*cin = USB_MIDI_CIN_SYSEX_END_3BYTE;
+			} else if (is_data_byte[2]) {
+				*cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+			}
+		}
+	} else if (is_data_byte[0]) {
+		if (is_data_byte[1]) {
+			if (is_data_byte[2]) {
+				*cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+			} else if (midi_bytes[2] == SYSEX_END_BYTE) {
+				*cin = USB_MIDI_CIN_SYSEX_END_3BYTE;
+			}
+		} else if (midi_bytes[1] == SYSEX_END_BYTE) {
+			*cin = USB_MIDI_CIN_SYSEX_END_2BYTE;
+		}
+	} else if (midi_bytes[0] == SYSEX_END_BYTE) {
+		*cin = USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE;
+	} else {
+		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+static uint8_t ref_num_midi_bytes_for_cin(uint8_t cin)
+{
+	switch (cin) {
+	case USB_MIDI_CIN_MISC:
+	case USB_MIDI_CIN_CABLE_EVENT:
+		return 0;
+	case USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE:
+	case USB_MIDI_CIN_1BYTE_DATA:
+		return 1;
+	case USB_MIDI_CIN_SYSCOM_2BYTE:
+	case USB_MIDI_CIN_SYSEX_END_2BYTE:
+	case USB_MIDI_CIN_PROGRAM_CHANGE:
+	case USB_MIDI_CIN_CHANNEL_PRESSURE:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+static enum usb_midi_error_t ref_packet_from_midi_bytes(uint8_t *midi_bytes, uint8_t cable_num,
+							struct usb_midi_packet_t *packet)
+{
+	if (cable_num >= 16) {
+		return USB_MIDI_ERROR_INVALID_CABLE_NUM;
+	}
+
+	packet->cable_num = cable_num;
+	packet->cin = 0;
+	packet->num_midi_bytes = 0;
+
+	enum usb_midi_error_t cin_error = ref_channel_msg_cin(midi_bytes[0], &packet->cin);
+	if (cin_error != USB_MIDI_SUCCESS) {
+		cin_error = ref_non_sysex_system_msg_cin(midi_bytes[0], &packet->cin);
+	}
+	if (cin_error != USB_MIDI_SUCCESS) {
+		cin_error = ref_sysex_msg_cin(midi_bytes, &packet->cin);
+	}
+
+	packet->num_midi_bytes = ref_num_midi_bytes_for_cin(packet->cin);
+
+	if (cin_error != USB_MIDI_SUCCESS || packet->num_midi_bytes == 0) {
+		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+
+	packet->bytes[0] = (packet->cable_num << 4) | packet->cin;
+	packet->bytes[1] = 0;
+	packet->bytes[2] = 0;
+	packet->bytes[3] = 0;
+	for (int i = 0; i < packet->num_midi_bytes; i++) {
+		packet->bytes[i + 1] = midi_bytes[i];
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+typedef enum usb_midi_error_t (*encoder_t)(uint8_t *midi_bytes, uint8_t cable_num,
+					   struct usb_midi_packet_t *packet);
+
+/*
+ * Runs both encoders on every possible three byte input and a few cable numbers
+ * and checks that the results are identical. Returns the number of mismatches.
+ */
+static int check_equivalence()
+{
+	int num_mismatches = 0;
+	uint8_t cable_nums[] = {0, 7, 15, 16};
+
+	for (int c = 0; c < sizeof(cable_nums); c++) {
+		for (uint32_t i = 0; i < (1 << 24); i++) {
+			uint8_t msg[3] = {i >> 16, (i >> 8) & 0xff, i & 0xff};
+			struct usb_midi_packet_t expected;
+			struct usb_midi_packet_t actual;
+			memset(&expected, 0xaa, sizeof(expected));
+			memset(&actual, 0xaa, sizeof(actual));
+			enum usb_midi_error_t expected_rc =
+				ref_packet_from_midi_bytes(msg, cable_nums[c], &expected);
+			enum usb_midi_error_t actual_rc =
+				usb_midi_packet_from_midi_bytes(msg, cable_nums[c], &actual);
+			if (expected_rc != actual_rc ||
+			    memcmp(&expected, &actual, sizeof(expected)) != 0) {
+				if (num_mismatches < 10) {
+					printf("❌ Mismatch for %02x %02x %02x, cable %d\n", msg[0],
+					       msg[1], msg[2], cable_nums[c]);
+				}
+				num_mismatches++;
+			}
+		}
+	}
+
+	return num_mismatches;
+}
+
+static double now_s()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* A mix of channel messages, system messages and sysex chunks. */
+static uint8_t bench_messages[][3] = {
+	{0x90, 0x45, 0x7f}, {0x80, 0x45, 0x00}, {0xb0, 0x07, 0x64}, {0xe0, 0x00, 0x40},
+	{0xc3, 0x12, 0x00}, {0xd1, 0x33, 0x00}, {0xa2, 0x3c, 0x10}, {0xf8, 0x00, 0x00},
+	{0xf2, 0x01, 0x02}, {0xf1, 0x31, 0x00}, {0xfe, 0x00, 0x00}, {0xf6, 0x00, 0x00},
+	{0xf0, 0x7e, 0x01}, {0x11, 0x22, 0x33}, {0x44, 0x55, 0x66}, {0x77, 0xf7, 0x00},
+	{0xf0, 0x01, 0xf7}, {0x01, 0x02, 0xf7}, {0xf7, 0x00, 0x00}, {0xf0, 0xf7, 0x00},
+};
+
+static double packets_per_s(encoder_t encoder, int num_rounds)
+{
+	int num_messages = sizeof(bench_messages) / 3;
+	volatile uint8_t sink = 0;
+	struct usb_midi_packet_t packet;
+
+	double t0 = now_s();
+	for (int r = 0; r < num_rounds; r++) {
+		for (int i = 0; i < num_messages; i++) {
+			encoder(bench_messages[i], r & 0xf, &packet);
+			sink ^= packet.bytes[0];
+		}
+	}
+	double dt = now_s() - t0;
+	(void)sink;
+
+	return dt > 0 ? (double)num_rounds * num_messages / dt : 0;
+}
+
+/*
+ * Heap allocation counting. Linked with -Wl,--wrap=malloc etc, so that
+ * allocations made by the codec end up here.
+ */
+static int num_allocations = 0;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	num_allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+	num_allocations++;
+	return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	num_allocations++;
+	return __real_realloc(ptr, size);
+}
+
+#define MAX_WORKLOAD_PACKETS 4096
+#define NUM_WORKLOAD_ROUNDS 2000
+
+struct workload_t {
+	const char *name;
+	int num_packets;
+	/* Zero if the workload can't be expressed as input to usb_midi_packet_from_midi_bytes. */
+	int has_midi_bytes;
+	/*
+	 * Set if the packets carry a raw byte stream in CIN 0xF packets, which the
+	 * driver parses with usb_midi_stream_parse_byte instead of usb_midi_parse_packet.
+	 */
+	int is_byte_stream;
+	uint8_t midi_bytes[MAX_WORKLOAD_PACKETS][3];
+	uint8_t usb_bytes[MAX_WORKLOAD_PACKETS][4];
+};
+
+static void workload_add(struct workload_t *workload, uint8_t cable_num, uint8_t b0, uint8_t b1,
+			 uint8_t b2)
+{
+	struct usb_midi_packet_t packet;
+	int idx = workload->num_packets++;
+	uint8_t *midi_bytes = workload->midi_bytes[idx];
+	midi_bytes[0] = b0;
+	midi_bytes[1] = b1;
+	midi_bytes[2] = b2;
+	if (usb_midi_packet_from_midi_bytes(midi_bytes, cable_num, &packet) != USB_MIDI_SUCCESS) {
+		printf("❌ Invalid workload message %02x %02x %02x\n", b0, b1, b2);
+		exit(1);
+	}
+	memcpy(workload->usb_bytes[idx], packet.bytes, 4);
+}
+
+/* Note on/off pairs on all channels, spread over four cables. */
+static void init_note_flood(struct workload_t *workload)
+{
+	workload->name = "note_flood";
+	workload->has_midi_bytes = 1;
+	for (int i = 0; i < MAX_WORKLOAD_PACKETS; i++) {
+		uint8_t status = (i % 2 == 0 ? 0x90 : 0x80) | ((i / 2) % 16);
+		workload_add(workload, (i / 32) % 4, status, (i / 2) % 128, i % 2 == 0 ? 100 : 0);
+	}
+}
+
+/* Control change value sweeps on a few controllers. */
+static void init_cc_sweep(struct workload_t *workload)
+{
+	workload->name = "cc_sweep";
+	workload->has_midi_bytes = 1;
+	uint8_t controllers[] = {1, 7, 10, 11, 74};
+	for (int i = 0; i < MAX_WORKLOAD_PACKETS; i++) {
+		uint8_t controller = controllers[(i / 128) % sizeof(controllers)];
+		workload_add(workload, 0, 0xb0 | ((i / 640) % 16), controller, i % 128);
+	}
+}
+
+/* A single sysex message, split into three byte chunks. */
+static void init_long_sysex(struct workload_t *workload)
+{
+	workload->name = "long_sysex";
+	workload->has_midi_bytes = 1;
+	for (int i = 0; i < MAX_WORKLOAD_PACKETS; i++) {
+		uint8_t bytes[3];
+		for (int j = 0; j < 3; j++) {
+			bytes[j] = (3 * i + j) % 128;
+		}
+		if (i == 0) {
+			bytes[0] = 0xf0;
+		} else if (i == MAX_WORKLOAD_PACKETS - 1) {
+			bytes[2] = 0xf7;
+		}
+		workload_add(workload, 1, bytes[0], bytes[1], bytes[2]);
+	}
+}
+
+/*
+ * Notes sent one byte per packet with CIN 0xF, like some hosts do, with
+ * interleaved timing clocks.
+ */
+static void init_cin_f_stream(struct workload_t *workload)
+{
+	workload->name = "cin_f_stream";
+	workload->has_midi_bytes = 0;
+	workload->is_byte_stream = 1;
+	for (int i = 0; i < MAX_WORKLOAD_PACKETS; i++) {
+		uint8_t byte;
+		if (i % 8 == 7) {
+			byte = 0xf8;
+		} else {
+			int note_byte_idx = i - i / 8;
+			switch (note_byte_idx % 3) {
+			case 0:
+				byte = 0x90;
+				break;
+			case 1:
+				byte = (note_byte_idx / 3) % 128;
+				break;
+			default:
+				byte = 64;
+				break;
+			}
+		}
+		uint8_t *usb_bytes = workload->usb_bytes[workload->num_packets++];
+		usb_bytes[0] = USB_MIDI_CIN_1BYTE_DATA;
+		usb_bytes[1] = byte;
+		usb_bytes[2] = 0;
+		usb_bytes[3] = 0;
+	}
+}
+
+static volatile uint32_t parse_sink = 0;
+
+static void bench_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	parse_sink += bytes[0] + num_bytes + cable_num;
+}
+
+static void bench_sysex_start_cb(uint8_t cable_num)
+{
+	parse_sink += cable_num;
+}
+
+static void bench_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	parse_sink += data_bytes[0] + num_data_bytes;
+}
+
+static void bench_sysex_end_cb(uint8_t cable_num)
+{
+	parse_sink += cable_num;
+}
+
+enum bench_function_t {
+	BENCH_FROM_MIDI_BYTES,
+	BENCH_FROM_USB_BYTES,
+	BENCH_PARSE_PACKET,
+	BENCH_PARSE_STREAM,
+	NUM_BENCH_FUNCTIONS
+};
+
+static const char *bench_function_names[NUM_BENCH_FUNCTIONS] = {
+	"usb_midi_packet_from_midi_bytes", "usb_midi_packet_from_usb_bytes",
+	"usb_midi_parse_packet", "usb_midi_stream_parse_byte"};
+
+struct bench_result_t {
+	double ns_per_packet;
+	int num_allocations;
+};
+
+static struct bench_result_t run_bench(struct workload_t *workload, enum bench_function_t function)
+{
+	struct usb_midi_parse_cb_t parse_cb = {.message_cb = bench_message_cb,
+					       .sysex_start_cb = bench_sysex_start_cb,
+					       .sysex_data_cb = bench_sysex_data_cb,
+					       .sysex_end_cb = bench_sysex_end_cb};
+	struct usb_midi_packet_t packet;
+	struct usb_midi_stream_parser_t stream_parsers[16];
+	memset(stream_parsers, 0, sizeof(stream_parsers));
+	volatile uint8_t sink = 0;
+
+	num_allocations = 0;
+	double t0 = now_s();
+	for (int r = 0; r < NUM_WORKLOAD_ROUNDS; r++) {
+		for (int i = 0; i < workload->num_packets; i++) {
+			switch (function) {
+			case BENCH_FROM_MIDI_BYTES:
+				usb_midi_packet_from_midi_bytes(workload->midi_bytes[i],
+								workload->usb_bytes[i][0] >> 4,
+								&packet);
+				sink ^= packet.bytes[0];
+				break;
+			case BENCH_FROM_USB_BYTES:
+				usb_midi_packet_from_usb_bytes(workload->usb_bytes[i], &packet);
+				sink ^= packet.num_midi_bytes;
+				break;
+			case BENCH_PARSE_PACKET:
+				usb_midi_parse_packet(workload->usb_bytes[i], &parse_cb);
+				break;
+			default: {
+				/* Like the driver's rx path, which feeds CIN 0xF packets to a per cable parser */
+				uint8_t *usb_bytes = workload->usb_bytes[i];
+				uint8_t cable_num = usb_bytes[0] >> 4;
+				usb_midi_stream_parse_byte(&stream_parsers[cable_num], usb_bytes[1],
+							   cable_num, &parse_cb);
+				break;
+			}
+			}
+		}
+	}
+	double dt = now_s() - t0;
+	(void)sink;
+
+	struct bench_result_t result = {
+		.ns_per_packet = 1e9 * dt / ((double)NUM_WORKLOAD_ROUNDS * workload->num_packets),
+		.num_allocations = num_allocations};
+	return result;
+}
+
+static int run_workload_benchmarks(const char *csv_path)
+{
+	static struct workload_t workloads[4];
+	init_note_flood(&workloads[0]);
+	init_cc_sweep(&workloads[1]);
+	init_long_sysex(&workloads[2]);
+	init_cin_f_stream(&workloads[3]);
+
+	FILE *csv = NULL;
+	if (csv_path) {
+		csv = fopen(csv_path, "w");
+		if (!csv) {
+			printf("❌ Failed to open %s\n", csv_path);
+			return 1;
+		}
+		fprintf(csv, "workload,function,num_packets,ns_per_packet,num_allocations\n");
+	}
+
+	printf("\n%-14s %-32s %12s %12s\n", "workload", "function", "ns/packet", "allocations");
+	for (int w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		struct workload_t *workload = &workloads[w];
+		for (int f = 0; f < NUM_BENCH_FUNCTIONS; f++) {
+			if (f == BENCH_FROM_MIDI_BYTES && !workload->has_midi_bytes) {
+				continue;
+			}
+			/* Each workload is parsed the way the driver parses it. */
+			if ((f == BENCH_PARSE_PACKET && workload->is_byte_stream) ||
+			    (f == BENCH_PARSE_STREAM && !workload->is_byte_stream)) {
+				continue;
+			}
+			struct bench_result_t result = run_bench(workload, f);
+			printf("%-14s %-32s %12.2f %12d\n", workload->name, bench_function_names[f],
+			       result.ns_per_packet, result.num_allocations);
+			if (csv) {
+				fprintf(csv, "%s,%s,%d,%.3f,%d\n", workload->name,
+					bench_function_names[f],
+					NUM_WORKLOAD_ROUNDS * workload->num_packets,
+					result.ns_per_packet, result.num_allocations);
+			}
+		}
+	}
+
+	if (csv) {
+		fclose(csv);
+		printf("Results written to %s\n", csv_path);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int num_mismatches = check_equivalence();
+	if (num_mismatches > 0) {
+		printf("❌ %d mismatches between table driven and reference encoder.\n",
+		       num_mismatches);
+		return 1;
+	}
+	printf("✅ Table driven encoder matches reference encoder on all inputs.\n");
+
+	int num_rounds = 2000000;
+	double ref_rate = packets_per_s(ref_packet_from_midi_bytes, num_rounds);
+	double table_rate = packets_per_s(usb_midi_packet_from_midi_bytes, num_rounds);
+	printf("usb_midi_packet_from_midi_bytes, reference: %.1f Mpackets/s\n", ref_rate * 1e-6);
+	printf("usb_midi_packet_from_midi_bytes, table:     %.1f Mpackets/s (%.2fx)\n",
+	       table_rate * 1e-6, ref_rate > 0 ? table_rate / ref_rate : 0);
+
+	return run_workload_benchmarks(argc > 1 ? argv[1] : NULL);
+}
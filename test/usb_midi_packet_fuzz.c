@@ -0,0 +1,327 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../usb_midi/src/usb_midi_packet.h"
+#include "../usb_midi/src/usb_midi_stream.h"
+
+/*
+ * Fuzz harness for the packet codec. Built with clang -fsanitize=fuzzer it's
+ * a libFuzzer target. Built with -DUSB_MIDI_FUZZ_STANDALONE it has its own
+ * main, which runs the inputs in the files passed as arguments (this is how
+ * AFL runs it) or, with -t, mutates them for a number of seconds and reports
+ * the throughput. See run_fuzz.sh.
+ *
+ * The input is used as a stream of USB MIDI event packets for the parser,
+ * as a stream of (cable number, 3 MIDI bytes) records for the encoder and
+ * as a raw MIDI byte stream for the stream parser. Violated invariants abort.
+ */
+
+#define FUZZ_CHECK(condition)                                                                      \
+	do {                                                                                       \
+		if (!(condition)) {                                                                \
+			fprintf(stderr, "Fuzz check failed at line %d: %s\n", __LINE__, #condition); \
+			abort();                                                                   \
+		}                                                                                  \
+	} while (0)
+
+/* What the parser reported for a packet, as a MIDI byte stream. */
+static struct {
+	const uint8_t *packet_bytes;
+	uint8_t cable_num;
+	uint8_t bytes[8];
+	int num_bytes;
+	int num_callbacks;
+} parsed;
+
+static void check_callback_bytes(const uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	/* Callback bytes must point into the MIDI bytes of the packet */
+	FUZZ_CHECK(num_bytes >= 1 && num_bytes <= 3);
+	FUZZ_CHECK(bytes >= parsed.packet_bytes + 1 && bytes + num_bytes <= parsed.packet_bytes + 4);
+	FUZZ_CHECK(cable_num == parsed.cable_num);
+	parsed.num_callbacks++;
+}
+
+static void append_parsed(uint8_t byte)
+{
+	FUZZ_CHECK(parsed.num_bytes < sizeof(parsed.bytes));
+	parsed.bytes[parsed.num_bytes++] = byte;
+}
+
+static void fuzz_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	check_callback_bytes(bytes, num_bytes, cable_num);
+	for (int i = 0; i < num_bytes; i++) {
+		append_parsed(bytes[i]);
+	}
+}
+
+static void fuzz_sysex_start_cb(uint8_t cable_num)
+{
+	FUZZ_CHECK(cable_num == parsed.cable_num);
+	append_parsed(0xf0);
+}
+
+static void fuzz_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	check_callback_bytes(data_bytes, num_data_bytes, cable_num);
+	for (int i = 0; i < num_data_bytes; i++) {
+		append_parsed(data_bytes[i]);
+	}
+}
+
+static void fuzz_sysex_end_cb(uint8_t cable_num)
+{
+	FUZZ_CHECK(cable_num == parsed.cable_num);
+	append_parsed(0xf7);
+}
+
+static struct usb_midi_parse_cb_t fuzz_parse_cb = {.message_cb = fuzz_message_cb,
+						   .sysex_start_cb = fuzz_sysex_start_cb,
+						   .sysex_data_cb = fuzz_sysex_data_cb,
+						   .sysex_end_cb = fuzz_sysex_end_cb};
+
+static enum usb_midi_error_t parse(uint8_t *packet_bytes)
+{
+	memset(&parsed, 0, sizeof(parsed));
+	parsed.packet_bytes = packet_bytes;
+	parsed.cable_num = packet_bytes[0] >> 4;
+	return usb_midi_parse_packet(packet_bytes, &fuzz_parse_cb);
+}
+
+static void fuzz_parser(const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		uint8_t packet_bytes[4];
+		memcpy(packet_bytes, &data[i], 4);
+
+		struct usb_midi_packet_t packet;
+		enum usb_midi_error_t decode_result =
+			usb_midi_packet_from_usb_bytes(packet_bytes, &packet);
+		enum usb_midi_error_t parse_result = parse(packet_bytes);
+
+		FUZZ_CHECK(decode_result == parse_result);
+		FUZZ_CHECK(memcmp(packet.bytes, packet_bytes, 4) == 0);
+		if (parse_result == USB_MIDI_SUCCESS) {
+			FUZZ_CHECK(packet.num_midi_bytes >= 1 && packet.num_midi_bytes <= 3);
+			FUZZ_CHECK(packet.cable_num == packet_bytes[0] >> 4);
+			FUZZ_CHECK(parsed.num_bytes <= 3);
+		} else {
+			FUZZ_CHECK(parsed.num_bytes == 0 && parsed.num_callbacks == 0);
+		}
+	}
+}
+
+static void fuzz_encoder(const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		/* Cable numbers up to 31, to also hit invalid ones */
+		uint8_t cable_num = data[i] & 0x1f;
+		uint8_t midi_bytes[3];
+		memcpy(midi_bytes, &data[i + 1], 3);
+
+		struct usb_midi_packet_t packet;
+		enum usb_midi_error_t result =
+			usb_midi_packet_from_midi_bytes(midi_bytes, cable_num, &packet);
+		if (cable_num >= 16) {
+			FUZZ_CHECK(result == USB_MIDI_ERROR_INVALID_CABLE_NUM);
+			continue;
+		}
+		if (result != USB_MIDI_SUCCESS) {
+			FUZZ_CHECK(result == USB_MIDI_ERROR_INVALID_MIDI_MSG);
+			continue;
+		}
+
+		/* Encoded packets must be well formed and parse back into the input bytes */
+		FUZZ_CHECK(packet.num_midi_bytes >= 1 && packet.num_midi_bytes <= 3);
+		FUZZ_CHECK(packet.bytes[0] == ((cable_num << 4) | packet.cin));
+		for (int j = packet.num_midi_bytes; j < 3; j++) {
+			FUZZ_CHECK(packet.bytes[j + 1] == 0);
+		}
+		FUZZ_CHECK(parse(packet.bytes) == USB_MIDI_SUCCESS);
+		FUZZ_CHECK(parsed.num_bytes == packet.num_midi_bytes);
+		FUZZ_CHECK(memcmp(parsed.bytes, midi_bytes, packet.num_midi_bytes) == 0);
+	}
+}
+
+/* Stream parser output must be well formed, whatever the input. */
+static int stream_in_sysex = 0;
+
+static void stream_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	FUZZ_CHECK(num_bytes >= 1 && num_bytes <= 3);
+	FUZZ_CHECK(bytes[0] >= 0x80 && bytes[0] != 0xf0 && bytes[0] != 0xf7);
+	uint8_t packet_bytes[4] = {0};
+	struct usb_midi_packet_t packet;
+	memcpy(&packet_bytes[1], bytes, num_bytes);
+	FUZZ_CHECK(usb_midi_packet_from_midi_bytes(&packet_bytes[1], 0, &packet) == USB_MIDI_SUCCESS);
+	FUZZ_CHECK(packet.num_midi_bytes == num_bytes || (bytes[0] >= 0xf8 && num_bytes == 1));
+	for (int i = 1; i < num_bytes; i++) {
+		FUZZ_CHECK(bytes[i] < 0x80);
+	}
+}
+
+static void stream_sysex_start_cb(uint8_t cable_num)
+{
+	FUZZ_CHECK(!stream_in_sysex);
+	stream_in_sysex = 1;
+}
+
+static void stream_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	FUZZ_CHECK(stream_in_sysex);
+	FUZZ_CHECK(num_data_bytes == 1 && data_bytes[0] < 0x80);
+}
+
+static void stream_sysex_end_cb(uint8_t cable_num)
+{
+	FUZZ_CHECK(stream_in_sysex);
+	stream_in_sysex = 0;
+}
+
+static void fuzz_stream_parser(const uint8_t *data, size_t size)
+{
+	struct usb_midi_parse_cb_t stream_cb = {.message_cb = stream_message_cb,
+						.sysex_start_cb = stream_sysex_start_cb,
+						.sysex_data_cb = stream_sysex_data_cb,
+						.sysex_end_cb = stream_sysex_end_cb};
+	struct usb_midi_stream_parser_t parser;
+	usb_midi_stream_parser_init(&parser);
+	stream_in_sysex = 0;
+	for (size_t i = 0; i < size; i++) {
+		usb_midi_stream_parse_byte(&parser, data[i], 0, &stream_cb);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	fuzz_parser(data, size);
+	fuzz_encoder(data, size);
+	fuzz_stream_parser(data, size);
+	return 0;
+}
+
+#ifdef USB_MIDI_FUZZ_STANDALONE
+#include <time.h>
+
+#define MAX_INPUT_SIZE 4096
+#define MAX_NUM_SEEDS 256
+
+static double now_s()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static size_t read_file(const char *path, uint8_t *dest, size_t max_size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		exit(1);
+	}
+	size_t size = fread(dest, 1, max_size, f);
+	fclose(f);
+	return size;
+}
+
+/* Random byte flips, insertions and deletions of 4 byte records. */
+static size_t mutate(uint8_t *data, size_t size)
+{
+	int num_mutations = 1 + rand() % 8;
+	for (int i = 0; i < num_mutations; i++) {
+		switch (rand() % 4) {
+		case 0:
+			if (size > 0) {
+				data[rand() % size] ^= 1 << (rand() % 8);
+			}
+			break;
+		case 1:
+			if (size > 0) {
+				data[rand() % size] = rand();
+			}
+			break;
+		case 2:
+			if (size + 4 <= MAX_INPUT_SIZE) {
+				size_t pos = size > 0 ? 4 * (rand() % (size / 4 + 1)) : 0;
+				pos = pos > size ? size : pos;
+				memmove(&data[pos + 4], &data[pos], size - pos);
+				for (int j = 0; j < 4; j++) {
+					data[pos + j] = rand();
+				}
+				size += 4;
+			}
+			break;
+		default:
+			if (size >= 4) {
+				size_t pos = 4 * (rand() % (size / 4));
+				memmove(&data[pos], &data[pos + 4], size - pos - 4);
+				size -= 4;
+			}
+			break;
+		}
+	}
+	return size;
+}
+
+/*
+ * usb_midi_packet_fuzz [-t seconds] [-m min execs/s] files...
+ * Runs each file once. With -t, then keeps mutating them for the given
+ * number of seconds and fails if the throughput is below -m.
+ */
+int main(int argc, char *argv[])
+{
+	static uint8_t seeds[MAX_NUM_SEEDS][MAX_INPUT_SIZE];
+	static size_t seed_sizes[MAX_NUM_SEEDS];
+	int num_seeds = 0;
+	double duration_s = 0;
+	double min_execs_per_s = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			duration_s = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			min_execs_per_s = atof(argv[++i]);
+		} else if (num_seeds < MAX_NUM_SEEDS) {
+			seed_sizes[num_seeds] = read_file(argv[i], seeds[num_seeds], MAX_INPUT_SIZE);
+			LLVMFuzzerTestOneInput(seeds[num_seeds], seed_sizes[num_seeds]);
+			num_seeds++;
+		}
+	}
+	printf("Ran %d inputs\n", num_seeds);
+	if (duration_s <= 0) {
+		return 0;
+	}
+
+	uint8_t input[MAX_INPUT_SIZE];
+	uint64_t num_execs = 0;
+	double t0 = now_s();
+	double elapsed_s = 0;
+	srand(1);
+	while (elapsed_s < duration_s) {
+		for (int i = 0; i < 1000; i++) {
+			size_t size = 0;
+			if (num_seeds > 0) {
+				int seed_idx = rand() % num_seeds;
+				size = seed_sizes[seed_idx];
+				memcpy(input, seeds[seed_idx], size);
+			}
+			size = mutate(input, size);
+			LLVMFuzzerTestOneInput(input, size);
+			num_execs++;
+		}
+		elapsed_s = now_s() - t0;
+	}
+
+	double execs_per_s = num_execs / elapsed_s;
+	printf("%llu execs in %.1f s, %.0f execs/s\n", (unsigned long long)num_execs, elapsed_s,
+	       execs_per_s);
+	if (execs_per_s < min_execs_per_s) {
+		printf("❌ Throughput below target of %.0f execs/s\n", min_execs_per_s);
+		return 1;
+	}
+	return 0;
+}
+#endif
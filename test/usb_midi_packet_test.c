@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <string.h>
 #include "../usb_midi/src/usb_midi_packet.h"
+#include "../usb_midi/src/usb_midi_stream.h"
 
 int num_failed_assertions = 0;
 
@@ -210,11 +212,96 @@ static void test_parse_sysex() {
     }
 }
 
+/*
+ * Stream parser callbacks are logged as 'M', num bytes, bytes for messages,
+ * 'S' for sysex start, 'D', byte for sysex data and 'E' for sysex end.
+ */
+static uint8_t stream_log[256];
+static int stream_log_size = 0;
+
+static void stream_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+    stream_log[stream_log_size++] = 'M';
+    stream_log[stream_log_size++] = num_bytes;
+    for (int i = 0; i < num_bytes; i++) {
+        stream_log[stream_log_size++] = bytes[i];
+    }
+}
+
+static void stream_sysex_start_cb(uint8_t cable_num)
+{
+    stream_log[stream_log_size++] = 'S';
+}
+
+static void stream_sysex_data_cb(uint8_t* data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+    for (int i = 0; i < num_data_bytes; i++) {
+        stream_log[stream_log_size++] = 'D';
+        stream_log[stream_log_size++] = data_bytes[i];
+    }
+}
+
+static void stream_sysex_end_cb(uint8_t cable_num)
+{
+    stream_log[stream_log_size++] = 'E';
+}
+
+static void check_stream(const uint8_t *bytes, int num_bytes, const uint8_t *expected_log,
+                         int expected_log_size, const char *msg)
+{
+    struct usb_midi_parse_cb_t stream_cb = {
+        .message_cb = stream_message_cb,
+        .sysex_start_cb = stream_sysex_start_cb,
+        .sysex_data_cb = stream_sysex_data_cb,
+        .sysex_end_cb = stream_sysex_end_cb,
+    };
+    struct usb_midi_stream_parser_t parser;
+    usb_midi_stream_parser_init(&parser);
+    stream_log_size = 0;
+    for (int i = 0; i < num_bytes; i++) {
+        usb_midi_stream_parse_byte(&parser, bytes[i], 0, &stream_cb);
+    }
+    assert(stream_log_size == expected_log_size &&
+           memcmp(stream_log, expected_log, expected_log_size) == 0, msg);
+}
+
+#define CHECK_STREAM(bytes, expected_log, msg) \
+    check_stream(bytes, sizeof(bytes), expected_log, sizeof(expected_log), msg)
+
+static void test_stream_parser() {
+    uint8_t running_status[] = { 0x90, 0x3c, 0x40, 0x3e, 0x41, 0xc0, 0x05, 0x06 };
+    uint8_t running_status_log[] = { 'M', 3, 0x90, 0x3c, 0x40, 'M', 3, 0x90, 0x3e, 0x41,
+                                     'M', 2, 0xc0, 0x05, 'M', 2, 0xc0, 0x06 };
+    CHECK_STREAM(running_status, running_status_log, "stream parser should handle running status");
+
+    uint8_t realtime[] = { 0x90, 0x3c, 0xf8, 0x40, 0xfa };
+    uint8_t realtime_log[] = { 'M', 1, 0xf8, 'M', 3, 0x90, 0x3c, 0x40, 'M', 1, 0xfa };
+    CHECK_STREAM(realtime, realtime_log, "stream parser should pass interleaved realtime bytes");
+
+    uint8_t sysex[] = { 0xf0, 0x01, 0xf8, 0x02, 0xf7 };
+    uint8_t sysex_log[] = { 'S', 'D', 0x01, 'M', 1, 0xf8, 'D', 0x02, 'E' };
+    CHECK_STREAM(sysex, sysex_log, "stream parser should handle realtime bytes in sysex");
+
+    uint8_t truncated_sysex[] = { 0xf0, 0x01, 0x90, 0x3c, 0x40 };
+    uint8_t truncated_sysex_log[] = { 'S', 'D', 0x01, 'E', 'M', 3, 0x90, 0x3c, 0x40 };
+    CHECK_STREAM(truncated_sysex, truncated_sysex_log, "status bytes should end sysex");
+
+    uint8_t system_common[] = { 0x90, 0x3c, 0x40, 0xf3, 0x05, 0x3e, 0x40, 0xf2, 0x01, 0x02 };
+    uint8_t system_common_log[] = { 'M', 3, 0x90, 0x3c, 0x40, 'M', 2, 0xf3, 0x05,
+                                    'M', 3, 0xf2, 0x01, 0x02 };
+    CHECK_STREAM(system_common, system_common_log, "system common messages should cancel running status");
+
+    uint8_t invalid[] = { 0x01, 0xf4, 0x02, 0xf7, 0x03, 0xf9, 0xf6, 0x04 };
+    uint8_t invalid_log[] = { 'M', 1, 0xf6 };
+    CHECK_STREAM(invalid, invalid_log, "stream parser should ignore stray and undefined bytes");
+}
+
 int main(int argc, char *argv[])
 {
     test_packet_from_midi_bytes();
     test_parse_sysex();
     test_parse_non_sysex();
+    test_stream_parser();
 
     if (num_failed_assertions > 0) {
         printf("❌ %d failed assertions.\n", num_failed_assertions);
@@ -0,0 +1,1737 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <usb_midi/usb_midi.h>
+#include <usb_midi/usb_midi_clock.h>
+#include "../usb_midi/src/usb_midi_backend.h"
+#include "../usb_midi/src/usb_midi_packet.h"
+#include "sim/usb_midi_sim.h"
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+#include <zephyr/kernel.h>
+#endif
+
+/*
+ * Load tests running the driver on top of the in-memory endpoint backend.
+ * Messages carry sequence numbers, so the receiving side can check that
+ * nothing is lost, duplicated or reordered.
+ */
+
+int num_failed_assertions = 0;
+
+static void assert(int condition, const char *msg)
+{
+	if (!condition) {
+		num_failed_assertions++;
+		printf("❌ Assertion failed: %s\n", msg);
+	}
+}
+
+#define NUM_CABLES CONFIG_USB_MIDI_NUM_OUTPUTS
+#define SEQ_MASK 0x3fff
+#define SYSEX_MSG_SIZE 1000
+
+/* A note on message with a 14 bit sequence number in the data bytes. */
+static void seq_msg(uint32_t seq, uint8_t *msg)
+{
+	msg[0] = 0x90;
+	msg[1] = seq & 0x7f;
+	msg[2] = (seq >> 7) & 0x7f;
+}
+
+static uint32_t seq_from_msg(const uint8_t *msg)
+{
+	return msg[1] | (msg[2] << 7);
+}
+
+static uint8_t sysex_msg[SYSEX_MSG_SIZE];
+
+static void init_sysex_msg()
+{
+	sysex_msg[0] = 0xf0;
+	for (int i = 1; i < SYSEX_MSG_SIZE - 1; i++) {
+		sysex_msg[i] = (7 * i) % 128;
+	}
+	sysex_msg[SYSEX_MSG_SIZE - 1] = 0xf7;
+}
+
+/* Host side state, checking what the device sends. */
+static struct {
+	uint32_t next_seq[16];
+	uint32_t num_messages;
+	uint32_t num_cable_messages[16];
+	uint32_t num_seq_errors;
+	uint32_t num_realtime_messages;
+	/* Messages other than sequence numbered note ons and realtime messages */
+	uint8_t other_messages[16][3];
+	uint32_t num_other_messages;
+	int in_sysex;
+	uint32_t sysex_size;
+	uint32_t num_sysex_errors;
+	uint32_t num_sysex_messages;
+} host_rx;
+
+static void host_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	if (bytes[0] >= 0xf8) {
+		host_rx.num_realtime_messages++;
+		return;
+	}
+	if ((bytes[0] & 0xf0) != 0x90) {
+		if (host_rx.num_other_messages < sizeof(host_rx.other_messages) / 3) {
+			memcpy(host_rx.other_messages[host_rx.num_other_messages], bytes, num_bytes);
+		}
+		host_rx.num_other_messages++;
+		return;
+	}
+	if (seq_from_msg(bytes) != host_rx.next_seq[cable_num]) {
+		host_rx.num_seq_errors++;
+	}
+	host_rx.next_seq[cable_num] = (seq_from_msg(bytes) + 1) & SEQ_MASK;
+	host_rx.num_messages++;
+	host_rx.num_cable_messages[cable_num]++;
+}
+
+static void host_sysex_start_cb(uint8_t cable_num)
+{
+	host_rx.in_sysex = 1;
+	host_rx.sysex_size = 1;
+}
+
+static void host_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	for (int i = 0; i < num_data_bytes; i++) {
+		if (!host_rx.in_sysex || host_rx.sysex_size >= SYSEX_MSG_SIZE - 1 ||
+		    data_bytes[i] != sysex_msg[host_rx.sysex_size]) {
+			host_rx.num_sysex_errors++;
+		}
+		host_rx.sysex_size++;
+	}
+}
+
+static void host_sysex_end_cb(uint8_t cable_num)
+{
+	if (!host_rx.in_sysex || host_rx.sysex_size + 1 != SYSEX_MSG_SIZE) {
+		host_rx.num_sysex_errors++;
+	}
+	host_rx.in_sysex = 0;
+	host_rx.num_sysex_messages++;
+}
+
+static void host_rx_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	struct usb_midi_parse_cb_t parse_cb = {.message_cb = host_message_cb,
+					       .sysex_start_cb = host_sysex_start_cb,
+					       .sysex_data_cb = host_sysex_data_cb,
+					       .sysex_end_cb = host_sysex_end_cb};
+	uint8_t packets[EP_MAX_PACKET_SIZE];
+	memcpy(packets, data, num_bytes);
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		usb_midi_parse_packet(&packets[i], &parse_cb);
+	}
+}
+
+/* Device side state, checking what the host sends. */
+static struct {
+	uint32_t next_seq[16];
+	uint32_t num_messages;
+	uint32_t num_seq_errors;
+	uint32_t num_sysex_tx_done;
+	int last_sysex_tx_result;
+} app;
+
+static void app_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	if (seq_from_msg(bytes) != app.next_seq[cable_num]) {
+		app.num_seq_errors++;
+	}
+	app.next_seq[cable_num] = (seq_from_msg(bytes) + 1) & SEQ_MASK;
+	app.num_messages++;
+}
+
+static void app_sysex_tx_done_cb(uint8_t cable_num, int result)
+{
+	app.num_sysex_tx_done++;
+	app.last_sysex_tx_result = result;
+}
+
+static void reset(const struct usb_midi_sim_config_t *config)
+{
+	memset(&host_rx, 0, sizeof(host_rx));
+	memset(&app, 0, sizeof(app));
+	struct usb_midi_cb_t cb = {.midi_message_cb = app_message_cb,
+				   .sysex_tx_done_cb = app_sysex_tx_done_cb};
+	usb_midi_register_callbacks(&cb);
+	usb_midi_sim_set_available(0);
+	usb_midi_sim_init(config);
+	usb_midi_sim_set_available(1);
+}
+
+/* Runs frames until there is nothing more to send. */
+static void run_until_idle()
+{
+	for (int i = 0; i < 10000; i++) {
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+		if (!usb_midi_sim_in_flight() && !usb_midi_sysex_tx_in_progress() &&
+		    usb_midi_sim_host_tx_pending() == 0) {
+			break;
+		}
+	}
+	/* Let the last completion callbacks and work items run */
+	for (int i = 0; i < 100; i++) {
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+	}
+}
+
+/* Sends messages on all cables and sysex messages with a randomly busy IN endpoint. */
+static void test_tx_load()
+{
+	struct usb_midi_sim_config_t config = {
+		.in_transfers_per_frame = 4, .busy_percent = 20, .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	uint32_t next_seq[NUM_CABLES] = {0};
+	uint32_t num_sent = 0;
+	uint32_t num_sysex_started = 0;
+	int sysex_cable = -1;
+	for (int frame = 0; frame < 20000; frame++) {
+		int num_msgs = rand() % 40;
+		for (int i = 0; i < num_msgs; i++) {
+			int cable = rand() % NUM_CABLES;
+			uint8_t msg[3];
+			seq_msg(next_seq[cable], msg);
+			int result = usb_midi_tx(cable, msg);
+			if (result == 0) {
+				next_seq[cable] = (next_seq[cable] + 1) & SEQ_MASK;
+				num_sent++;
+			} else if (result == -EBUSY) {
+				assert(usb_midi_sysex_tx_in_progress() && cable == sysex_cable,
+				       "usb_midi_tx should only be busy on the sysex tx cable");
+			} else {
+				assert(result == -ENOBUFS, "usb_midi_tx should only fail when full");
+				break;
+			}
+		}
+		if (frame % 500 == 0 && !usb_midi_sysex_tx_in_progress()) {
+			sysex_cable = frame % NUM_CABLES;
+			int result = usb_midi_sysex_tx(sysex_cable, sysex_msg, SYSEX_MSG_SIZE);
+			assert(result == 0, "usb_midi_sysex_tx should succeed when idle");
+			num_sysex_started++;
+		}
+		usb_midi_sim_run_frame();
+	}
+	run_until_idle();
+
+	assert(host_rx.num_messages == num_sent, "host should receive all sent messages");
+	assert(host_rx.num_seq_errors == 0, "host should receive messages in order");
+	assert(host_rx.num_sysex_messages == num_sysex_started,
+	       "host should receive all sysex messages");
+	assert(host_rx.num_sysex_errors == 0, "host should receive intact sysex messages");
+	assert(app.num_sysex_tx_done == num_sysex_started,
+	       "sysex_tx_done_cb should be called for each sysex message");
+	assert(app.last_sysex_tx_result == 0, "sysex tx should succeed");
+	printf("tx load: %u messages, %u sysex messages, %u transfers, %u busy writes\n", num_sent,
+	       num_sysex_started, usb_midi_sim_stats()->num_in_transfers,
+	       usb_midi_sim_stats()->num_busy_writes);
+}
+
+/*
+ * Checks that write errors and the device becoming unavailable abort sysex tx,
+ * and that writing is retried while the IN endpoint is busy.
+ */
+static void test_tx_errors()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	assert(usb_midi_sysex_tx(0, sysex_msg, SYSEX_MSG_SIZE) == 0, "sysex tx should start");
+	usb_midi_sim_run_frame();
+	usb_midi_sim_fail_next_write(-EIO);
+	usb_midi_sim_run_frame();
+	assert(app.num_sysex_tx_done == 1 && app.last_sysex_tx_result == -EIO,
+	       "a write error should abort sysex tx");
+	assert(!usb_midi_sysex_tx_in_progress(), "sysex tx should not be in progress after error");
+
+	assert(usb_midi_sysex_tx(0, sysex_msg, SYSEX_MSG_SIZE) == 0, "sysex tx should restart");
+	usb_midi_sim_run_frame();
+	usb_midi_sim_set_available(0);
+	assert(app.num_sysex_tx_done == 2 && app.last_sysex_tx_result == -EIO,
+	       "becoming unavailable should abort sysex tx");
+	uint8_t msg[3];
+	seq_msg(0, msg);
+	assert(usb_midi_sysex_tx(0, sysex_msg, SYSEX_MSG_SIZE) == -EIO,
+	       "sysex tx should fail when unavailable");
+
+	/* Everything works again once available */
+	usb_midi_sim_set_available(1);
+	memset(&host_rx, 0, sizeof(host_rx));
+	for (uint32_t seq = 0; seq < 100; seq++) {
+		seq_msg(seq, msg);
+		assert(usb_midi_tx(1, msg) == 0, "usb_midi_tx should succeed");
+		usb_midi_sim_run_frame();
+	}
+	assert(usb_midi_sysex_tx(2, sysex_msg, SYSEX_MSG_SIZE) == 0, "sysex tx should start");
+	run_until_idle();
+	assert(host_rx.num_messages == 100 && host_rx.num_seq_errors == 0,
+	       "host should receive messages sent after becoming available again");
+	assert(host_rx.num_sysex_messages == 1 && host_rx.num_sysex_errors == 0,
+	       "host should receive sysex sent after becoming available again");
+	assert(app.num_sysex_tx_done == 3 && app.last_sysex_tx_result == 0,
+	       "sysex tx should succeed after becoming available again");
+
+	/* Writing is retried without the app sending again while the endpoint is busy */
+	memset(&host_rx, 0, sizeof(host_rx));
+	seq_msg(0, msg);
+	usb_midi_sim_fail_next_write(-EAGAIN);
+	assert(usb_midi_tx(1, msg) == 0, "usb_midi_tx should enqueue when the endpoint is busy");
+	for (int i = 0; i < 5; i++) {
+		usb_midi_sim_run_frame();
+	}
+	assert(host_rx.num_messages == 1,
+	       "host should receive a message enqueued while the endpoint was busy");
+}
+
+/*
+ * Sends a raw MIDI byte stream using running status, with timing clocks between
+ * arbitrary bytes and sysex messages, in randomly sized chunks.
+ */
+static void test_tx_stream()
+{
+	struct usb_midi_sim_config_t config = {
+		.in_transfers_per_frame = 2, .busy_percent = 20, .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	static uint8_t stream[200000];
+	uint32_t stream_size = 0;
+	uint32_t num_notes = 0;
+	uint32_t num_clocks = 0;
+	uint32_t num_sysex = 0;
+	while (stream_size + 2 * SYSEX_MSG_SIZE + 8 < sizeof(stream)) {
+		uint8_t msg[3];
+		seq_msg(num_notes++, msg);
+		/* Running status, except for the first note and after sysex */
+		int first_byte = (num_notes == 1 || num_notes % 100 == 1) ? 0 : 1;
+		for (int i = first_byte; i < 3; i++) {
+			if (rand() % 4 == 0) {
+				stream[stream_size++] = 0xf8;
+				num_clocks++;
+			}
+			stream[stream_size++] = msg[i];
+		}
+		if (num_notes % 100 == 0) {
+			for (int i = 0; i < SYSEX_MSG_SIZE; i++) {
+				if (i > 0 && rand() % 50 == 0) {
+					stream[stream_size++] = 0xf8;
+					num_clocks++;
+				}
+				stream[stream_size++] = sysex_msg[i];
+			}
+			num_sysex++;
+		}
+	}
+
+	assert(usb_midi_tx_stream(NUM_CABLES, stream, 1) == -EINVAL,
+	       "usb_midi_tx_stream should reject invalid cable numbers");
+	uint32_t offset = 0;
+	while (offset < stream_size) {
+		uint32_t chunk_size = 1 + rand() % 20;
+		if (chunk_size > stream_size - offset) {
+			chunk_size = stream_size - offset;
+		}
+		int result = usb_midi_tx_stream(1, &stream[offset], chunk_size);
+		assert(result >= 0 && result <= chunk_size,
+		       "usb_midi_tx_stream should consume part of the chunk");
+		offset += result;
+		usb_midi_sim_run_frame();
+	}
+	run_until_idle();
+
+	assert(host_rx.num_messages == num_notes, "host should receive all streamed messages");
+	assert(host_rx.num_seq_errors == 0, "host should receive streamed messages in order");
+	assert(host_rx.num_realtime_messages == num_clocks,
+	       "host should receive all streamed timing clocks");
+	assert(host_rx.num_sysex_messages == num_sysex,
+	       "host should receive all streamed sysex messages");
+	assert(host_rx.num_sysex_errors == 0, "host should receive intact streamed sysex messages");
+	assert(usb_midi_tx_stream_num_dropped(1, 0) == 0, "no streamed bytes should be dropped");
+
+	/* Another message ends the stream's sysex message, so the rest of it is dropped. */
+	uint8_t sysex_start[4] = {0xf0, 1, 2, 3};
+	uint8_t sysex_rest[4] = {4, 5, 6, 0xf7};
+	uint8_t note[3] = {0x90, 0x40, 0x7f};
+	usb_midi_tx_stream(1, sysex_start, sizeof(sysex_start));
+	usb_midi_tx_buffer_add(1, note);
+	usb_midi_tx_stream(1, sysex_rest, sizeof(sysex_rest));
+	assert(usb_midi_tx_stream_num_dropped(1, 1) == 5,
+	       "streamed sysex chunks that could not be enqueued should be counted");
+	assert(usb_midi_tx_stream_num_dropped(1, 0) == 0, "the dropped count should be reset");
+	run_until_idle();
+
+	/* Running status does not survive the device becoming available again. */
+	uint32_t num_in_bytes = usb_midi_sim_stats()->num_in_bytes;
+	usb_midi_tx_stream(1, note, 2);
+	usb_midi_sim_set_available(0);
+	usb_midi_sim_set_available(1);
+	uint8_t running_status[3] = {0x7f, 0x41, 0x7f};
+	usb_midi_tx_stream(1, running_status, sizeof(running_status));
+	run_until_idle();
+	assert(usb_midi_sim_stats()->num_in_bytes == num_in_bytes,
+	       "streams should start over when the device becomes available");
+	printf("tx stream: %u bytes, %u messages, %u clocks, %u sysex messages\n", stream_size,
+	       num_notes, num_clocks, num_sysex);
+}
+
+/* Sends timing clocks while the tx ring is full and a sysex message is being sent. */
+static void test_tx_realtime_lane()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	uint32_t next_seq = 0;
+	uint32_t num_clocks = 0;
+	uint32_t max_clock_delay = 0;
+	uint32_t num_sysex_started = 0;
+	uint8_t clock[3] = {0xf8, 0, 0};
+	for (int frame = 0; frame < 1000; frame++) {
+		if (!usb_midi_sysex_tx_in_progress()) {
+			usb_midi_sysex_tx(2, sysex_msg, SYSEX_MSG_SIZE);
+			num_sysex_started++;
+		}
+		uint8_t msg[3];
+		seq_msg(next_seq, msg);
+		while (frame < 900 && usb_midi_tx_buffer_add(0, msg) == 0) {
+			next_seq = (next_seq + 1) & SEQ_MASK;
+			seq_msg(next_seq, msg);
+		}
+		if (frame % 3 == 0) {
+			usb_midi_tx(1, clock);
+			num_clocks++;
+		}
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+		uint32_t clock_delay = num_clocks - host_rx.num_realtime_messages;
+		if (clock_delay > max_clock_delay) {
+			max_clock_delay = clock_delay;
+		}
+	}
+	run_until_idle();
+
+	assert(max_clock_delay <= 1, "timing clocks should be sent in the next transfer");
+	assert(host_rx.num_realtime_messages == num_clocks, "host should receive all timing clocks");
+	assert(host_rx.num_seq_errors == 0, "realtime messages should not reorder other messages");
+	assert(host_rx.num_sysex_messages == num_sysex_started && host_rx.num_sysex_errors == 0,
+	       "host should receive intact sysex messages with realtime messages in between");
+	printf("tx realtime lane: %u clocks, at most %u frame(s) late\n", num_clocks,
+	       max_clock_delay);
+}
+
+/*
+ * A tx producer thread, like the DIN bridge's work queue next to the app. Each
+ * enqueues notes and timing clocks on a cable of its own, producer 0 also sysex
+ * messages in chunks. Transfers are only sent by the main thread, since the
+ * simulated backend is not thread safe.
+ */
+struct tx_producer_t {
+	uint8_t cable_number;
+	uint32_t num_notes;
+	uint32_t num_clocks;
+	uint32_t num_sysex;
+	int done;
+};
+
+static void tx_add_all(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	while (usb_midi_tx_buffer_add(cable_number, midi_bytes) == -ENOBUFS) {
+		sched_yield();
+	}
+}
+
+static void *tx_producer(void *arg)
+{
+	struct tx_producer_t *producer = arg;
+	uint8_t clock[3] = {0xf8, 0, 0};
+	for (int i = 0; i < 20000; i++) {
+		uint8_t msg[3];
+		seq_msg(producer->num_notes++, msg);
+		tx_add_all(producer->cable_number, msg);
+		tx_add_all(producer->cable_number, clock);
+		producer->num_clocks++;
+		if (producer->cable_number == 0 && i % 500 == 0) {
+			for (int j = 0; j + 1 < SYSEX_MSG_SIZE; j += 3) {
+				tx_add_all(0, &sysex_msg[j]);
+			}
+			uint8_t sysex_end[3] = {0xf7, 0, 0};
+			tx_add_all(0, sysex_end);
+			producer->num_sysex++;
+		}
+	}
+	__atomic_store_n(&producer->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Enqueues from two threads at once while the main thread sends the transfers. */
+static void test_tx_producers()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 4,
+					       .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	struct tx_producer_t producers[2] = {{.cable_number = 0}, {.cable_number = 1}};
+	pthread_t threads[2];
+	for (int i = 0; i < 2; i++) {
+		pthread_create(&threads[i], NULL, tx_producer, &producers[i]);
+	}
+	while (!__atomic_load_n(&producers[0].done, __ATOMIC_ACQUIRE) ||
+	       !__atomic_load_n(&producers[1].done, __ATOMIC_ACQUIRE)) {
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+	}
+	for (int i = 0; i < 2; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	run_until_idle();
+
+	assert(host_rx.num_cable_messages[0] == producers[0].num_notes &&
+	       host_rx.num_cable_messages[1] == producers[1].num_notes,
+	       "host should receive all messages of both producers");
+	assert(host_rx.num_seq_errors == 0, "host should receive each producer's messages in order");
+	assert(host_rx.num_realtime_messages == producers[0].num_clocks + producers[1].num_clocks,
+	       "host should receive all timing clocks of both producers");
+	assert(host_rx.num_sysex_messages == producers[0].num_sysex &&
+	       host_rx.num_sysex_errors == 0,
+	       "host should receive intact sysex messages");
+	printf("tx producers: %u messages, %u clocks\n", host_rx.num_messages,
+	       host_rx.num_realtime_messages);
+}
+
+/* Keeps two cables' rings full while sending occasional messages on a third one. */
+static void test_tx_fairness()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_rx_cb};
+	reset(&config);
+	assert(usb_midi_tx_set_cable_share(0, 12) == 0, "setting a cable share should succeed");
+	assert(usb_midi_tx_set_cable_share(2, 4) == 0, "setting a cable share should succeed");
+	assert(usb_midi_tx_set_cable_share(1, 17) == -EINVAL &&
+		       usb_midi_tx_set_cable_share(NUM_CABLES, 4) == -EINVAL,
+	       "setting an invalid cable share should fail");
+
+	uint32_t next_seq[NUM_CABLES] = {0};
+	uint32_t max_delay = 0;
+	uint32_t num_live_sent = 0;
+	int live_sent_frame = 0;
+	for (int frame = 0; frame < 1000; frame++) {
+		for (int cable = 0; cable < NUM_CABLES; cable += 2) {
+			uint8_t msg[3];
+			seq_msg(next_seq[cable], msg);
+			while (usb_midi_tx_buffer_add(cable, msg) == 0) {
+				next_seq[cable] = (next_seq[cable] + 1) & SEQ_MASK;
+				seq_msg(next_seq[cable], msg);
+			}
+		}
+		if (frame % 10 == 0) {
+			uint8_t msg[3];
+			seq_msg(num_live_sent++, msg);
+			usb_midi_tx(1, msg);
+			live_sent_frame = frame;
+		}
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+		if (host_rx.num_cable_messages[1] < num_live_sent &&
+		    frame + 1 - live_sent_frame > max_delay) {
+			max_delay = frame + 1 - live_sent_frame;
+		}
+	}
+	uint32_t num_bulk_0 = host_rx.num_cable_messages[0];
+	uint32_t num_bulk_2 = host_rx.num_cable_messages[2];
+	run_until_idle();
+	usb_midi_tx_set_cable_share(0, CONFIG_USB_MIDI_TX_CABLE_SHARE);
+	usb_midi_tx_set_cable_share(2, CONFIG_USB_MIDI_TX_CABLE_SHARE);
+
+	assert(host_rx.num_seq_errors == 0, "host should receive messages in order");
+	assert(host_rx.num_cable_messages[1] == num_live_sent,
+	       "host should receive all messages on the live cable");
+	assert(max_delay <= 2, "messages on the live cable should not wait for the busy cables");
+	assert(num_bulk_0 > 2.9 * num_bulk_2 && num_bulk_0 < 3.1 * num_bulk_2,
+	       "busy cables should share the bandwidth according to their shares");
+	printf("tx fairness: %u and %u packets on busy cables, live messages at most %u frame(s) "
+	       "late\n",
+	       num_bulk_0, num_bulk_2, max_delay);
+}
+
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+/* Checks that enqueued controller values are replaced, but never moved ahead of other messages. */
+static void test_tx_coalesce()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_rx_cb};
+	reset(&config);
+
+	uint8_t msg[3];
+	seq_msg(0, msg);
+	assert(usb_midi_tx_buffer_add(0, msg) == 0, "note should be enqueued");
+	for (int i = 0; i < 1000; i++) {
+		uint8_t pitch_bend[3] = {0xe3, i & 0x7f, (i >> 7) & 0x7f};
+		uint8_t volume[3] = {0xb3, 7, i % 128};
+		uint8_t bank_select[3] = {0xb3, 0, i % 2};
+		assert(usb_midi_tx_buffer_add(0, pitch_bend) == 0, "pitch bend should be coalesced");
+		assert(usb_midi_tx_buffer_add(0, volume) == 0, "control change should be coalesced");
+		if (i < 2) {
+			assert(usb_midi_tx_buffer_add(0, bank_select) == 0, "bank select should be enqueued");
+		}
+	}
+	seq_msg(1, msg);
+	assert(usb_midi_tx_buffer_add(0, msg) == 0, "note should be enqueued");
+	uint8_t pitch_bend[3] = {0xe3, 0, 0x40};
+	assert(usb_midi_tx_buffer_add(0, pitch_bend) == 0, "pitch bend should be enqueued");
+	run_until_idle();
+
+	/* Values enqueued after the last bank select replace each other. */
+	static const uint8_t expected[9][3] = {
+		{0xe3, 0, 0}, {0xb3, 7, 0},   {0xb3, 0, 0},   {0xe3, 1, 0},    {0xb3, 7, 1},
+		{0xb3, 0, 1}, {0xe3, 103, 7}, {0xb3, 7, 103}, {0xe3, 0, 0x40}};
+	assert(host_rx.num_messages == 2 && host_rx.num_seq_errors == 0,
+	       "host should receive notes in order");
+	assert(host_rx.num_other_messages == 9 &&
+		       memcmp(host_rx.other_messages, expected, sizeof(expected)) == 0,
+	       "host should receive coalesced values, never ahead of other messages");
+
+	reset(&config);
+	for (int i = 0; i < 1000; i++) {
+		uint8_t pitch_bend[3] = {0xe3, i & 0x7f, (i >> 7) & 0x7f};
+		usb_midi_tx_buffer_add(0, pitch_bend);
+	}
+	run_until_idle();
+	assert(host_rx.num_other_messages == 1 && host_rx.other_messages[0][1] == (999 & 0x7f) &&
+		       host_rx.other_messages[0][2] == (999 >> 7),
+	       "host should receive the last of the coalesced values");
+	printf("tx coalesce: 1000 pitch bends enqueued, %u received\n", host_rx.num_other_messages);
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+/* Transfers received by the host, with the enqueue frame in the messages' sequence numbers. */
+static struct {
+	uint32_t num_transfers;
+	uint32_t num_bytes;
+	uint32_t last_transfer_size;
+	uint32_t num_messages;
+	uint32_t max_latency_frames;
+} host_flush;
+
+static void host_flush_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	uint32_t frame = usb_midi_sim_stats()->num_frames;
+	host_flush.num_transfers++;
+	host_flush.num_bytes += num_bytes;
+	host_flush.last_transfer_size = num_bytes;
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		if (data[i + 1] == 0x90) {
+			uint32_t latency = (frame - seq_from_msg(&data[i + 1])) & SEQ_MASK;
+			if (latency > host_flush.max_latency_frames) {
+				host_flush.max_latency_frames = latency;
+			}
+			host_flush.num_messages++;
+		}
+	}
+}
+
+/* Runs frames without calling usb_midi_tx_buffer_send. */
+static void run_flush_frames(int num_frames)
+{
+	for (int i = 0; i < num_frames; i++) {
+		usb_midi_sim_run_frame();
+	}
+}
+
+/*
+ * Checks that held messages are sent within the latency budget without calling
+ * usb_midi_tx_buffer_send, that a burst goes out as soon as it fills a transfer
+ * and that realtime messages are not held.
+ */
+static void test_tx_auto_flush()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_flush_cb};
+	reset(&config);
+	memset(&host_flush, 0, sizeof(host_flush));
+	/* Sent in the frame after the budget has run out, and received in the frame after that. */
+	uint32_t max_latency_frames = (CONFIG_USB_MIDI_TX_AUTO_FLUSH_BUDGET_US + 999) / 1000 + 2;
+
+	uint8_t msg[3];
+	uint32_t num_sent = 0;
+	for (int i = 0; i < 100; i++) {
+		int was_idle = !usb_midi_sim_in_flight();
+		seq_msg(usb_midi_sim_stats()->num_frames, msg);
+		if (i % 2 == 0) {
+			usb_midi_tx(i % NUM_CABLES, msg);
+		} else {
+			usb_midi_tx_buffer_add(i % NUM_CABLES, msg);
+		}
+		num_sent++;
+		assert(!was_idle || !usb_midi_sim_in_flight(), "a single message should be held");
+		run_flush_frames(i % 7);
+	}
+	run_flush_frames(max_latency_frames);
+	assert(host_flush.num_messages == num_sent, "held messages should be sent without a flush");
+	assert(host_flush.max_latency_frames <= max_latency_frames,
+	       "held messages should be sent within the latency budget");
+
+	for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+		assert(!usb_midi_sim_in_flight(), "a burst should be held until it fills a transfer");
+		seq_msg(usb_midi_sim_stats()->num_frames, msg);
+		usb_midi_tx(0, msg);
+	}
+	assert(usb_midi_sim_in_flight(), "a burst should be sent once it fills a transfer");
+	run_flush_frames(1);
+	assert(host_flush.last_transfer_size == EP_MAX_PACKET_SIZE, "a burst should be sent in a full transfer");
+
+	seq_msg(usb_midi_sim_stats()->num_frames, msg);
+	assert(usb_midi_tx_stream(1, msg, sizeof(msg)) == sizeof(msg) && !usb_midi_sim_in_flight(),
+	       "a streamed message should be held");
+	run_flush_frames(max_latency_frames);
+	assert(host_flush.num_messages == num_sent + EP_MAX_PACKET_SIZE / 4 + 1,
+	       "a streamed message should be sent within the latency budget");
+
+	uint8_t clock[1] = {0xf8};
+	usb_midi_tx(0, msg);
+	usb_midi_tx(0, clock);
+	assert(usb_midi_sim_in_flight(), "realtime messages should not be held");
+	run_flush_frames(max_latency_frames);
+
+	/* A random load of 0 to 3 messages per frame */
+	memset(&host_flush, 0, sizeof(host_flush));
+	num_sent = 0;
+	for (int frame = 0; frame < 10000; frame++) {
+		int num_msgs = rand() % 4;
+		for (int i = 0; i < num_msgs; i++) {
+			seq_msg(usb_midi_sim_stats()->num_frames, msg);
+			num_sent += usb_midi_tx(rand() % NUM_CABLES, msg) == 0;
+		}
+		run_flush_frames(1);
+	}
+	run_flush_frames(max_latency_frames);
+	assert(host_flush.num_messages == num_sent && host_flush.max_latency_frames <= max_latency_frames,
+	       "messages should be sent within the latency budget under load");
+	printf("tx auto flush: %u messages in %u transfers, %.1f bytes per transfer, at most %u frame(s) late\n",
+	       num_sent, host_flush.num_transfers, (double)host_flush.num_bytes / host_flush.num_transfers,
+	       host_flush.max_latency_frames);
+}
+#endif
+
+/* Queues a transfer of sequence numbered messages for the host to send. */
+static int host_send_transfer(uint32_t *next_seq)
+{
+	uint8_t transfer[EP_MAX_PACKET_SIZE];
+	uint32_t seqs[16];
+	memcpy(seqs, next_seq, sizeof(seqs));
+	for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+		int cable = (i / 4) % CONFIG_USB_MIDI_NUM_INPUTS;
+		struct usb_midi_packet_t packet;
+		uint8_t msg[3];
+		seq_msg(seqs[cable], msg);
+		usb_midi_packet_from_midi_bytes(msg, cable, &packet);
+		memcpy(&transfer[4 * i], packet.bytes, 4);
+		seqs[cable] = (seqs[cable] + 1) & SEQ_MASK;
+	}
+	int result = usb_midi_sim_host_tx(transfer, sizeof(transfer));
+	if (result == 0) {
+		memcpy(next_seq, seqs, sizeof(seqs));
+	}
+	return result;
+}
+
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+/* The app's work queue, dispatching received packets. */
+static struct k_work_q app_work_q;
+#endif
+
+/* Sends full transfers from the host to a device dispatching received packets slowly. */
+static void test_rx_load()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 4,
+					       .work_period_frames = 8};
+	reset(&config);
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+	uint32_t num_app_work_items = app_work_q.num_items_run;
+#endif
+
+	uint32_t next_seq[16] = {0};
+	uint32_t num_sent = 0;
+	for (int frame = 0; frame < 20000; frame++) {
+		while (usb_midi_sim_host_tx_pending() < 8 && host_send_transfer(next_seq) == 0) {
+			num_sent += EP_MAX_PACKET_SIZE / 4;
+		}
+		usb_midi_sim_run_frame();
+	}
+	run_until_idle();
+
+	assert(app.num_seq_errors == 0, "device should receive messages in order");
+#if !defined(CONFIG_USB_MIDI_RX_DEFERRED) || defined(CONFIG_USB_MIDI_RX_FLOW_CONTROL)
+	assert(app.num_messages == num_sent, "device should receive all sent messages");
+#endif
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+	assert(app_work_q.num_items_run > num_app_work_items,
+	       "received packets should be dispatched from the app's work queue");
+#endif
+	printf("rx load: %u messages sent, %u received, %u NAKed frames\n", num_sent,
+	       app.num_messages, usb_midi_sim_stats()->num_out_naks);
+}
+
+#ifdef CONFIG_USB_MIDI_RX_RATE_LIMIT
+/* Sends full transfers from the host to a device pacing both input cables to DIN rate. */
+static void test_rx_rate_limit()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 4};
+	reset(&config);
+	assert(usb_midi_rx_set_cable_rate(0, 3125) == 0 && usb_midi_rx_set_cable_rate(1, 3125) == 0,
+	       "setting a cable rate should succeed");
+	assert(usb_midi_rx_set_cable_rate(CONFIG_USB_MIDI_NUM_INPUTS, 3125) == -EINVAL,
+	       "setting the rate of an invalid cable should fail");
+
+	uint32_t next_seq[16] = {0};
+	uint32_t num_sent = 0;
+	int num_frames = 1000;
+	for (int frame = 0; frame < num_frames; frame++) {
+		while (usb_midi_sim_host_tx_pending() < 8 && host_send_transfer(next_seq) == 0) {
+			num_sent += EP_MAX_PACKET_SIZE / 4;
+		}
+		usb_midi_sim_run_frame();
+	}
+	/* Three MIDI bytes per message, 3125 bytes per second and a burst of 32 bytes per cable */
+	uint32_t max_num_messages = 2 * (3125 * num_frames / 1000 + 32) / 3;
+	uint32_t num_paced_messages = app.num_messages;
+	run_until_idle();
+	usb_midi_rx_set_cable_rate(0, 0);
+	usb_midi_rx_set_cable_rate(1, 0);
+
+	assert(num_paced_messages <= max_num_messages && num_paced_messages > 0.95 * max_num_messages,
+	       "received messages should be dispatched at the configured rate");
+	assert(usb_midi_sim_stats()->num_out_naks > 0, "the host should wait while rate limited");
+	assert(app.num_messages == num_sent && app.num_seq_errors == 0,
+	       "device should receive all rate limited messages in order");
+	printf("rx rate limit: %u messages dispatched in %d ms (at most %u), %u NAKed frames\n",
+	       num_paced_messages, num_frames, max_num_messages, usb_midi_sim_stats()->num_out_naks);
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+/* Arrival times of the message batches and sysex messages received by the app. */
+static struct usb_midi_timestamp_t app_timestamps[8];
+static uint32_t app_batch_sizes[8];
+static uint32_t num_app_timestamps;
+
+static void app_timestamp_batch_cb(const struct usb_midi_event_t *events, uint32_t num_events)
+{
+	if (num_app_timestamps < 8) {
+		app_batch_sizes[num_app_timestamps] = num_events;
+		usb_midi_rx_timestamp(&app_timestamps[num_app_timestamps++]);
+	}
+}
+
+static void app_timestamp_sysex_end_cb(uint8_t cable_num)
+{
+	app_timestamp_batch_cb(NULL, 0);
+}
+
+/*
+ * Sends three transfers arriving at different times in two frames, and checks that
+ * the app gets their arrival times also when dispatching is deferred by a few frames.
+ */
+static void test_rx_timestamps()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 2,
+					       .work_period_frames = 4};
+	reset(&config);
+	num_app_timestamps = 0;
+	struct usb_midi_cb_t cb = {.midi_message_batch_cb = app_timestamp_batch_cb,
+				   .sysex_end_cb = app_timestamp_sysex_end_cb};
+	usb_midi_register_callbacks(&cb);
+
+	static const uint8_t notes[2][4] = {{0x09, 0x90, 0x40, 0x7f}, {0x08, 0x80, 0x40, 0x00}};
+	static const uint8_t sysex[4] = {0x07, 0xf0, 0x01, 0xf7};
+	usb_midi_sim_host_tx((const uint8_t *)notes, sizeof(notes));
+	usb_midi_sim_host_tx(notes[0], 4);
+	usb_midi_sim_host_tx(sysex, 4);
+	run_until_idle();
+
+	assert(num_app_timestamps == 3 && app_batch_sizes[0] == 2 && app_batch_sizes[1] == 1,
+	       "messages from different transfers should be passed in separate batches");
+	assert(app_timestamps[0].cycles == USB_MIDI_SIM_OUT_CYCLES &&
+		       app_timestamps[1].frame == app_timestamps[0].frame &&
+		       app_timestamps[1].cycles == 2 * USB_MIDI_SIM_OUT_CYCLES &&
+		       app_timestamps[2].frame == app_timestamps[0].frame + 1 &&
+		       app_timestamps[2].cycles == USB_MIDI_SIM_OUT_CYCLES,
+	       "app should get the frame and cycle offset of the transfer each message arrived in");
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+/* Packets received by the host on cables other than 0, and the frames they arrived in. */
+static uint8_t host_timed_packets[8][4];
+static uint32_t host_timed_frames[8];
+static uint32_t num_host_timed_packets;
+static uint32_t num_host_backlog_packets;
+
+static void host_timed_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		if ((data[i] >> 4) == 0) {
+			num_host_backlog_packets++;
+		} else if (num_host_timed_packets < 8) {
+			memcpy(host_timed_packets[num_host_timed_packets], &data[i], 4);
+			host_timed_frames[num_host_timed_packets++] = usb_midi_frame();
+		}
+	}
+}
+
+/*
+ * Schedules messages for the next few frames while a backlog of enqueued messages
+ * is being sent, and checks that each goes out in its frame, in schedule order.
+ * Then checks that messages are not scheduled on cables with open sysex messages.
+ */
+static void test_tx_schedule()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 2,
+					       .host_rx_cb = host_timed_cb};
+	reset(&config);
+	num_host_timed_packets = 0;
+	num_host_backlog_packets = 0;
+
+	uint8_t note[3] = {0x90, 0x40, 0x7f};
+	for (int i = 0; i < CONFIG_USB_MIDI_TX_RING_SIZE; i++) {
+		usb_midi_tx_buffer_add(0, note);
+	}
+	usb_midi_tx_buffer_send();
+
+	uint32_t now = usb_midi_frame();
+	uint8_t messages[5][3] = {
+		{0x90, 0x3c, 0x7f}, {0x90, 0x3d, 0x7f}, {0x91, 0x3e, 0x7f}, {0xf8, 0, 0}, {0x90, 0x3f, 0x7f}};
+	uint8_t cables[5] = {1, 1, 2, 1, 1};
+	uint32_t frames[5] = {now + 3, now + 1, now + 1, now + 2, now - 5};
+	for (int i = 0; i < 5; i++) {
+		assert(usb_midi_tx_at(cables[i], messages[i], frames[i]) == 0,
+		       "messages should be scheduled");
+	}
+	run_until_idle();
+
+	/* The late message goes first, then the others by frame and in schedule order. */
+	static const uint8_t expected_packets[5][4] = {{0x19, 0x90, 0x3f, 0x7f},
+						       {0x19, 0x90, 0x3d, 0x7f},
+						       {0x29, 0x91, 0x3e, 0x7f},
+						       {0x1f, 0xf8, 0, 0},
+						       {0x19, 0x90, 0x3c, 0x7f}};
+	uint32_t expected_frames[5] = {now + 1, now + 1, now + 1, now + 2, now + 3};
+	assert(num_host_timed_packets == 5 &&
+		       memcmp(host_timed_packets, expected_packets, sizeof(expected_packets)) == 0,
+	       "scheduled messages should be sent in order");
+	assert(memcmp(host_timed_frames, expected_frames, sizeof(expected_frames)) == 0,
+	       "scheduled messages should be sent in their frame, ahead of enqueued messages");
+	assert(num_host_backlog_packets == CONFIG_USB_MIDI_TX_RING_SIZE,
+	       "enqueued messages should be sent");
+
+	/* Also when nothing else is being sent */
+	now = usb_midi_frame();
+	usb_midi_tx_at(2, messages[2], now + 2);
+	run_until_idle();
+	assert(num_host_timed_packets == 6 && host_timed_frames[5] == now + 2,
+	       "scheduled messages should be sent in their frame when the endpoint is idle");
+
+	/* Scheduled messages would land inside sysex messages open on the cable */
+	uint8_t sysex_start[3] = {0xf0, 1, 2};
+	uint8_t sysex_end[3] = {3, 0xf7, 0};
+	uint8_t clock[3] = {0xf8, 0, 0};
+	usb_midi_tx_buffer_add(1, sysex_start);
+	assert(usb_midi_tx_at(1, note, now) == -EBUSY,
+	       "messages should not be scheduled on a cable with an enqueued sysex message open");
+	assert(usb_midi_tx_at(1, clock, now) == 0 && usb_midi_tx_at(2, note, now) == 0,
+	       "realtime messages and messages on other cables should be scheduled");
+	usb_midi_tx_buffer_add(1, sysex_end);
+	usb_midi_sysex_tx(1, sysex_msg, SYSEX_MSG_SIZE);
+	assert(usb_midi_tx_at(1, note, now) == -EBUSY,
+	       "messages should not be scheduled on the cable usb_midi_sysex_tx is sending on");
+	run_until_idle();
+	assert(usb_midi_tx_at(1, note, now) == 0,
+	       "messages should be scheduled once the sysex messages are sent");
+	run_until_idle();
+
+	uint8_t sysex[3] = {0xf0, 0x01, 0xf7};
+	assert(usb_midi_tx_at(1, sysex, now) == -EINVAL, "sysex should not be scheduled");
+	for (int i = 0; i < CONFIG_USB_MIDI_TX_SCHEDULE_SIZE; i++) {
+		usb_midi_tx_at(1, note, now + 1000);
+	}
+	assert(usb_midi_tx_at(1, note, now + 1000) == -ENOBUFS,
+	       "scheduling should fail when the schedule is full");
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_CLOCK
+#define MAX_HOST_CLOCK_BYTES 2048
+
+/* Realtime messages received by the host on cable 1, and the frames they arrived in. */
+static uint8_t host_clock_bytes[MAX_HOST_CLOCK_BYTES];
+static uint32_t host_clock_frames[MAX_HOST_CLOCK_BYTES];
+static uint32_t num_host_clock_bytes;
+
+static void host_clock_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		if ((data[i] >> 4) == 1 && data[i + 1] >= 0xf8 &&
+		    num_host_clock_bytes < MAX_HOST_CLOCK_BYTES) {
+			host_clock_bytes[num_host_clock_bytes] = data[i + 1];
+			host_clock_frames[num_host_clock_bytes++] = usb_midi_frame();
+		}
+	}
+}
+
+/* Runs frames while keeping the tx ring of cable 0 full, so every transfer is full. */
+static void run_clock_frames(int num_frames)
+{
+	uint8_t note[3] = {0x90, 0x40, 0x7f};
+	for (int i = 0; i < num_frames; i++) {
+		while (usb_midi_tx_buffer_add(0, note) == 0) {
+		}
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+	}
+}
+
+/*
+ * Runs the clock generator at an integer and a fractional tempo while the
+ * endpoint is saturated, then stops and continues it, and checks the intervals
+ * and number of clock messages received by the host.
+ */
+static void test_clock()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_clock_cb};
+	reset(&config);
+	num_host_clock_bytes = 0;
+
+	usb_midi_clock_set_tempo(120000);
+	usb_midi_clock_start(1);
+	uint32_t tempo_change_frame = usb_midi_frame() + 4800;
+	run_clock_frames(4800);
+	assert(usb_midi_clock_set_tempo(123456) == 0, "tempo should be set while running");
+	run_clock_frames(10000);
+	uint32_t stop_frame = usb_midi_frame();
+	usb_midi_clock_stop();
+	run_clock_frames(100);
+	usb_midi_clock_continue(1);
+	run_clock_frames(100);
+	usb_midi_clock_stop();
+	run_until_idle();
+
+	/* 120 BPM is a clock every 20.83 frames and 123.456 BPM every 20.25 frames. */
+	uint32_t num_bad_intervals = 0;
+	uint32_t num_fractional_clocks = 0;
+	int is_running = 0;
+	uint32_t last_clock_frame = 0;
+	uint32_t expected[5] = {0xfa, 0xfc, 0xfb, 0xfc, 0};
+	int num_commands = 0;
+	uint32_t num_stray = 0;
+	for (uint32_t i = 0; i < num_host_clock_bytes; i++) {
+		uint8_t byte = host_clock_bytes[i];
+		uint32_t frame = host_clock_frames[i];
+		if (byte != 0xf8) {
+			num_stray += byte != expected[num_commands++];
+			is_running = byte != 0xfc;
+			last_clock_frame = 0;
+			continue;
+		}
+		num_stray += !is_running;
+		if (last_clock_frame != 0) {
+			uint32_t interval = frame - last_clock_frame;
+			num_bad_intervals += interval != 20 && interval != 21;
+		}
+		last_clock_frame = frame;
+		if ((int32_t)(frame - tempo_change_frame) > 0 && (int32_t)(frame - stop_frame) <= 0) {
+			num_fractional_clocks++;
+		}
+	}
+	assert(num_commands == 4 && num_stray == 0,
+	       "clock messages should be sent between start or continue and stop");
+	assert(num_bad_intervals == 0, "clock messages should be at most a frame apart from the exact interval");
+	/* 10000 frames at 123.456 BPM are 493.824 clocks. */
+	assert(num_fractional_clocks >= 493 && num_fractional_clocks <= 495,
+	       "fractional tempos should not drift");
+
+	struct usb_midi_clock_stats_t stats;
+	usb_midi_clock_stats(&stats);
+	assert(stats.num_clocks > 700 && stats.max_jitter_us < 1000,
+	       "clock jitter should be less than a frame");
+	printf("clock: %u clocks, max jitter %u us, mean jitter %u us\n", stats.num_clocks,
+	       stats.max_jitter_us, stats.mean_jitter_us);
+}
+#endif
+
+/* Sysex callbacks received by the app, checking that starts and ends come in pairs. */
+static struct {
+	int in_sysex;
+	uint32_t num_starts;
+	uint32_t num_ends;
+	uint32_t num_unpaired;
+	uint32_t num_data_bytes;
+	uint32_t num_realtime;
+} app_framing;
+
+static void app_framing_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	if (bytes[0] >= 0xf8) {
+		app_framing.num_realtime++;
+	}
+}
+
+static void app_framing_start_cb(uint8_t cable_num)
+{
+	app_framing.num_unpaired += app_framing.in_sysex;
+	app_framing.in_sysex = 1;
+	app_framing.num_starts++;
+}
+
+static void app_framing_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	app_framing.num_unpaired += !app_framing.in_sysex;
+	app_framing.num_data_bytes += num_data_bytes;
+}
+
+static void app_framing_end_cb(uint8_t cable_num)
+{
+	app_framing.num_unpaired += !app_framing.in_sysex;
+	app_framing.in_sysex = 0;
+	app_framing.num_ends++;
+}
+
+/* Packets received by the host, in order. */
+static uint8_t host_packets[32][4];
+static uint32_t num_host_packets;
+
+static void host_packets_cb(const uint8_t *data, uint32_t num_bytes)
+{
+	for (uint32_t i = 0; i + 4 <= num_bytes && num_host_packets < 32; i += 4) {
+		memcpy(host_packets[num_host_packets++], &data[i], 4);
+	}
+}
+
+/*
+ * Sends and enqueues sysex messages with realtime messages inside, a missing F7,
+ * a stray end and a message interrupted by another F0, also in CIN 0xF packets,
+ * and checks how they are closed and counted. Then checks that usb_midi_sysex_tx
+ * and messages enqueued on its cable keep out of each other's messages.
+ */
+static void test_sysex_framing()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1,
+					       .host_rx_cb = host_packets_cb};
+	reset(&config);
+	memset(&app_framing, 0, sizeof(app_framing));
+	num_host_packets = 0;
+	struct usb_midi_cb_t cb = {.midi_message_cb = app_framing_message_cb,
+				   .sysex_start_cb = app_framing_start_cb,
+				   .sysex_data_cb = app_framing_data_cb,
+				   .sysex_end_cb = app_framing_end_cb};
+	usb_midi_register_callbacks(&cb);
+	struct usb_midi_sysex_stats_t stats_before;
+	usb_midi_sysex_stats(&stats_before);
+
+	static uint8_t rx_packets[9][4] = {
+		{0x04, 0xf0, 1, 2}, {0x0f, 0xf8, 0, 0}, {0x04, 3, 4, 5},
+		{0x09, 0x90, 0x40, 0x7f}, {0x07, 6, 7, 0xf7}, {0x07, 0xf0, 1, 0xf7},
+		{0x04, 0xf0, 1, 2}, {0x04, 0xf0, 3, 4}, {0x06, 5, 0xf7, 0}};
+	usb_midi_sim_host_tx((uint8_t *)rx_packets, sizeof(rx_packets));
+	run_until_idle();
+
+	static uint8_t tx_chunks[9][3] = {
+		{0xf0, 1, 2}, {0xf8, 0, 0}, {3, 4, 5}, {0x90, 0x40, 0x7f}, {6, 7, 0xf7},
+		{0xf0, 1, 0xf7}, {0xf0, 1, 2}, {0xf0, 3, 4}, {5, 0xf7, 0}};
+	for (int i = 0; i < 9; i++) {
+		int result = usb_midi_tx_buffer_add(0, tx_chunks[i]);
+		assert(result == (i == 4 ? -EINVAL : 0),
+		       "only sysex chunks continuing no message should be rejected");
+	}
+	usb_midi_tx_buffer_send();
+	run_until_idle();
+
+	struct usb_midi_sysex_stats_t stats;
+	usb_midi_sysex_stats(&stats);
+	assert(app_framing.num_starts == 4 && app_framing.num_ends == 4 &&
+		       app_framing.num_unpaired == 0,
+	       "app should get paired sysex starts and ends");
+	assert(app_framing.num_data_bytes == 11, "app should get the data bytes of sysex messages");
+	assert(app_framing.num_realtime == 1, "app should get realtime messages inside sysex");
+	assert(stats.num_rx_truncated - stats_before.num_rx_truncated == 2 &&
+		       stats.num_rx_stray_bytes - stats_before.num_rx_stray_bytes == 3,
+	       "received framing violations should be counted");
+
+	/* The realtime message goes first, in the next transfer */
+	static const uint8_t expected[10][4] = {
+		{0x0f, 0xf8, 0, 0}, {0x04, 0xf0, 1, 2}, {0x04, 3, 4, 5},
+		{0x05, 0xf7, 0, 0}, {0x09, 0x90, 0x40, 0x7f}, {0x07, 0xf0, 1, 0xf7},
+		{0x04, 0xf0, 1, 2}, {0x05, 0xf7, 0, 0}, {0x04, 0xf0, 3, 4}, {0x06, 5, 0xf7, 0}};
+	assert(num_host_packets == 10 && memcmp(host_packets, expected, sizeof(expected)) == 0,
+	       "enqueued sysex messages should be closed before other messages");
+	assert(stats.num_tx_truncated - stats_before.num_tx_truncated == 2 &&
+		       stats.num_tx_rejected - stats_before.num_tx_rejected == 1,
+	       "enqueued framing violations should be counted");
+
+	/* The same framing for sysex messages sent one byte per CIN 0xF packet */
+	memset(&app_framing, 0, sizeof(app_framing));
+	stats_before = stats;
+	static const uint8_t stream[] = {0xf0, 1, 2, 0xf7, 0xf0, 3, 0xf8, 0x90, 0x40, 0x7f};
+	uint8_t stream_packets[sizeof(stream)][4];
+	for (int i = 0; i < sizeof(stream); i++) {
+		uint8_t packet[4] = {0x0f, stream[i], 0, 0};
+		memcpy(stream_packets[i], packet, 4);
+	}
+	usb_midi_sim_host_tx((uint8_t *)stream_packets, sizeof(stream_packets));
+	run_until_idle();
+	usb_midi_sysex_stats(&stats);
+	assert(app_framing.num_starts == 2 && app_framing.num_ends == 2 &&
+		       app_framing.num_unpaired == 0 && app_framing.num_data_bytes == 3,
+	       "app should get paired sysex starts and ends sent in CIN 0xF packets");
+	assert(stats.num_rx_truncated - stats_before.num_rx_truncated == 1 &&
+		       stats.num_rx_stray_bytes == stats_before.num_rx_stray_bytes,
+	       "only the sysex message ended by a status byte should be counted as truncated");
+
+	/* Messages on the cable usb_midi_sysex_tx is sending on would land inside its message */
+	num_host_packets = 0;
+	static const uint8_t sysex[8] = {0xf0, 1, 2, 3, 4, 5, 6, 0xf7};
+	uint8_t note[3] = {0x90, 0x40, 0x7f};
+	uint8_t clock[3] = {0xf8, 0, 0};
+	assert(usb_midi_sysex_tx(0, sysex, sizeof(sysex)) == 0, "usb_midi_sysex_tx should start");
+	assert(usb_midi_tx(0, note) == -EBUSY && usb_midi_tx_buffer_add(0, note) == -EBUSY,
+	       "messages on the sysex tx cable should be rejected");
+	assert(usb_midi_tx_buffer_add(0, clock) == 0 && usb_midi_tx_buffer_add(1, note) == 0,
+	       "realtime messages and messages on other cables should be enqueued");
+	usb_midi_tx_buffer_send();
+	run_until_idle();
+	static const uint8_t expected_sysex[3][4] = {
+		{0x04, 0xf0, 1, 2}, {0x04, 3, 4, 5}, {0x06, 6, 0xf7, 0}};
+	assert(num_host_packets == 5 &&
+		       memcmp(host_packets, expected_sysex, sizeof(expected_sysex)) == 0,
+	       "the sysex tx message should be sent in one piece");
+	assert(usb_midi_tx(0, note) == 0,
+	       "messages on the cable should be sent after the sysex message");
+
+	/* usb_midi_sysex_tx would land inside a sysex message enqueued on the cable */
+	uint8_t sysex_start[3] = {0xf0, 1, 2};
+	uint8_t sysex_end[3] = {3, 0xf7, 0};
+	usb_midi_tx_buffer_add(0, sysex_start);
+	assert(usb_midi_sysex_tx(0, sysex, sizeof(sysex)) == -EBUSY,
+	       "usb_midi_sysex_tx should be rejected on a cable with an open sysex message");
+	usb_midi_tx_buffer_add(0, sysex_end);
+	assert(usb_midi_sysex_tx(0, sysex, sizeof(sysex)) == 0,
+	       "usb_midi_sysex_tx should start once the enqueued sysex message is closed");
+	run_until_idle();
+}
+
+/*
+ * The receive callbacks in the order they were invoked, e.g "[0:903c7f 1:b0017f] S0 D0:0102 E0"
+ * for a batch of two messages followed by a sysex message on cable 0.
+ */
+static char rx_log[1024];
+static uint32_t rx_log_size;
+static uint32_t rx_log_max_batch_size;
+
+static void rx_log_append(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	rx_log_size += vsnprintf(&rx_log[rx_log_size], sizeof(rx_log) - rx_log_size, format, args);
+	va_end(args);
+	if (rx_log_size >= sizeof(rx_log)) {
+		rx_log_size = sizeof(rx_log) - 1;
+	}
+}
+
+static void rx_log_batch_cb(const struct usb_midi_event_t *events, uint32_t num_events)
+{
+	rx_log_append(rx_log_size > 0 ? " [" : "[");
+	for (uint32_t i = 0; i < num_events; i++) {
+		rx_log_append(i > 0 ? " %d:" : "%d:", events[i].cable_num);
+		for (int j = 0; j < events[i].num_bytes; j++) {
+			rx_log_append("%02x", events[i].bytes[j]);
+		}
+	}
+	rx_log_append("]");
+	if (num_events > rx_log_max_batch_size) {
+		rx_log_max_batch_size = num_events;
+	}
+}
+
+static void rx_log_start_cb(uint8_t cable_num)
+{
+	rx_log_append(rx_log_size > 0 ? " S%d" : "S%d", cable_num);
+}
+
+static void rx_log_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	rx_log_append(rx_log_size > 0 ? " D%d:" : "D%d:", cable_num);
+	for (int i = 0; i < num_data_bytes; i++) {
+		rx_log_append("%02x", data_bytes[i]);
+	}
+}
+
+static void rx_log_end_cb(uint8_t cable_num)
+{
+	rx_log_append(rx_log_size > 0 ? " E%d" : "E%d", cable_num);
+}
+
+/* Starts logging the receive callbacks, with messages passed in batches. */
+static void rx_log_reset()
+{
+	rx_log[0] = 0;
+	rx_log_size = 0;
+	rx_log_max_batch_size = 0;
+	struct usb_midi_cb_t cb = {.midi_message_batch_cb = rx_log_batch_cb,
+				   .sysex_start_cb = rx_log_start_cb,
+				   .sysex_data_cb = rx_log_data_cb,
+				   .sysex_end_cb = rx_log_end_cb};
+	usb_midi_register_callbacks(&cb);
+}
+
+static void rx_log_check(const char *expected, const char *msg)
+{
+	if (strcmp(rx_log, expected) != 0) {
+		printf("Expected receive callbacks %s\n             but got %s\n", expected, rx_log);
+	}
+	assert(strcmp(rx_log, expected) == 0, msg);
+}
+
+/*
+ * Sends messages mixed with sysex data, a transfer full of messages and then two
+ * transfers queued at once, and checks the batches and the sysex callbacks between.
+ */
+static void test_rx_batch()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 2,
+					       .work_period_frames = 4};
+	reset(&config);
+
+	/* Messages before sysex data are delivered first, the ones after it in new batches */
+	rx_log_reset();
+	static uint8_t mixed[7][4] = {
+		{0x09, 0x90, 0x3c, 0x7f}, {0x1b, 0xb0, 0x01, 0x7f}, {0x04, 0xf0, 1, 2},
+		{0x1c, 0xc0, 0x05, 0}, {0x04, 3, 4, 5}, {0x06, 6, 0xf7, 0}, {0x08, 0x80, 0x3c, 0}};
+	usb_midi_sim_host_tx((uint8_t *)mixed, sizeof(mixed));
+	run_until_idle();
+	rx_log_check("[0:903c7f 1:b0017f] S0 D0:0102 [1:c005] D0:03040506 E0 [0:803c00]",
+		     "batches should be flushed before sysex callbacks and vice versa");
+
+	/* A transfer full of messages is one full batch */
+	rx_log_reset();
+	uint8_t full[EP_MAX_PACKET_SIZE / 4][4];
+	char expected[512] = "[";
+	for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+		uint8_t cable_num = i % CONFIG_USB_MIDI_NUM_INPUTS;
+		uint8_t packet[4] = {(cable_num << 4) | 0x9, 0x90, i, 0x7f};
+		memcpy(full[i], packet, 4);
+		sprintf(&expected[strlen(expected)], i > 0 ? " %d:90%02x7f" : "%d:90%02x7f",
+			cable_num, i);
+	}
+	strcat(expected, "]");
+	usb_midi_sim_host_tx((uint8_t *)full, sizeof(full));
+	run_until_idle();
+	rx_log_check(expected, "a transfer full of messages should be delivered in one batch");
+	assert(rx_log_max_batch_size == EP_MAX_PACKET_SIZE / 4, "the batch should be full");
+
+	/*
+	 * Two transfers dispatched at once, if deferred. Batches and sysex data spans
+	 * end with each transfer, like with the endpoint callback.
+	 */
+	rx_log_reset();
+	static uint8_t first[2][4] = {{0x09, 0x90, 0x10, 0x7f}, {0x04, 0xf0, 1, 2}};
+	static uint8_t second[3][4] = {
+		{0x07, 3, 4, 0xf7}, {0x19, 0x90, 0x11, 0x7f}, {0x19, 0x90, 0x12, 0x7f}};
+	usb_midi_sim_host_tx((uint8_t *)first, sizeof(first));
+	usb_midi_sim_host_tx((uint8_t *)second, sizeof(second));
+	run_until_idle();
+#if !defined(CONFIG_USB_MIDI_RX_DEFERRED) || defined(CONFIG_USB_MIDI_RX_TIMESTAMPS)
+	rx_log_check("[0:90107f] S0 D0:0102 D0:0304 E0 [1:90117f 1:90127f]",
+		     "each transfer should be delivered in order in batches of its own");
+#else
+	rx_log_check("[0:90107f] S0 D0:01020304 E0 [1:90117f 1:90127f]",
+		     "transfers dispatched at once should be delivered in order");
+#endif
+}
+
+/*
+ * Sends a sysex message filling a transfer, then sysex messages interleaved on two
+ * cables within a transfer and across two, and checks where sysex data is split
+ * into sysex_data_cb calls.
+ */
+static void test_rx_sysex_spans()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 2,
+					       .work_period_frames = 4};
+	reset(&config);
+
+	/* Spans end when the next packet's data bytes would not fit */
+	rx_log_reset();
+	uint8_t full[EP_MAX_PACKET_SIZE / 4][4];
+	char expected[512] = "S0";
+	uint32_t span_size = CONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN;
+	for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+		int is_first = i == 0;
+		int is_last = i == EP_MAX_PACKET_SIZE / 4 - 1;
+		uint8_t packet[4] = {is_last ? 0x07 : 0x04, is_first ? 0xf0 : 3 * i, 3 * i + 1,
+				     is_last ? 0xf7 : 3 * i + 2};
+		memcpy(full[i], packet, 4);
+		int num_data_bytes = is_first || is_last ? 2 : 3;
+		if (span_size + num_data_bytes > CONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN) {
+			strcat(expected, " D0:");
+			span_size = 0;
+		}
+		for (int j = is_first ? 2 : 1; j < 1 + (is_first ? 3 : num_data_bytes); j++) {
+			sprintf(&expected[strlen(expected)], "%02x", packet[j]);
+		}
+		span_size += num_data_bytes;
+	}
+	strcat(expected, " E0");
+	usb_midi_sim_host_tx((uint8_t *)full, sizeof(full));
+	run_until_idle();
+	rx_log_check(expected, "sysex data should be split into spans of at most the span size");
+
+	/* Spans end when the cable changes */
+	rx_log_reset();
+	static uint8_t interleaved[7][4] = {
+		{0x04, 0xf0, 0x01, 0x02}, {0x14, 0xf0, 0x11, 0x12}, {0x04, 0x03, 0x04, 0x05},
+		{0x04, 0x06, 0x07, 0x08}, {0x14, 0x13, 0x14, 0x15}, {0x06, 0x09, 0xf7, 0},
+		{0x16, 0x16, 0xf7, 0}};
+	usb_midi_sim_host_tx((uint8_t *)interleaved, sizeof(interleaved));
+	run_until_idle();
+	rx_log_check("S0 D0:0102 S1 D1:1112 D0:030405060708 D1:131415 D0:09 E0 D1:16 E1",
+		     "sysex data spans should end when the cable changes");
+
+	/* Spans end with each transfer */
+	rx_log_reset();
+	static uint8_t first[3][4] = {
+		{0x04, 0xf0, 0x01, 0x02}, {0x14, 0xf0, 0x11, 0x12}, {0x14, 0x13, 0x14, 0x15}};
+	static uint8_t second[2][4] = {{0x17, 0x16, 0x17, 0xf7}, {0x07, 0x03, 0x04, 0xf7}};
+	usb_midi_sim_host_tx((uint8_t *)first, sizeof(first));
+	usb_midi_sim_host_tx((uint8_t *)second, sizeof(second));
+	run_until_idle();
+#if !defined(CONFIG_USB_MIDI_RX_DEFERRED) || defined(CONFIG_USB_MIDI_RX_TIMESTAMPS)
+	rx_log_check("S0 D0:0102 S1 D1:1112131415 D1:1617 E1 D0:0304 E0",
+		     "sysex data spans should end with each transfer");
+#else
+	rx_log_check("S0 D0:0102 S1 D1:11121314151617 E1 D0:0304 E0",
+		     "sysex data of transfers dispatched at once should be delivered in order");
+#endif
+}
+
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+#define REASSEMBLY_CAPACITY (CONFIG_USB_MIDI_RX_SYSEX_BLOCK_SIZE * CONFIG_USB_MIDI_RX_SYSEX_NUM_BLOCKS)
+
+/* Reassembled messages received by the app. At most one is held until the next arrives. */
+static struct {
+	uint32_t num_msgs;
+	uint32_t num_bytes;
+	uint32_t num_errors;
+	struct usb_midi_sysex_block_t *held;
+} app_sysex;
+
+static void app_sysex_msg_cb(struct usb_midi_sysex_block_t *blocks, uint32_t num_bytes,
+			     uint8_t cable_num)
+{
+	uint32_t pos = 0;
+	for (struct usb_midi_sysex_block_t *block = blocks; block; block = block->next) {
+		for (int i = 0; i < block->num_bytes; i++, pos++) {
+			uint8_t expected = pos == 0 ? 0xf0 : pos == num_bytes - 1 ? 0xf7 : (7 * pos) % 128;
+			if (block->bytes[i] != expected) {
+				app_sysex.num_errors++;
+			}
+		}
+	}
+	if (pos != num_bytes) {
+		app_sysex.num_errors++;
+	}
+	app_sysex.num_msgs++;
+	app_sysex.num_bytes += num_bytes;
+	usb_midi_sysex_free(app_sysex.held);
+	app_sysex.held = blocks;
+}
+
+/* Writes the next USB MIDI packet of a sysex message of any size with the bytes of sysex_msg. */
+static void host_sysex_packet(uint32_t size, uint32_t *pos, uint8_t cable_num, uint8_t *packet)
+{
+	uint32_t num_bytes = size - *pos < 3 ? size - *pos : 3;
+	uint8_t cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+	if (*pos + num_bytes == size) {
+		cin = num_bytes == 1 ? USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE :
+		      num_bytes == 2 ? USB_MIDI_CIN_SYSEX_END_2BYTE :
+				       USB_MIDI_CIN_SYSEX_END_3BYTE;
+	}
+	memset(packet, 0, 4);
+	packet[0] = (cable_num << 4) | cin;
+	for (uint32_t i = 0; i < num_bytes; i++, (*pos)++) {
+		packet[1 + i] = *pos == 0 ? 0xf0 : *pos == size - 1 ? 0xf7 : (7 * *pos) % 128;
+	}
+}
+
+/* Sends a sysex message on cable 0, one packet per transfer, and waits for it to be dispatched. */
+static void host_send_sysex(uint32_t size)
+{
+	uint32_t pos = 0;
+	while (pos < size) {
+		uint8_t packet[4];
+		host_sysex_packet(size, &pos, 0, packet);
+		while (usb_midi_sim_host_tx(packet, 4) != 0) {
+			usb_midi_sim_run_frame();
+		}
+	}
+	run_until_idle();
+}
+
+/*
+ * Sends sysex messages of random size interleaved on two cables and checks the
+ * reassembled messages, then checks that messages not fitting in the pool are
+ * dropped without leaking blocks.
+ */
+static void test_rx_sysex_reassembly()
+{
+	struct usb_midi_sim_config_t config = {.out_transfers_per_frame = 2};
+	reset(&config);
+	memset(&app_sysex, 0, sizeof(app_sysex));
+	struct usb_midi_cb_t cb = {.midi_message_cb = app_message_cb,
+				   .sysex_msg_cb = app_sysex_msg_cb};
+	usb_midi_register_callbacks(&cb);
+
+	uint32_t sizes[2] = {0};
+	uint32_t positions[2] = {0};
+	uint32_t num_sent = 0;
+	uint32_t num_bytes_sent = 0;
+	for (int frame = 0; frame < 5000; frame++) {
+		while (usb_midi_sim_host_tx_pending() < 4) {
+			uint8_t transfer[EP_MAX_PACKET_SIZE];
+			for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+				int cable = i % 2;
+				if (positions[cable] == sizes[cable]) {
+					sizes[cable] = 2 + rand() % (SYSEX_MSG_SIZE - 1);
+					positions[cable] = 0;
+					num_sent++;
+					num_bytes_sent += sizes[cable];
+				}
+				host_sysex_packet(sizes[cable], &positions[cable], cable, &transfer[4 * i]);
+			}
+			usb_midi_sim_host_tx(transfer, sizeof(transfer));
+		}
+		usb_midi_sim_run_frame();
+	}
+	for (int cable = 0; cable < 2; cable++) {
+		while (positions[cable] < sizes[cable]) {
+			uint8_t packet[4];
+			host_sysex_packet(sizes[cable], &positions[cable], cable, packet);
+			while (usb_midi_sim_host_tx(packet, 4) != 0) {
+				usb_midi_sim_run_frame();
+			}
+		}
+	}
+	run_until_idle();
+	assert(app_sysex.num_msgs == num_sent && app_sysex.num_errors == 0,
+	       "app should receive intact reassembled messages");
+	printf("rx sysex reassembly: %u messages, %u bytes\n", app_sysex.num_msgs,
+	       app_sysex.num_bytes);
+
+	usb_midi_sysex_free(app_sysex.held);
+	app_sysex.held = NULL;
+	memset(&app_sysex, 0, sizeof(app_sysex));
+	host_send_sysex(REASSEMBLY_CAPACITY + 1);
+	assert(app_sysex.num_msgs == 0, "messages not fitting in the pool should be dropped");
+	uint8_t packet[4];
+	uint32_t pos = 0;
+	host_sysex_packet(100, &pos, 0, packet);
+	usb_midi_sim_host_tx(packet, 4);
+	run_until_idle();
+	host_send_sysex(REASSEMBLY_CAPACITY);
+	assert(app_sysex.num_msgs == 1 && app_sysex.num_errors == 0,
+	       "a new message should drop an unfinished one on the same cable");
+	usb_midi_sysex_free(app_sysex.held);
+	app_sysex.held = NULL;
+	memset(&app_sysex, 0, sizeof(app_sysex));
+	host_send_sysex(REASSEMBLY_CAPACITY);
+	assert(app_sysex.num_msgs == 1 && app_sysex.num_errors == 0,
+	       "a message using all blocks should be received after dropping one");
+	host_send_sysex(10);
+	assert(app_sysex.num_msgs == 1, "messages should be dropped while the app holds all blocks");
+	usb_midi_sysex_free(app_sysex.held);
+	app_sysex.held = NULL;
+	host_send_sysex(REASSEMBLY_CAPACITY);
+	assert(app_sysex.num_msgs == 2 && app_sysex.num_errors == 0,
+	       "blocks freed by the app should be reused");
+	usb_midi_sysex_free(app_sysex.held);
+	app_sysex.held = NULL;
+}
+#endif
+
+static double now_s()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Measures the host CPU time spent per packet in the tx and rx paths. */
+static void bench_tx_rx()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1000,
+					       .out_transfers_per_frame = 1000};
+	reset(&config);
+
+	int num_frames = 100000;
+	uint32_t num_packets = 0;
+	uint8_t msg[3];
+	double t0 = now_s();
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int i = 0; i < 32; i++) {
+			seq_msg(num_packets, msg);
+			if (usb_midi_tx_buffer_add(i % NUM_CABLES, msg) == 0) {
+				num_packets++;
+			}
+		}
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+	}
+	double tx_ns = 1e9 * (now_s() - t0) / num_packets;
+
+	uint32_t next_seq[16] = {0};
+	uint32_t num_rx_packets = 0;
+	t0 = now_s();
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int i = 0; i < 2; i++) {
+			if (host_send_transfer(next_seq) == 0) {
+				num_rx_packets += EP_MAX_PACKET_SIZE / 4;
+			}
+		}
+		usb_midi_sim_run_frame();
+	}
+	double rx_ns = 1e9 * (now_s() - t0) / num_rx_packets;
+
+	printf("tx path: %.1f ns/packet, rx path: %.1f ns/packet\n", tx_ns, rx_ns);
+}
+
+/*
+ * Measures the host CPU time spent per packet in the rx and tx paths for sysex
+ * messages with a realtime message in every eighth packet, i.e with the per
+ * cable sysex framing checks on every packet.
+ */
+static void bench_sysex()
+{
+	struct usb_midi_sim_config_t config = {.in_transfers_per_frame = 1000,
+					       .out_transfers_per_frame = 1000};
+	reset(&config);
+
+	int num_frames = 100000;
+	uint8_t transfer[EP_MAX_PACKET_SIZE];
+	uint32_t num_rx_packets = 0;
+	double t0 = now_s();
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int t = 0; t < 2; t++) {
+			for (int i = 0; i < EP_MAX_PACKET_SIZE / 4; i++) {
+				uint8_t *packet = &transfer[4 * i];
+				int cable = i % 2;
+				if (i % 8 == 7) {
+					packet[0] = (cable << 4) | 0xf;
+					packet[1] = 0xf8;
+				} else {
+					packet[0] = (cable << 4) | USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+					packet[1] = (frame == 0 && t == 0 && i < 2) ? 0xf0 : i;
+				}
+				packet[2] = i;
+				packet[3] = i;
+			}
+			if (usb_midi_sim_host_tx(transfer, sizeof(transfer)) == 0) {
+				num_rx_packets += EP_MAX_PACKET_SIZE / 4;
+			}
+		}
+		usb_midi_sim_run_frame();
+	}
+	double rx_ns = 1e9 * (now_s() - t0) / num_rx_packets;
+
+	/* Open a sysex message on every cable, so all chunks below continue one. */
+	uint8_t sysex_start[3] = {0xf0, 1, 2};
+	for (int cable = 0; cable < NUM_CABLES; cable++) {
+		usb_midi_tx_buffer_add(cable, sysex_start);
+	}
+	struct usb_midi_sysex_stats_t stats_before;
+	usb_midi_sysex_stats(&stats_before);
+	uint32_t num_tx_packets = 0;
+	uint8_t chunk[3] = {3, 1, 2};
+	uint8_t clock[3] = {0xf8, 0, 0};
+	t0 = now_s();
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int i = 0; i < 32; i++) {
+			if (usb_midi_tx_buffer_add(i % NUM_CABLES, i % 8 == 7 ? clock : chunk) == 0) {
+				num_tx_packets++;
+			}
+		}
+		usb_midi_tx_buffer_send();
+		usb_midi_sim_run_frame();
+	}
+	double tx_ns = 1e9 * (now_s() - t0) / num_tx_packets;
+
+	struct usb_midi_sysex_stats_t stats;
+	usb_midi_sysex_stats(&stats);
+	assert(stats.num_tx_rejected == stats_before.num_tx_rejected, "benchmarked sysex chunks should not be rejected");
+	printf("sysex tx path: %.1f ns/packet, sysex rx path: %.1f ns/packet\n", tx_ns, rx_ns);
+}
+
+int main(int argc, char *argv[])
+{
+	init_sysex_msg();
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+	usb_midi_rx_set_work_queue(&app_work_q);
+#endif
+	test_tx_load();
+	test_tx_errors();
+	test_tx_stream();
+	test_tx_realtime_lane();
+#ifndef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+	/* Auto flush would send from the producer threads */
+	test_tx_producers();
+#endif
+	test_tx_fairness();
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+	test_tx_coalesce();
+#endif
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+	test_tx_auto_flush();
+#endif
+	test_rx_load();
+#ifdef CONFIG_USB_MIDI_RX_RATE_LIMIT
+	test_rx_rate_limit();
+#endif
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+	test_rx_sysex_reassembly();
+#endif
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+	test_rx_timestamps();
+#endif
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+	test_tx_schedule();
+#endif
+#ifdef CONFIG_USB_MIDI_CLOCK
+	test_clock();
+#endif
+	test_sysex_framing();
+	test_rx_batch();
+	test_rx_sysex_spans();
+	bench_tx_rx();
+	bench_sysex();
+
+	if (num_failed_assertions > 0) {
+		printf("❌ %d failed assertions.\n", num_failed_assertions);
+		return 1;
+	} else {
+		printf("✅ No failed assertions.\n");
+	}
+	return 0;
+}
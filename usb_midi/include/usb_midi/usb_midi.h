@@ -9,12 +9,76 @@ typedef void (*usb_midi_available_cb_t)(int is_available);
 typedef void (*usb_midi_tx_done_cb_t)();
 /** A function to call when a non-sysex message has been received. */
 typedef void (*usb_midi_message_cb_t)(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num);
+/** A received non-sysex message, as passed to usb_midi_message_batch_cb_t. */
+struct usb_midi_event_t {
+    uint8_t cable_num;
+    uint8_t num_bytes;
+    /** Bytes beyond num_bytes should be ignored. */
+    uint8_t bytes[3];
+};
+/**
+ * A function to call with the non-sysex messages received in a transfer, in
+ * order. Replaces midi_message_cb if set. When a transfer also contains sysex
+ * data, the messages before it are delivered as a separate batch first.
+ */
+typedef void (*usb_midi_message_batch_cb_t)(const struct usb_midi_event_t *events,
+					    uint32_t num_events);
 /** A function to call when a sysex message starts */
 typedef void (*usb_midi_sysex_start_cb_t)(uint8_t cable_num);
 /** A function to call when sysex data bytes have been received */
 typedef void (*usb_midi_sysex_data_cb_t)(uint8_t* data_bytes, uint8_t num_data_bytes, uint8_t cable_num);
 /** A function to call when a sysex message ends */
 typedef void (*usb_midi_sysex_end_cb_t)(uint8_t cable_num);
+/**
+ * A function to call when a sysex message started with usb_midi_sysex_tx or
+ * usb_midi_sysex_tx_pull has been sent (result is 0) or was aborted (result is
+ * a negative error code).
+ */
+typedef void (*usb_midi_sysex_tx_done_cb_t)(uint8_t cable_num, int result);
+/**
+ * A function providing bytes of an outgoing sysex message. Must write the
+ * num_bytes message bytes starting at offset to dest. Called from the
+ * USB stack's endpoint callback, i.e possibly from interrupt context.
+ */
+typedef void (*usb_midi_sysex_tx_pull_cb_t)(uint8_t *dest, uint32_t offset, uint32_t num_bytes);
+/**
+ * A block of a received sysex message reassembled by the driver. The blocks of
+ * a message are chained in order.
+ */
+struct usb_midi_sysex_block_t {
+    /** The next block of the message, or NULL if this is the last one. */
+    struct usb_midi_sysex_block_t *next;
+    /** The number of message bytes in the block. */
+    uint16_t num_bytes;
+    uint8_t bytes[];
+};
+/**
+ * A function to call with a complete received sysex message, including F0 and F7,
+ * as a chain of blocks. The blocks belong to the app until it passes them to
+ * usb_midi_sysex_free. Requires CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY.
+ */
+typedef void (*usb_midi_sysex_msg_cb_t)(struct usb_midi_sysex_block_t *blocks,
+					uint32_t num_bytes, uint8_t cable_num);
+
+/** Counts of sysex framing violations per direction, see usb_midi_sysex_stats. */
+struct usb_midi_sysex_stats_t {
+    /** Received sysex messages ended by F0 or another status byte instead of F7. */
+    uint32_t num_rx_truncated;
+    /** Received sysex data and F7 bytes outside of a sysex message, which were dropped. */
+    uint32_t num_rx_stray_bytes;
+    /** Enqueued sysex messages ended with an F7 added by the driver. */
+    uint32_t num_tx_truncated;
+    /** Sysex chunks not starting with F0 rejected because no message was open on the cable. */
+    uint32_t num_tx_rejected;
+};
+
+/** The arrival time of a received transfer, see usb_midi_rx_timestamp. */
+struct usb_midi_timestamp_t {
+    /** The number of start of frame events since boot, i.e the USB (micro)frame the transfer arrived in. Wraps around. */
+    uint32_t frame;
+    /** The number of k_cycle_get_32 cycles from the start of the frame until the transfer arrived. */
+    uint32_t cycles;
+};
 
 struct usb_midi_cb_t {
     usb_midi_available_cb_t available_cb;
@@ -23,13 +87,59 @@ struct usb_midi_cb_t {
     usb_midi_sysex_start_cb_t sysex_start_cb;
     usb_midi_sysex_data_cb_t sysex_data_cb;
     usb_midi_sysex_end_cb_t sysex_end_cb;
+    usb_midi_sysex_tx_done_cb_t sysex_tx_done_cb;
+    usb_midi_message_batch_cb_t midi_message_batch_cb;
+    usb_midi_sysex_msg_cb_t sysex_msg_cb;
 };
 
 /**
- * Register callbacks to invoke when receiving MIDI messages etc.
+ * Register callbacks to invoke when receiving MIDI messages etc. The receive
+ * callbacks (midi_message_cb and the sysex callbacks) are invoked from the OUT
+ * endpoint callback, or from the driver thread, the system work queue or the
+ * app's work queue if CONFIG_USB_MIDI_RX_DISPATCH_THREAD,
+ * CONFIG_USB_MIDI_RX_DISPATCH_SYSTEM_WORKQ or CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+ * is set.
  */
 void usb_midi_register_callbacks(struct usb_midi_cb_t* handlers);
 
+struct k_work_q;
+
+/**
+ * Set the work queue the receive callbacks are invoked from, e.g one started
+ * by the app with k_work_queue_start, at a priority of its choosing. Received
+ * packets are dispatched from the system work queue until this is called.
+ * Call before enabling USB. Only available if CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+ * is set.
+ * @param work_q The work queue.
+ */
+void usb_midi_rx_set_work_queue(struct k_work_q *work_q);
+
+/**
+ * Give the blocks of a message passed to sysex_msg_cb back to the driver. Can be
+ * called from any context.
+ * @param blocks The first block of the message.
+ */
+void usb_midi_sysex_free(struct usb_midi_sysex_block_t *blocks);
+
+/**
+ * Get the arrival time of the OUT transfer containing the message or sysex
+ * bytes being passed to a receive callback, taken when the transfer is read
+ * from the endpoint, i.e before any deferred dispatching or rate limiting.
+ * The messages passed to a midi_message_batch_cb call all arrived in the same
+ * transfer, and sysex_msg_cb gets the arrival time of the F7. Only valid when
+ * called from a receive callback. Requires CONFIG_USB_MIDI_RX_TIMESTAMPS.
+ */
+void usb_midi_rx_timestamp(struct usb_midi_timestamp_t *timestamp);
+
+/**
+ * Set the rate at which MIDI bytes received on an input cable are dispatched.
+ * Only available if CONFIG_USB_MIDI_RX_RATE_LIMIT is set.
+ * @param cable_number The cable number. Must be smaller than the number of inputs.
+ * @param bytes_per_sec The number of MIDI bytes per second, or zero for no limit.
+ * @return 0 on success, -EINVAL if the cable number is invalid.
+ */
+int usb_midi_rx_set_cable_rate(uint8_t cable_number, uint32_t bytes_per_sec);
+
 /**
  * Send a MIDI message with a given cable number. The event must be 1, 2 or 3 
  * bytes long passed in a buffer of length 3 (unused bytes can be set to zero).
@@ -47,31 +157,188 @@ void usb_midi_register_callbacks(struct usb_midi_cb_t* handlers);
  * d, F7
  * F7
  *
+ * Chunks other than the ones starting with F0 are rejected with -EINVAL unless
+ * a sysex message is open on the cable, see usb_midi_sysex_stats.
+ *
+ * The message is enqueued like with usb_midi_tx_buffer_add and sent right away
+ * if no transfer is in flight, otherwise when the transfer in flight is done.
+ * If CONFIG_USB_MIDI_TX_AUTO_FLUSH is set, messages other than system realtime
+ * are held until they fill a transfer or CONFIG_USB_MIDI_TX_AUTO_FLUSH_BUDGET_US
+ * has passed since the oldest of them was enqueued. If the IN endpoint is busy,
+ * the driver retries writing until it isn't.
+ *
  * @param cable_number Send the event on the virtual cable with this number.
  * Must be smaller than the number of outputs.
  * @param midi_bytes The MIDI bytes to send.
- * @return 0 on success, a non-zero number on failure.
+ * @return 0 if the message was enqueued, a negative error code on failure. -EBUSY
+ * means that usb_midi_sysex_tx is sending a message on the cable.
  */
 int usb_midi_tx(uint8_t cable_number, uint8_t* midi_bytes);
 
 /**
  * Enqueue a message for transmission. Used to send more than one
  * message per USB tx packet, which is useful for increasing throughput.
- * @return 0 if the message was enqueued, otherwise a non-zero number indicating that
- * usb_midi_tx_buffer_send should be called.
+ *
+ * Enqueued messages are kept in a ring of CONFIG_USB_MIDI_TX_RING_SIZE
+ * packets per cable. Once usb_midi_tx_buffer_send has been called, the rings are drained
+ * automatically, a full transfer at a time, each time a transfer is done. The cables
+ * take turns putting packets in transfers, see usb_midi_tx_set_cable_share.
+ * Enqueueing is serialized with a spinlock, so messages may be enqueued from more
+ * than one thread, e.g the DIN bridge's work queue and the app. Messages on a cable
+ * are sent in the order they were enqueued.
+ * System realtime messages (F8 to FF) take a separate lane and go in the very next
+ * transfer, ahead of enqueued messages and outgoing sysex data.
+ * If CONFIG_USB_MIDI_TX_AUTO_FLUSH is set, enqueued messages are also sent without
+ * calling usb_midi_tx_buffer_send, like with usb_midi_tx.
+ * @return 0 if the message was enqueued, -ENOBUFS if the ring of the cable is full,
+ * -EBUSY if usb_midi_sysex_tx is sending a message on the cable or -EINVAL if the
+ * message or cable number is invalid. If CONFIG_USB_MIDI_TX_AUTO_FLUSH
+ * is set, a negative error code from sending the message, like for usb_midi_tx,
+ * in which case it was enqueued.
  */
 int usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t* midi_bytes);
 
 /**
  * Indicates if more messages can be enqueued for transmission.
- * @return Zero if more messages can be enqueued. A non-zero number indicates that 
- * usb_midi_tx_buffer_send should be called.
+ * @return Zero if more messages can be enqueued on any cable. A non-zero number
+ * indicates that the tx ring of at least one cable is full.
  */
 int usb_midi_tx_buffer_is_full();
 
 /**
- * Send enqueued messages, if any, in a single USB packet.
+ * Start sending enqueued messages, if any, unless a transfer is already in flight.
+ * Remaining messages are sent automatically as transfers are done.
+ * @return 0 on success, a negative error code if writing to the IN endpoint failed.
+ * If the endpoint was busy, the messages stay enqueued and writing is retried.
  */
 int usb_midi_tx_buffer_send();
 
+/**
+ * Get the highest number of packets that have been waiting in a tx ring at the
+ * same time, which is useful for choosing CONFIG_USB_MIDI_TX_RING_SIZE.
+ * @param reset If non-zero, start over from zero after returning the current value.
+ * @return The high-water mark of the tx rings.
+ */
+int usb_midi_tx_buffer_high_water_mark(int reset);
+
+/**
+ * Set the number of enqueued packets a cable may put in transfers before the next
+ * cable with enqueued packets gets its turn. This determines the cable's share of
+ * the bandwidth when other cables are busy too, e.g so that bulk data on one cable
+ * does not delay live messages on another. Defaults to CONFIG_USB_MIDI_TX_CABLE_SHARE.
+ * @param cable_number The cable number. Must be smaller than the number of outputs.
+ * @param num_packets The number of packets per turn, between 1 and 16.
+ * @return 0 on success, -EINVAL if an argument is invalid.
+ */
+int usb_midi_tx_set_cable_share(uint8_t cable_number, uint8_t num_packets);
+
+/**
+ * Get the number of the current USB frame, i.e the number of start of frame
+ * events since boot, which wraps around. Frames are 1 ms long, or 125 us at
+ * high speed. Requires CONFIG_USB_MIDI_TX_SCHEDULE or CONFIG_USB_MIDI_RX_TIMESTAMPS.
+ */
+uint32_t usb_midi_frame();
+
+/**
+ * Schedule a message to be sent in a given USB frame. At the start of that
+ * frame, the message is put in the very next transfer, like system realtime
+ * messages, ahead of enqueued messages, so its timing does not depend on when
+ * the app's threads run. Messages scheduled for the same frame are sent in the
+ * order they were scheduled, and messages scheduled for a frame that has already
+ * started are sent at the start of the next one. Only available if
+ * CONFIG_USB_MIDI_TX_SCHEDULE is set. Must be called from one thread only.
+ * Since scheduled messages go ahead of enqueued ones, messages other than system
+ * realtime are rejected on a cable while a sysex message is being sent on it, and
+ * should not be scheduled for frames in which one will be.
+ * @param cable_number Send the message on the virtual cable with this number.
+ * Must be smaller than the number of outputs.
+ * @param midi_bytes The MIDI bytes of a non-sysex message, like for usb_midi_tx.
+ * @param frame The frame to send the message in, see usb_midi_frame. At most
+ * 2^31 frames ahead.
+ * @return 0 on success, -ENOBUFS if CONFIG_USB_MIDI_TX_SCHEDULE_SIZE messages are
+ * waiting to be moved to the schedule, -EBUSY if a sysex message is open on the
+ * cable, either enqueued or sent with usb_midi_sysex_tx, or -EINVAL if the message
+ * or cable number is invalid.
+ */
+int usb_midi_tx_at(uint8_t cable_number, uint8_t *midi_bytes, uint32_t frame);
+
+/**
+ * Enqueue raw MIDI bytes, e.g received from a DIN port, for transmission and
+ * start sending them. The bytes may be split into chunks of any size and may
+ * use running status and contain system realtime bytes anywhere. Each cable
+ * has its own parser, which keeps partial messages between calls and puts
+ * complete messages and sysex chunks in the tx ring as they are completed.
+ * Each cable's stream must be fed from one thread only. Avoid sending other
+ * messages on a cable while its stream is in the middle of a sysex message.
+ * @param cable_number Send the bytes on the virtual cable with this number.
+ * Must be smaller than the number of outputs.
+ * @param bytes The MIDI bytes to send.
+ * @param num_bytes The number of bytes.
+ * @return The number of bytes consumed, which is less than num_bytes if the tx ring
+ * filled up, or -EINVAL if the cable number is invalid. If the IN endpoint was busy,
+ * writing the enqueued packets is retried.
+ * Messages and sysex chunks that could not be enqueued, e.g because other messages
+ * ended the stream's sysex message on the cable, are dropped and counted, see
+ * usb_midi_tx_stream_num_dropped. The parser state of all cables is reset when
+ * the device becomes available. If CONFIG_USB_MIDI_TX_AUTO_FLUSH is set, the
+ * enqueued packets are held like for usb_midi_tx.
+ */
+int usb_midi_tx_stream(uint8_t cable_number, const uint8_t *bytes, uint32_t num_bytes);
+
+/**
+ * Get the number of MIDI bytes consumed by usb_midi_tx_stream whose messages
+ * could not be enqueued and were dropped. Must be called from the same thread
+ * as usb_midi_tx_stream.
+ * @param cable_number The cable number. Must be smaller than the number of outputs.
+ * @param reset If non-zero, start over from zero after returning the current value.
+ * @return The number of dropped bytes, or 0 if the cable number is invalid.
+ */
+uint32_t usb_midi_tx_stream_num_dropped(uint8_t cable_number, int reset);
+
+/**
+ * Start sending a complete sysex message, including the leading F0 and the
+ * trailing F7, from a buffer. The driver splits the message into USB MIDI
+ * packets, sends them in full size transfers and refills the next transfer
+ * when the previous one is done. The buffer must stay valid until
+ * the sysex_tx_done_cb callback has been invoked.
+ *
+ * Messages enqueued with usb_midi_tx_buffer_add while a sysex message is being
+ * sent share transfers with the sysex data. Messages on the same cable, other
+ * than system realtime, are rejected with -EBUSY until sysex_tx_done_cb.
+ *
+ * @param cable_number Send the message on the virtual cable with this number.
+ * @param bytes The sysex message bytes.
+ * @param num_bytes The number of bytes in the message.
+ * @return 0 if the transmission was started, -EBUSY if a sysex message is already being
+ * sent or a sysex message enqueued on the cable is open, another negative error code
+ * on failure.
+ */
+int usb_midi_sysex_tx(uint8_t cable_number, const uint8_t *bytes, uint32_t num_bytes);
+
+/**
+ * Like usb_midi_sysex_tx, but the message bytes are requested from pull_cb as they are
+ * needed, which allows sending messages that are not stored in memory in their entirety.
+ * The first and last bytes provided by pull_cb must be F0 and F7 respectively.
+ */
+int usb_midi_sysex_tx_pull(uint8_t cable_number, uint32_t num_bytes,
+			   usb_midi_sysex_tx_pull_cb_t pull_cb);
+
+/**
+ * Get the number of sysex framing violations detected so far. Received and
+ * enqueued sysex messages are tracked per cable. Received system realtime
+ * messages are passed through anywhere. Any other status byte, including F0,
+ * received before F7 ends the message with sysex_end_cb, and sysex bytes
+ * received outside of a message are dropped, so sysex_start_cb and sysex_end_cb
+ * always come in pairs. Likewise, enqueueing F0 or a message other than system
+ * realtime while a sysex message is open on the cable first enqueues F7.
+ */
+void usb_midi_sysex_stats(struct usb_midi_sysex_stats_t *stats);
+
+/**
+ * Indicates if a sysex message started with usb_midi_sysex_tx or usb_midi_sysex_tx_pull
+ * is being sent.
+ * @return A non-zero number if a sysex message is being sent, otherwise 0.
+ */
+int usb_midi_sysex_tx_in_progress();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef ZEPHYR_USB_MIDI_CLOCK_H_
+#define ZEPHYR_USB_MIDI_CLOCK_H_
+
+#include <stdint.h>
+
+/**
+ * Generates MIDI clock (F8) at 24 pulses per quarter note, together with
+ * start (FA), stop (FC) and continue (FB) messages. Requires CONFIG_USB_MIDI_CLOCK.
+ *
+ * The generator runs in the start of frame callback, using the USB frames as
+ * its time base. A phase accumulator adds the tempo each frame, so fractional
+ * tempos are exact in the long run and never drift. The messages go in the very
+ * next transfer, ahead of enqueued messages, like system realtime messages sent
+ * with usb_midi_tx. Clock messages are sent in whole frames, so the interval
+ * between them varies by up to a frame around the exact interval.
+ *
+ * The functions below can be called from any thread and take effect at the
+ * start of the next frame. If several commands are given during a frame, only
+ * the last one is sent.
+ */
+
+/** Measured timing of the generated clock messages. */
+struct usb_midi_clock_stats_t {
+	/* Clock messages generated since the clock was last started. */
+	uint32_t num_clocks;
+	/*
+	 * The max and mean deviation, in microseconds, of the interval between
+	 * consecutive clock messages from the exact interval at the current tempo,
+	 * measured with k_cycle_get_32 when they are released to the IN endpoint.
+	 */
+	uint32_t max_jitter_us;
+	uint32_t mean_jitter_us;
+};
+
+/**
+ * Send start and start sending clock messages, the first one right after start.
+ * @param cable_number Send the messages on the virtual cable with this number.
+ * @return 0 on success, -EINVAL if the cable number is invalid.
+ */
+int usb_midi_clock_start(uint8_t cable_number);
+
+/**
+ * Send stop, on the cable of the last start or continue, and stop sending clock
+ * messages. The position within the current beat is kept for usb_midi_clock_continue.
+ */
+void usb_midi_clock_stop();
+
+/**
+ * Send continue and resume sending clock messages where they were stopped.
+ * @param cable_number Send the messages on the virtual cable with this number.
+ * @return 0 on success, -EINVAL if the cable number is invalid.
+ */
+int usb_midi_clock_continue(uint8_t cable_number);
+
+/**
+ * Set the tempo, also while the clock is running. The next clock message is
+ * sent when the beat position advanced at the new tempo reaches it. Defaults
+ * to CONFIG_USB_MIDI_CLOCK_TEMPO.
+ * @param millibpm The tempo in thousandths of beats per minute, between 1000 and 1000000.
+ * @return 0 on success, -EINVAL if the tempo is out of range.
+ */
+int usb_midi_clock_set_tempo(uint32_t millibpm);
+
+/** Get the measured timing of the clock messages. */
+void usb_midi_clock_stats(struct usb_midi_clock_stats_t *stats);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef ZEPHYR_USB_MIDI_DIN_H_
+#define ZEPHYR_USB_MIDI_DIN_H_
+
+#include <stdint.h>
+#include <zephyr/device.h>
+
+/**
+ * Bridges USB MIDI cables to MIDI DIN ports driven by UARTs, using the async
+ * UART API. Requires CONFIG_USB_MIDI_DIN_BRIDGE.
+ *
+ * MIDI bytes received from the host on an input cable are written to the
+ * UART of the port with the same cable number, directly from a per port
+ * ring buffer. Bytes received by the UART are parsed statefully, i.e running
+ * status and realtime bytes anywhere are supported, and sent to the host on
+ * the output cable with the same number, using usb_midi_tx_stream. This is
+ * done in the system work queue, which then feeds the streams of the bridged
+ * cables. The app may still send on any cable from its own threads, enqueueing
+ * is serialized, but should not use the streams of the bridged cables.
+ * Received messages are still passed to the user callbacks.
+ */
+
+/** Counters of a DIN port. */
+struct usb_midi_din_stats_t {
+	/* Bytes written to the UART. */
+	uint32_t num_tx_bytes;
+	/* Bytes from the host dropped because the port's tx buffer was full. */
+	uint32_t num_tx_dropped_bytes;
+	/* Bytes received by the UART and enqueued for the host. */
+	uint32_t num_rx_bytes;
+	/*
+	 * Bytes received by the UART and dropped, e.g while the device was unavailable
+	 * or because usb_midi_tx_stream could not enqueue their messages.
+	 */
+	uint32_t num_rx_dropped_bytes;
+	/* UART tx errors and aborts, rx stops because of line errors. */
+	uint32_t num_uart_errors;
+};
+
+/**
+ * Add a DIN port. The UART is configured for MIDI, i.e 31250 baud 8N1.
+ * @param cable_number The cable number of the port. Host to DIN bytes are taken
+ * from the input cable with this number, if any, and DIN to host bytes are sent
+ * on the output cable with this number, if any.
+ * @param uart A UART supporting the async API.
+ * @return 0 on success, -EINVAL if the cable number is invalid or already bridged,
+ * -ENOMEM if CONFIG_USB_MIDI_DIN_NUM_PORTS ports have already been added, -ENODEV
+ * if the UART is not ready, or an error code from the UART API.
+ */
+int usb_midi_din_add_port(uint8_t cable_number, const struct device *uart);
+
+/**
+ * Get the counters of a DIN port.
+ * @return 0 on success, -EINVAL if no port has the given cable number.
+ */
+int usb_midi_din_port_stats(uint8_t cable_number, struct usb_midi_din_stats_t *stats);
+
+#endif
@@ -1,10 +1,15 @@
-#include <zephyr/init.h>
-#include <zephyr/usb/usb_device.h>
-#include <usb_descriptor.h>
+#include <zephyr/kernel.h>
 #include <usb_midi/usb_midi.h>
-#include "usb_midi_types.h"
-#include "usb_midi_macros.h"
+#include "usb_midi_backend.h"
 #include "usb_midi_packet.h"
+#include "usb_midi_ring.h"
+#include "usb_midi_stream.h"
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+#include "usb_midi_din_hooks.h"
+#endif
+#ifdef CONFIG_USB_MIDI_CLOCK
+#include "usb_midi_clock_hooks.h"
+#endif
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
@@ -12,24 +17,118 @@ LOG_MODULE_REGISTER(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
 #define LOG_DBG_PACKET(packet) LOG_DBG("%02x %02x %02x %02x | cable %02x | CIN %01x | %d MIDI bytes", \
 									   packet.bytes[0], packet.bytes[1], packet.bytes[2], packet.bytes[3],            \
 									   packet.cable_num, packet.cin, packet.num_midi_bytes)
+#define LOG_DBG_PACKET_BYTES(bytes) LOG_DBG("%02x %02x %02x %02x | cable %02x | CIN %01x", \
+											bytes[0], bytes[1], bytes[2], bytes[3], bytes[0] >> 4, bytes[0] & 0xf)
 
-USBD_CLASS_DESCR_DEFINE(primary, 0)
-struct usb_midi_config usb_midi_config_data = {
-	.ac_if = INIT_AC_IF,
-	.ac_cs_if = INIT_AC_CS_IF,
-	.ms_if = INIT_MS_IF,
-	.ms_cs_if = INIT_MS_CS_IF,
-	.out_jacks_emb = {
-		LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, INIT_OUT_JACK, (, ), 0)},
-	.in_jacks_emb = {LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, INIT_IN_JACK, (, ), CONFIG_USB_MIDI_NUM_OUTPUTS)},
-	.element = INIT_ELEMENT,
-	.in_ep = INIT_IN_EP,
-	.in_cs_ep = {.bLength = sizeof(struct usb_midi_bulk_in_ep_descriptor), .bDescriptorType = USB_DESC_CS_ENDPOINT, .bDescriptorSubtype = 0x01, .bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_OUTPUTS, .BaAssocJackID = {LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, IDX_WITH_OFFSET, (, ), 1)}},
-	.out_ep = INIT_OUT_EP,
-	.out_cs_ep = {.bLength = sizeof(struct usb_midi_bulk_out_ep_descriptor), .bDescriptorType = USB_DESC_CS_ENDPOINT, .bDescriptorSubtype = 0x01, .bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_INPUTS, .BaAssocJackID = {LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, IDX_WITH_OFFSET, (, ), 1 + CONFIG_USB_MIDI_NUM_OUTPUTS)}}};
-
-static int temp_tx_buffer_size = 0;
-static uint8_t temp_tx_buffer[EP_MAX_PACKET_SIZE];
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_USB_MIDI_TX_RING_SIZE), "USB MIDI tx ring size must be a power of two");
+
+/*
+ * Encoded packets waiting to be sent, one ring per output cable. Producer is
+ * the app, consumer is the owner of tx_busy.
+ */
+static uint32_t tx_ring_items[CONFIG_USB_MIDI_NUM_OUTPUTS][CONFIG_USB_MIDI_TX_RING_SIZE];
+#define TX_RING_INITIALIZER(cable_num, ...) USB_MIDI_RING_INITIALIZER(tx_ring_items[cable_num])
+static struct usb_midi_ring_t tx_rings[CONFIG_USB_MIDI_NUM_OUTPUTS] = {
+	LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, TX_RING_INITIALIZER, (, ))};
+/* The highest number of packets in a tx ring observed when enqueuing. */
+static uint32_t tx_ring_high_water_mark = 0;
+
+/*
+ * Weighted round robin scheduling of the tx rings. Each cable in turn gets to
+ * put up to its share of packets in transfers, so bulk data enqueued on one
+ * cable only delays packets on other cables by a bounded amount.
+ */
+#define TX_CABLE_SHARE_INITIALIZER(cable_num, ...) CONFIG_USB_MIDI_TX_CABLE_SHARE
+static uint8_t tx_cable_shares[CONFIG_USB_MIDI_NUM_OUTPUTS] = {
+	LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, TX_CABLE_SHARE_INITIALIZER, (, ))};
+/* The cable whose turn it is. Only accessed by the owner of tx_busy. */
+static uint8_t tx_sched_cable = 0;
+/* The number of packets the cable whose turn it is may still send. Only accessed by the owner of tx_busy. */
+static uint8_t tx_sched_credit = 0;
+
+/*
+ * Encoded system realtime packets waiting to be sent. They bypass the tx rings and
+ * outgoing sysex data and go in the very next transfer written.
+ */
+#define TX_REALTIME_RING_SIZE 16
+USB_MIDI_RING_DEFINE(tx_realtime_ring, TX_REALTIME_RING_SIZE);
+
+#ifdef CONFIG_USB_MIDI_SOF
+/* The number of start of frame events so far, i.e the number of the current frame. */
+static atomic_t sof_frame = ATOMIC_INIT(0);
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+/*
+ * Clock and scheduled packets released at the start of their frame. Like
+ * realtime packets, they go in the very next transfer written. Producer is
+ * the start of frame callback.
+ */
+#define TX_TIMED_RING_SIZE 32
+USB_MIDI_RING_DEFINE(tx_timed_ring, TX_TIMED_RING_SIZE);
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+/*
+ * Last-value-wins coalescing. A coalescable message is enqueued as a marker
+ * referring to a slot holding the message. Until the marker is put in a
+ * transfer, newer messages for the same controller replace the message in
+ * the slot. Zero means that the slot is free, since encoded packets are
+ * never zero.
+ */
+static atomic_t tx_coalesce_slots[CONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS];
+/* tx_coalesce_epoch when each slot was taken. Only accessed with tx_enqueue_lock held. */
+static uint32_t tx_coalesce_slot_epochs[CONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS];
+/*
+ * Incremented when enqueuing a message that is not coalesced, so a message
+ * never replaces one enqueued before that message. Only accessed with
+ * tx_enqueue_lock held.
+ */
+static uint32_t tx_coalesce_epoch = 0;
+#endif
+
+/*
+ * Set while a transfer is being assembled or is in flight. Whoever sets it
+ * owns the tx buffer, the consumer side of the tx rings and the packing of
+ * outgoing sysex data. Cleared when there is nothing more to send.
+ */
+static atomic_t tx_busy = ATOMIC_INIT(0);
+
+BUILD_ASSERT(CONFIG_USB_MIDI_TX_NUM_BUFFERS >= 2, "USB MIDI needs at least two tx buffers");
+
+/* A transfer to write to the IN endpoint. */
+struct tx_transfer_t {
+	/* Word aligned, so packets can be copied from the tx rings as is. */
+	uint32_t packets[EP_MAX_PACKET_SIZE / 4];
+	/* Size in bytes. Zero if the transfer is unused. */
+	int size;
+	/* Set if the transfer contains the last packet of the outgoing sysex message. */
+	int ends_sysex;
+};
+
+/*
+ * Transfer buffers, used in order. While one transfer is in flight, the
+ * following ones are filled, so the next transfer can be written as soon
+ * as the one in flight is done. The extra last buffer is for realtime
+ * packets that don't fit in the next filled transfer. Only accessed by
+ * the owner of tx_busy.
+ */
+static struct tx_transfer_t tx_transfers[CONFIG_USB_MIDI_TX_NUM_BUFFERS + 1];
+#define TX_REALTIME_TRANSFER_IDX CONFIG_USB_MIDI_TX_NUM_BUFFERS
+/* Index of the oldest filled transfer that has not been written yet. */
+static int tx_next_idx = 0;
+/* The number of filled transfers that have not been written yet. */
+static int tx_num_filled = 0;
+/* Index of the transfer in flight, or -1 if there is none. */
+static int tx_in_flight_idx = -1;
+
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+/*
+ * Set while the OUT endpoint is left unarmed, making the host NAK, because
+ * the rx queue lacks space for another transfer.
+ */
+static atomic_t rx_paused = ATOMIC_INIT(0);
+#endif
 
 static int usb_midi_is_available = false;
 static struct usb_midi_cb_t user_callbacks = {
@@ -38,9 +137,74 @@ static struct usb_midi_cb_t user_callbacks = {
 	.tx_done_cb = NULL,
 	.sysex_data_cb = NULL,
 	.sysex_end_cb = NULL,
-	.sysex_start_cb = NULL};
+	.sysex_start_cb = NULL,
+	.sysex_tx_done_cb = NULL,
+	.midi_message_batch_cb = NULL};
+
+/* State of the sysex message being sent by usb_midi_sysex_tx(_pull), if any. */
+struct sysex_tx_state_t {
+	/* Set last when starting, so the tx buffer owner never sees a half initialized state. */
+	atomic_t in_progress;
+	uint8_t cable_num;
+	/* The message bytes, if sending from a buffer. */
+	const uint8_t *bytes;
+	/* Provides the message bytes, if not sending from a buffer. */
+	usb_midi_sysex_tx_pull_cb_t pull_cb;
+	uint32_t num_bytes;
+	/* The number of message bytes put in USB MIDI packets so far. */
+	uint32_t num_packed_bytes;
+};
+
+static struct sysex_tx_state_t sysex_tx = {.in_progress = ATOMIC_INIT(0)};
+
+/*
+ * Sysex framing violations. The rx counters are only written by the rx dispatch
+ * context and the tx counters with tx_enqueue_lock held.
+ */
+static struct usb_midi_sysex_stats_t sysex_stats;
+/*
+ * Bit n is set while a sysex message enqueued on cable n is open, i.e its F0
+ * has been enqueued but not its F7. Only accessed with tx_enqueue_lock held.
+ */
+static uint16_t tx_sysex_open_cables = 0;
+/* Serializes the tx ring producers, see tx_enqueue. */
+static struct k_spinlock tx_enqueue_lock;
 
-static void availability_changed(int is_available) {
+/* State of the raw MIDI byte stream sent on a cable with usb_midi_tx_stream. */
+struct tx_stream_t {
+	struct usb_midi_stream_parser_t parser;
+	/* Sysex bytes waiting to be put in a packet, including F0 and F7. */
+	uint8_t sysex_chunk[3];
+	uint8_t sysex_chunk_size;
+	/* MIDI bytes of messages and sysex chunks that could not be enqueued. */
+	uint32_t num_dropped_bytes;
+};
+
+/* Each only accessed by the thread feeding the stream. Zero initialized, which is the initial state. */
+static struct tx_stream_t tx_streams[CONFIG_USB_MIDI_NUM_OUTPUTS];
+
+static void sysex_tx_finish(int result);
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+static void tx_schedule_clear();
+#endif
+
+/* Discards filled transfers that have not been written yet. */
+static void tx_drop_transfers()
+{
+	for (int i = 0; i < ARRAY_SIZE(tx_transfers); i++) {
+		if (i != tx_in_flight_idx) {
+			tx_transfers[i].size = 0;
+			tx_transfers[i].ends_sysex = 0;
+		}
+	}
+	tx_num_filled = 0;
+	if (tx_in_flight_idx != TX_REALTIME_TRANSFER_IDX) {
+		tx_next_idx = (tx_in_flight_idx + 1) % CONFIG_USB_MIDI_TX_NUM_BUFFERS;
+	}
+}
+
+void usb_midi_on_available(int is_available)
+{
 	if (usb_midi_is_available == is_available) {
 		return;
 	}
@@ -48,8 +212,44 @@ static void availability_changed(int is_available) {
 	LOG_INF("device became %s ", is_available ? "available" : "unavailable");
 
 	if (is_available) {
-		temp_tx_buffer_size = 0;
+		/* Drop anything left over from before the device became unavailable. */
+		for (int i = 0; i < CONFIG_USB_MIDI_NUM_OUTPUTS; i++) {
+			usb_midi_ring_clear(&tx_rings[i]);
+		}
+		tx_sched_credit = 0;
+		tx_sysex_open_cables = 0;
+		/* Streams start over, without running status or a partial sysex chunk. */
+		for (int i = 0; i < CONFIG_USB_MIDI_NUM_OUTPUTS; i++) {
+			memset(&tx_streams[i].parser, 0, sizeof(tx_streams[i].parser));
+			tx_streams[i].sysex_chunk_size = 0;
+		}
+		usb_midi_ring_clear(&tx_realtime_ring);
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+		usb_midi_ring_clear(&tx_timed_ring);
+#endif
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+		tx_schedule_clear();
+#endif
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+		/* The markers referring to the slots were dropped. */
+		for (int i = 0; i < CONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS; i++) {
+			atomic_clear(&tx_coalesce_slots[i]);
+		}
+#endif
+		/* A transfer in flight when becoming unavailable never completes. */
+		tx_in_flight_idx = -1;
+		tx_drop_transfers();
+		atomic_clear(&tx_busy);
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+		/* The stack arms the OUT endpoint when configuring the device. */
+		atomic_clear(&rx_paused);
+#endif
+	} else if (atomic_get(&sysex_tx.in_progress)) {
+		sysex_tx_finish(-EIO);
 	}
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+	usb_midi_din_on_available(is_available);
+#endif
 	if (user_callbacks.available_cb) {
 		user_callbacks.available_cb(is_available);
 	}
@@ -64,125 +264,679 @@ void usb_midi_register_callbacks(struct usb_midi_cb_t *cb)
 	user_callbacks.sysex_start_cb = cb->sysex_start_cb;
 	user_callbacks.sysex_data_cb = cb->sysex_data_cb;
 	user_callbacks.sysex_end_cb = cb->sysex_end_cb;
+	user_callbacks.sysex_tx_done_cb = cb->sysex_tx_done_cb;
+	user_callbacks.midi_message_batch_cb = cb->midi_message_batch_cb;
+	user_callbacks.sysex_msg_cb = cb->sysex_msg_cb;
 }
 
-static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+/*
+ * Messages collected for midi_message_batch_cb and sysex data bytes collected
+ * for sysex_data_cb. At most one of them is non-empty at a time and both are
+ * flushed before any other callback, so the order of events is preserved.
+ * Only accessed from the context received packets are dispatched in.
+ */
+static struct usb_midi_event_t rx_batch[EP_MAX_PACKET_SIZE / 4];
+static uint32_t rx_batch_size = 0;
+static uint8_t rx_sysex_span[CONFIG_USB_MIDI_RX_SYSEX_DATA_SPAN];
+static uint8_t rx_sysex_span_size = 0;
+static uint8_t rx_sysex_span_cable_num = 0;
+/*
+ * Parsers for the raw MIDI byte streams some hosts send one byte per CIN 0xF
+ * packet. Zero initialized, which is the initial state. Their in_sysex flags
+ * are kept in sync with rx_sysex_open_cables, since hosts may send some bytes
+ * of sysex messages started in regular packets in CIN 0xF packets.
+ */
+static struct usb_midi_stream_parser_t rx_stream_parsers[16];
+/*
+ * Bit n is set while a sysex message received on cable n is open, i.e its F0
+ * has been received but not its F7. Kept apart from the parsers' in_sysex
+ * flags, which the parsers update before invoking the sysex callbacks.
+ * Only accessed from the context received packets are dispatched in.
+ */
+static uint16_t rx_sysex_open_cables = 0;
+
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+#define RX_SYSEX_BLOCK_SIZE                                                                        \
+	ROUND_UP(sizeof(struct usb_midi_sysex_block_t) + CONFIG_USB_MIDI_RX_SYSEX_BLOCK_SIZE,      \
+		 sizeof(void *))
+
+K_MEM_SLAB_DEFINE_STATIC(rx_sysex_slab, RX_SYSEX_BLOCK_SIZE, CONFIG_USB_MIDI_RX_SYSEX_NUM_BLOCKS,
+			 sizeof(void *));
+
+/* Sysex messages being reassembled, by cable number. */
+static struct {
+	struct usb_midi_sysex_block_t *first;
+	struct usb_midi_sysex_block_t *last;
+	uint32_t num_bytes;
+	/* Set when bytes of the message did not fit in the pool. */
+	uint8_t dropped;
+} rx_sysex_msgs[16];
+
+void usb_midi_sysex_free(struct usb_midi_sysex_block_t *blocks)
 {
-	if (ep_status == USB_DC_EP_DATA_OUT) {
-		uint8_t buf[4];
-		uint32_t num_read_bytes = 1;
-		while (num_read_bytes > 0)
-		{
-			int read_rc = usb_read(ep, buf, 4, &num_read_bytes);
-			if (num_read_bytes == 0)
-			{
-				break;
+	while (blocks) {
+		struct usb_midi_sysex_block_t *next = blocks->next;
+		k_mem_slab_free(&rx_sysex_slab, blocks);
+		blocks = next;
+	}
+}
+
+/* Frees the blocks of the message being reassembled on a cable, if any. */
+static void rx_sysex_reset(uint8_t cable_num)
+{
+	usb_midi_sysex_free(rx_sysex_msgs[cable_num].first);
+	rx_sysex_msgs[cable_num].first = NULL;
+	rx_sysex_msgs[cable_num].last = NULL;
+	rx_sysex_msgs[cable_num].num_bytes = 0;
+	rx_sysex_msgs[cable_num].dropped = 0;
+}
+
+static void rx_sysex_append(uint8_t cable_num, const uint8_t *bytes, uint32_t num_bytes)
+{
+	/* Ignore bytes of dropped messages and bytes not preceded by F0 */
+	if (num_bytes == 0 || !user_callbacks.sysex_msg_cb || rx_sysex_msgs[cable_num].dropped ||
+	    (!rx_sysex_msgs[cable_num].first && bytes[0] != 0xf0)) {
+		return;
+	}
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		struct usb_midi_sysex_block_t *last = rx_sysex_msgs[cable_num].last;
+		if (!last || last->num_bytes == CONFIG_USB_MIDI_RX_SYSEX_BLOCK_SIZE) {
+			struct usb_midi_sysex_block_t *block;
+			if (k_mem_slab_alloc(&rx_sysex_slab, (void **)&block, K_NO_WAIT) != 0) {
+				LOG_WRN("Out of sysex blocks, dropping message on cable %d", cable_num);
+				rx_sysex_reset(cable_num);
+				rx_sysex_msgs[cable_num].dropped = 1;
+				return;
+			}
+			block->next = NULL;
+			block->num_bytes = 0;
+			if (last) {
+				last->next = block;
+			} else {
+				rx_sysex_msgs[cable_num].first = block;
 			}
-			struct usb_midi_packet_t packet;
-			enum usb_midi_error_t error = usb_midi_packet_from_usb_bytes(buf, &packet);
+			rx_sysex_msgs[cable_num].last = block;
+			last = block;
+		}
+		last->bytes[last->num_bytes++] = bytes[i];
+	}
+	rx_sysex_msgs[cable_num].num_bytes += num_bytes;
+}
+#endif
+
+/* Delivers collected messages or sysex data bytes. */
+static void rx_flush()
+{
+	if (rx_batch_size > 0) {
+		user_callbacks.midi_message_batch_cb(rx_batch, rx_batch_size);
+		rx_batch_size = 0;
+	}
+	if (rx_sysex_span_size > 0) {
+		if (user_callbacks.sysex_data_cb) {
+			user_callbacks.sysex_data_cb(rx_sysex_span, rx_sysex_span_size,
+						     rx_sysex_span_cable_num);
+		}
+		rx_sysex_span_size = 0;
+	}
+}
+
+static void rx_sysex_close(uint8_t cable_num, int is_truncated);
+
+static void rx_message(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	/* A status byte other than system realtime ends a sysex message without F7. */
+	if (bytes[0] < 0xf8 && (rx_sysex_open_cables & BIT(cable_num))) {
+		rx_sysex_close(cable_num, 1);
+	}
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+	usb_midi_din_on_rx_message(cable_num, bytes, num_bytes);
+#endif
+	if (!user_callbacks.midi_message_batch_cb) {
+		rx_flush();
+		if (user_callbacks.midi_message_cb) {
+			user_callbacks.midi_message_cb(bytes, num_bytes, cable_num);
+		}
+		return;
+	}
+
+	if (rx_sysex_span_size > 0) {
+		rx_flush();
+	}
+	struct usb_midi_event_t *event = &rx_batch[rx_batch_size++];
+	event->cable_num = cable_num;
+	event->num_bytes = num_bytes;
+	memcpy(event->bytes, bytes, sizeof(event->bytes));
+}
+
+static void rx_sysex_start(uint8_t cable_num)
+{
+	if (rx_sysex_open_cables & BIT(cable_num)) {
+		rx_sysex_close(cable_num, 1);
+	}
+	rx_sysex_open_cables |= BIT(cable_num);
+	rx_stream_parsers[cable_num].in_sysex = 1;
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+	usb_midi_din_on_rx_sysex(cable_num, (const uint8_t[]){0xf0}, 1);
+#endif
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+	rx_sysex_append(cable_num, (const uint8_t[]){0xf0}, 1);
+#endif
+	rx_flush();
+	if (user_callbacks.sysex_start_cb) {
+		user_callbacks.sysex_start_cb(cable_num);
+	}
+}
+
+static void rx_sysex_data(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	if (!(rx_sysex_open_cables & BIT(cable_num))) {
+		sysex_stats.num_rx_stray_bytes += num_data_bytes;
+		return;
+	}
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+	usb_midi_din_on_rx_sysex(cable_num, data_bytes, num_data_bytes);
+#endif
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+	rx_sysex_append(cable_num, data_bytes, num_data_bytes);
+#endif
+	if (rx_batch_size > 0 ||
+	    (rx_sysex_span_size > 0 && cable_num != rx_sysex_span_cable_num) ||
+	    rx_sysex_span_size + num_data_bytes > sizeof(rx_sysex_span)) {
+		rx_flush();
+	}
+	memcpy(&rx_sysex_span[rx_sysex_span_size], data_bytes, num_data_bytes);
+	rx_sysex_span_size += num_data_bytes;
+	rx_sysex_span_cable_num = cable_num;
+}
+
+/* Ends the sysex message on a cable, which was either ended by F7 or truncated. */
+static void rx_sysex_close(uint8_t cable_num, int is_truncated)
+{
+	if (is_truncated) {
+		LOG_WRN("sysex message on cable %d ended without F7", cable_num);
+		sysex_stats.num_rx_truncated++;
+	}
+	rx_sysex_open_cables &= ~BIT(cable_num);
+	rx_stream_parsers[cable_num].in_sysex = 0;
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+	usb_midi_din_on_rx_sysex(cable_num, (const uint8_t[]){0xf7}, 1);
+#endif
+	rx_flush();
+	if (user_callbacks.sysex_end_cb) {
+		user_callbacks.sysex_end_cb(cable_num);
+	}
+#ifdef CONFIG_USB_MIDI_RX_SYSEX_REASSEMBLY
+	if (is_truncated) {
+		/* Only complete messages are passed to sysex_msg_cb */
+		rx_sysex_reset(cable_num);
+	} else if (rx_sysex_msgs[cable_num].first) {
+		rx_sysex_append(cable_num, (const uint8_t[]){0xf7}, 1);
+	}
+	if (rx_sysex_msgs[cable_num].first) {
+		/* The app owns the blocks from now on */
+		struct usb_midi_sysex_block_t *blocks = rx_sysex_msgs[cable_num].first;
+		uint32_t num_bytes = rx_sysex_msgs[cable_num].num_bytes;
+		rx_sysex_msgs[cable_num].first = NULL;
+		rx_sysex_reset(cable_num);
+		user_callbacks.sysex_msg_cb(blocks, num_bytes, cable_num);
+	}
+	rx_sysex_msgs[cable_num].dropped = 0;
+#endif
+}
 
-			if (error != USB_MIDI_SUCCESS)
-			{
-				LOG_ERR("Failed to read packet with error %d", error);
+static void rx_sysex_end(uint8_t cable_num)
+{
+	if (!(rx_sysex_open_cables & BIT(cable_num))) {
+		sysex_stats.num_rx_stray_bytes++;
+		return;
+	}
+	rx_sysex_close(cable_num, 0);
+}
+
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+/*
+ * The cycle count at the two most recent start of frame events, indexed by
+ * frame number. The slot of the latest frame is written before the frame
+ * number is published, so readers never see a slot being written, even when
+ * interrupting usb_midi_on_sof.
+ */
+static uint32_t rx_sof_cycles[2];
+/* The arrival time of the transfer being dispatched. Only accessed when dispatching. */
+static struct usb_midi_timestamp_t rx_timestamp;
+
+/* Returns the arrival time of a transfer received now. */
+static struct usb_midi_timestamp_t rx_timestamp_now()
+{
+	struct usb_midi_timestamp_t timestamp;
+	uint32_t frame;
+	do {
+		frame = atomic_get(&sof_frame);
+		timestamp.frame = frame;
+		timestamp.cycles = k_cycle_get_32() - rx_sof_cycles[frame & 1];
+	} while (frame != (uint32_t)atomic_get(&sof_frame));
+	return timestamp;
+}
+
+void usb_midi_rx_timestamp(struct usb_midi_timestamp_t *timestamp)
+{
+	*timestamp = rx_timestamp;
+}
+#endif
+
+/* Parses received packets and invokes the user callbacks. */
+static void rx_dispatch(uint8_t *bytes, uint32_t num_bytes)
+{
+	static struct usb_midi_parse_cb_t parse_cb = {
+		.message_cb = rx_message,
+		.sysex_data_cb = rx_sysex_data,
+		.sysex_end_cb = rx_sysex_end,
+		.sysex_start_cb = rx_sysex_start};
+
+	/* Parse the packets in place. */
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		uint8_t *packet_bytes = &bytes[i];
+		LOG_DBG_PACKET_BYTES(packet_bytes);
+		if ((packet_bytes[0] & 0xf) == USB_MIDI_CIN_1BYTE_DATA) {
+			uint8_t cable_num = packet_bytes[0] >> 4;
+			uint8_t byte = packet_bytes[1];
+			/*
+			 * A status byte other than F7 or system realtime ends a sysex
+			 * message without F7, like in a regular packet.
+			 */
+			if (byte >= 0x80 && byte < 0xf8 && byte != 0xf7 &&
+			    (rx_sysex_open_cables & BIT(cable_num))) {
+				rx_sysex_close(cable_num, 1);
 			}
-			else
-			{
-				LOG_DBG_PACKET(packet);
-				struct usb_midi_parse_cb_t parse_cb = {
-					.message_cb = user_callbacks.midi_message_cb,
-					.sysex_data_cb = user_callbacks.sysex_data_cb,
-					.sysex_end_cb = user_callbacks.sysex_end_cb,
-					.sysex_start_cb = user_callbacks.sysex_start_cb};
-				error = usb_midi_parse_packet(packet.bytes, &parse_cb);
-				if (error != USB_MIDI_SUCCESS)
-				{
-					LOG_ERR("Failed to parse packet with error %d", error);
-				}
+			usb_midi_stream_parse_byte(&rx_stream_parsers[cable_num], byte,
+						   cable_num, &parse_cb);
+			continue;
+		}
+		enum usb_midi_error_t error = usb_midi_parse_packet(packet_bytes, &parse_cb);
+		if (error != USB_MIDI_SUCCESS)
+		{
+			LOG_ERR("Failed to parse packet with error %d", error);
+		}
+	}
+
+	/* Never hold back events until the next transfer. */
+	rx_flush();
+}
+
+#ifdef CONFIG_USB_MIDI_RX_DEFERRED
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_USB_MIDI_RX_QUEUE_SIZE), "USB MIDI rx queue size must be a power of two");
+BUILD_ASSERT(CONFIG_USB_MIDI_RX_QUEUE_SIZE >= EP_MAX_PACKET_SIZE / 4, "USB MIDI rx queue must fit a transfer");
+
+/* Received packets waiting to be dispatched. Producer is the OUT endpoint callback. */
+USB_MIDI_RING_DEFINE(rx_ring, CONFIG_USB_MIDI_RX_QUEUE_SIZE);
+/* The number of received packets dropped because rx_ring was full. */
+static uint32_t rx_num_dropped_packets = 0;
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+/* The arrival time of the packet in each slot of rx_ring. */
+static struct usb_midi_timestamp_t rx_ring_timestamps[CONFIG_USB_MIDI_RX_QUEUE_SIZE];
+#endif
+
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+/*
+ * Re-arms the OUT endpoint if it was paused and rx_ring has room for a full
+ * transfer. Called from both sides of rx_ring; clearing rx_paused decides
+ * which one re-arms.
+ */
+static void rx_resume_if_space()
+{
+	if (atomic_get(&rx_paused) && usb_midi_ring_space(&rx_ring) >= EP_MAX_PACKET_SIZE / 4 &&
+	    atomic_cas(&rx_paused, 1, 0)) {
+		LOG_DBG("rx queue has space, resuming OUT endpoint");
+		usb_midi_backend_read_continue();
+	}
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_RX_RATE_LIMIT
+BUILD_ASSERT(CONFIG_USB_MIDI_RX_RATE_LIMIT_BURST >= 3, "USB MIDI rx rate limit burst must fit a packet");
+
+/*
+ * A token bucket pacing the dispatching of MIDI bytes received on an input
+ * cable. Credit is in bytes times ticks per second, to avoid fractions.
+ * Only accessed when dispatching, except for bytes_per_sec.
+ */
+struct rx_rate_limiter_t {
+	/* Zero means no limit. */
+	uint32_t bytes_per_sec;
+	int64_t credit;
+	int64_t last_update_ticks;
+};
+
+#define RX_RATE_LIMITER_INITIALIZER(cable_num, ...)                                                \
+	{                                                                                          \
+		.bytes_per_sec = CONFIG_USB_MIDI_RX_RATE_LIMIT_BYTES_PER_SEC                       \
+	}
+static struct rx_rate_limiter_t rx_rate_limiters[CONFIG_USB_MIDI_NUM_INPUTS] = {
+	LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, RX_RATE_LIMITER_INITIALIZER, (, ))};
+
+/**
+ * Takes credit for as many of the given packets as possible, in order.
+ * @param wait_ticks Set to the number of ticks until there is credit for the first
+ * packet that got none, if any.
+ * @return The number of leading packets there was credit for.
+ */
+static uint32_t rx_rate_limit(const uint32_t *packets, uint32_t num_packets, int64_t *wait_ticks)
+{
+	const int64_t max_credit =
+		(int64_t)CONFIG_USB_MIDI_RX_RATE_LIMIT_BURST * CONFIG_SYS_CLOCK_TICKS_PER_SEC;
+	int64_t now = k_uptime_ticks();
+	for (uint32_t i = 0; i < num_packets; i++) {
+		const uint8_t *packet_bytes = (const uint8_t *)&packets[i];
+		uint8_t cable_num = packet_bytes[0] >> 4;
+		if (cable_num >= CONFIG_USB_MIDI_NUM_INPUTS) {
+			continue;
+		}
+		struct rx_rate_limiter_t *limiter = &rx_rate_limiters[cable_num];
+		uint32_t bytes_per_sec = limiter->bytes_per_sec;
+		if (bytes_per_sec == 0) {
+			continue;
+		}
+		limiter->credit = MIN(max_credit, limiter->credit +
+							  (now - limiter->last_update_ticks) * bytes_per_sec);
+		limiter->last_update_ticks = now;
+		int64_t cost = (int64_t)usb_midi_cin_num_midi_bytes(packet_bytes[0] & 0xf) *
+			       CONFIG_SYS_CLOCK_TICKS_PER_SEC;
+		if (limiter->credit < cost) {
+			*wait_ticks = (cost - limiter->credit + bytes_per_sec - 1) / bytes_per_sec;
+			return i;
+		}
+		limiter->credit -= cost;
+	}
+	return num_packets;
+}
+
+int usb_midi_rx_set_cable_rate(uint8_t cable_number, uint32_t bytes_per_sec)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_INPUTS) {
+		return -EINVAL;
+	}
+	rx_rate_limiters[cable_number].bytes_per_sec = bytes_per_sec;
+	return 0;
+}
+#endif
+
+/**
+ * Dispatches the packets in rx_ring.
+ * @return 0 if rx_ring was drained, otherwise the number of ticks to wait before
+ * draining again, because of rate limiting.
+ */
+static int64_t rx_drain()
+{
+	uint32_t packets[EP_MAX_PACKET_SIZE / 4];
+	uint32_t num_packets;
+	int64_t wait_ticks = 0;
+	while ((num_packets = usb_midi_ring_peek(&rx_ring, packets, ARRAY_SIZE(packets))) > 0) {
+#ifdef CONFIG_USB_MIDI_RX_RATE_LIMIT
+		/* Packets without credit stay in rx_ring, eventually making the host wait. */
+		num_packets = rx_rate_limit(packets, num_packets, &wait_ticks);
+#endif
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+		/* Copied before the slots are released. */
+		struct usb_midi_timestamp_t timestamps[ARRAY_SIZE(packets)];
+		for (uint32_t i = 0; i < num_packets; i++) {
+			timestamps[i] = rx_ring_timestamps[(rx_ring.tail + i) & (rx_ring.size - 1)];
+		}
+#endif
+		usb_midi_ring_skip(&rx_ring, num_packets);
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+		/* Let the host send more while dispatching. */
+		rx_resume_if_space();
+#endif
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+		/* Dispatch the packets of each transfer separately, so batches share a timestamp. */
+		for (uint32_t start = 0, end = 1; end <= num_packets; end++) {
+			if (end == num_packets ||
+			    memcmp(&timestamps[end], &timestamps[start], sizeof(timestamps[0])) != 0) {
+				rx_timestamp = timestamps[start];
+				rx_dispatch((uint8_t *)&packets[start], 4 * (end - start));
+				start = end;
 			}
 		}
+#else
+		rx_dispatch((uint8_t *)packets, 4 * num_packets);
+#endif
+		if (wait_ticks > 0) {
+			break;
+		}
+	}
+	return wait_ticks;
+}
+
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_THREAD
+static K_SEM_DEFINE(rx_sem, 0, 1);
+
+static void rx_thread_main(void *p1, void *p2, void *p3)
+{
+	int64_t wait_ticks = 0;
+	while (1) {
+		k_sem_take(&rx_sem, wait_ticks > 0 ? K_TICKS(wait_ticks) : K_FOREVER);
+		wait_ticks = rx_drain();
+	}
+}
+
+K_THREAD_DEFINE(usb_midi_rx_thread, CONFIG_USB_MIDI_RX_THREAD_STACK_SIZE, rx_thread_main, NULL, NULL,
+		NULL, CONFIG_USB_MIDI_RX_THREAD_PRIORITY, 0, 0);
+
+static void rx_schedule()
+{
+	k_sem_give(&rx_sem);
+}
+#else
+static void rx_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(rx_work, rx_work_handler);
+
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+/* Set with usb_midi_rx_set_work_queue. */
+static struct k_work_q *rx_work_q = &k_sys_work_q;
+
+void usb_midi_rx_set_work_queue(struct k_work_q *work_q)
+{
+	rx_work_q = work_q;
+}
+#endif
+
+static void rx_work_schedule(k_timeout_t delay)
+{
+#ifdef CONFIG_USB_MIDI_RX_DISPATCH_WORKQ
+	k_work_schedule_for_queue(rx_work_q, &rx_work, delay);
+#else
+	k_work_schedule(&rx_work, delay);
+#endif
+}
+
+static void rx_work_handler(struct k_work *work)
+{
+	int64_t wait_ticks = rx_drain();
+	if (wait_ticks > 0) {
+		rx_work_schedule(K_TICKS(wait_ticks));
+	}
+}
+
+static void rx_schedule()
+{
+	/* Does nothing if already scheduled, e.g waiting for rate limiting credit. */
+	rx_work_schedule(K_NO_WAIT);
+}
+#endif /* CONFIG_USB_MIDI_RX_DISPATCH_THREAD */
+
+/*
+ * Queues received packets for dispatching outside of the endpoint callback.
+ * With flow control, also re-arms the OUT endpoint if another transfer fits.
+ */
+static void rx_enqueue(uint32_t *packets, uint32_t num_packets)
+{
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+	struct usb_midi_timestamp_t timestamp = rx_timestamp_now();
+#endif
+	for (uint32_t i = 0; i < num_packets; i++) {
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+		/* Published together with the packet by usb_midi_ring_put. */
+		rx_ring_timestamps[rx_ring.head & (rx_ring.size - 1)] = timestamp;
+#endif
+		if (usb_midi_ring_put(&rx_ring, packets[i]) != 0) {
+			rx_num_dropped_packets += num_packets - i;
+			LOG_WRN("rx queue full, dropped %d packets (%d in total)", num_packets - i,
+				rx_num_dropped_packets);
+			break;
+		}
+	}
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+	if (usb_midi_ring_space(&rx_ring) >= EP_MAX_PACKET_SIZE / 4) {
+		usb_midi_backend_read_continue();
 	} else {
-		// printk("USB ep status %d\n", ep_status);
+		LOG_DBG("rx queue full, pausing OUT endpoint");
+		atomic_set(&rx_paused, 1);
+		/* The queue may have been drained before rx_paused was set. */
+		rx_resume_if_space();
 	}
+#endif
+	rx_schedule();
 }
+#endif /* CONFIG_USB_MIDI_RX_DEFERRED */
 
-static void midi_in_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+void usb_midi_on_out_data()
 {
-	if (ep_status == USB_DC_EP_DATA_IN && user_callbacks.tx_done_cb)
+	/* Drain the whole transfer with a single read. Word aligned for rx_enqueue. */
+	uint32_t buf[EP_MAX_PACKET_SIZE / 4];
+	uint32_t num_read_bytes = 0;
+	int read_rc = usb_midi_backend_read_wait((uint8_t *)buf, sizeof(buf), &num_read_bytes);
+	if (read_rc != 0) {
+		LOG_ERR("Failed to read from OUT endpoint with error %d", read_rc);
+		usb_midi_backend_read_continue();
+		return;
+	}
+#ifndef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+	/* With flow control, rx_enqueue re-arms the endpoint if there is room. */
+	usb_midi_backend_read_continue();
+#endif
+	if (num_read_bytes % 4 != 0) {
+		LOG_WRN("Ignoring %d trailing bytes of OUT transfer", num_read_bytes % 4);
+	}
+
+#ifdef CONFIG_USB_MIDI_RX_DEFERRED
+	rx_enqueue(buf, num_read_bytes / 4);
+#else
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+	rx_timestamp = rx_timestamp_now();
+#endif
+	rx_dispatch((uint8_t *)buf, num_read_bytes);
+#endif
+}
+
+static void tx_transfer_done();
+
+void usb_midi_on_in_done()
+{
+	tx_transfer_done();
+	if (user_callbacks.tx_done_cb)
 	{
 		user_callbacks.tx_done_cb();
 	}
 }
 
-static struct usb_ep_cfg_data midi_ep_cfg[] = {
-	{
-		.ep_cb = midi_in_ep_cb,
-		.ep_addr = 0x81,
-	},
-	{
-		.ep_cb = midi_out_ep_cb,
-		.ep_addr = 0x01,
-	}};
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+/* The number of slots to look at when enqueuing a coalescable message. */
+#define TX_COALESCE_MAX_PROBES MIN(8, CONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS)
+
+/* Markers use CIN 0x0 (reserved), which the encoder never produces. Byte 1 is the slot index. */
+#define TX_COALESCE_MARKER_HEADER 0x00
 
-void usb_status_callback(struct usb_cfg_data *cfg,
-						 enum usb_dc_status_code cb_status,
-						 const uint8_t *param)
+/**
+ * Returns the number of leading packet bytes identifying the controller of
+ * a message, or 0 if the message must not be coalesced.
+ */
+static int tx_coalesce_key_size(const struct usb_midi_packet_t *packet)
 {
-	switch (cb_status)
-	{
-	/** USB error reported by the controller */
-	case USB_DC_ERROR:
-		LOG_DBG("USB_DC_ERROR");
-		break;
-	/** USB reset */
-	case USB_DC_RESET:
-		LOG_DBG("USB_DC_RESET");
-		break;
-	/** USB connection established, hardware enumeration is completed */
-	case USB_DC_CONNECTED:
-		LOG_DBG("USB_DC_CONNECTED");
-		break;
-	/** USB configuration done */
-	case USB_DC_CONFIGURED:
-		LOG_DBG("USB_DC_CONFIGURED");
-		availability_changed(1);
-		break;
-	/** USB connection lost */
-	case USB_DC_DISCONNECTED:
-		LOG_DBG("USB_DC_DISCONNECTED");
-		break;
-	/** USB connection suspended by the HOST */
-	case USB_DC_SUSPEND:
-		availability_changed(0);
-		break;
-	/** USB connection resumed by the HOST */
-	case USB_DC_RESUME:
-		LOG_DBG("USB_DC_RESUME");
-		break;
-	/** USB interface selected */
-	case USB_DC_INTERFACE:
-		LOG_DBG("USB_DC_INTERFACE");
-		break;
-	/** Set Feature ENDPOINT_HALT received */
-	case USB_DC_SET_HALT:
-		LOG_DBG("USB_DC_SET_HALT");
-		break;
-	/** Clear Feature ENDPOINT_HALT received */
-	case USB_DC_CLEAR_HALT:
-		LOG_DBG("USB_DC_CLEAR_HALT");
-		break;
-	/** Start of Frame received */
-	case USB_DC_SOF:
-		LOG_DBG("USB_DC_SOF");
-		break;
-	/** Initial USB connection status */
-	case USB_DC_UNKNOWN:
-		LOG_DBG("USB_DC_UNKNOWN");
-		break;
+	switch (packet->cin) {
+	case USB_MIDI_CIN_POLY_KEYPRESS:
+		return 3;
+	case USB_MIDI_CIN_CONTROL_CHANGE: {
+		uint8_t controller = packet->bytes[2];
+		/* Bank select, data entry, (N)RPN and channel mode messages only make sense in sequence. */
+		if (controller == 0 || controller == 32 || controller == 6 || controller == 38 ||
+		    (controller >= 96 && controller <= 101) || controller >= 120) {
+			return 0;
+		}
+		return 3;
+	}
+	case USB_MIDI_CIN_CHANNEL_PRESSURE:
+	case USB_MIDI_CIN_PITCH_BEND_CHANGE:
+		return 2;
+	default:
+		return 0;
 	}
 }
 
-int usb_midi_tx(uint8_t cable_number, uint8_t *midi_bytes)
+/**
+ * Replaces the value of an enqueued message for the same controller as a packet,
+ * if there is one. Otherwise provides the item to put in the cable's tx ring for the packet.
+ * Slots are looked up by linear probing from a hash of the controller.
+ * @param item The packet as a ring item. Set to a marker if a slot was taken for it.
+ * @return 1 if an enqueued message was replaced, otherwise 0.
+ */
+static int tx_coalesce(const struct usb_midi_packet_t *packet, uint32_t *item)
+{
+	int key_size = tx_coalesce_key_size(packet);
+	if (key_size == 0) {
+		tx_coalesce_epoch++;
+		return 0;
+	}
+
+	uint32_t key = 0;
+	memcpy(&key, packet->bytes, key_size);
+	uint32_t hash = (key * 2654435761u) >> 16;
+	int free_slot_idx = -1;
+	for (int i = 0; i < TX_COALESCE_MAX_PROBES; i++) {
+		uint32_t slot_idx = (hash + i) % CONFIG_USB_MIDI_TX_COALESCE_NUM_SLOTS;
+		uint32_t pending_item = (uint32_t)atomic_get(&tx_coalesce_slots[slot_idx]);
+		if (pending_item == 0) {
+			if (free_slot_idx < 0) {
+				free_slot_idx = slot_idx;
+			}
+		} else if (tx_coalesce_slot_epochs[slot_idx] == tx_coalesce_epoch &&
+			   memcmp(&pending_item, packet->bytes, key_size) == 0) {
+			if (atomic_cas(&tx_coalesce_slots[slot_idx], pending_item, *item)) {
+				return 1;
+			}
+			/* The marker was just put in a transfer, freeing the slot. */
+			free_slot_idx = slot_idx;
+			break;
+		}
+	}
+
+	/* Only take a slot if the marker is sure to fit. The consumer can only free up space. */
+	if (free_slot_idx >= 0 && usb_midi_ring_space(&tx_rings[packet->cable_num]) > 0) {
+		atomic_set(&tx_coalesce_slots[free_slot_idx], *item);
+		tx_coalesce_slot_epochs[free_slot_idx] = tx_coalesce_epoch;
+		uint8_t marker[4] = {TX_COALESCE_MARKER_HEADER, free_slot_idx, 0, 0};
+		memcpy(item, marker, 4);
+	}
+	return 0;
+}
+
+/* Replaces markers among packets taken from a tx ring with the latest message in their slots. */
+static void tx_coalesce_resolve(uint32_t *packets, uint32_t num_packets)
+{
+	for (uint32_t i = 0; i < num_packets; i++) {
+		uint8_t *bytes = (uint8_t *)&packets[i];
+		if (bytes[0] == TX_COALESCE_MARKER_HEADER) {
+			packets[i] = (uint32_t)atomic_clear(&tx_coalesce_slots[bytes[1]]);
+		}
+	}
+}
+#endif
+
+static int tx_enqueue_locked(uint8_t cable_number, uint8_t *midi_bytes)
 {
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+
 	struct usb_midi_packet_t packet;
 	enum usb_midi_error_t error = usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet);
 	if (error != USB_MIDI_SUCCESS)
@@ -191,55 +945,826 @@ int usb_midi_tx(uint8_t cable_number, uint8_t *midi_bytes)
 		return -EINVAL;
 	}
 	LOG_DBG_PACKET(packet);
-	int write_result = usb_write(0x81, packet.bytes, 4, NULL);
+
+	uint32_t item;
+	memcpy(&item, packet.bytes, 4);
+	if (midi_bytes[0] >= 0xf8 && usb_midi_ring_put(&tx_realtime_ring, item) == 0) {
+		/* Realtime messages may be sent ahead of anything, even inside sysex. */
+		return 0;
+	}
+
+	struct usb_midi_ring_t *ring = &tx_rings[cable_number];
+	/* Sysex chunks not starting with F0 continue or end the open sysex message. */
+	int is_sysex = midi_bytes[0] < 0x80 || midi_bytes[0] == 0xf0 || midi_bytes[0] == 0xf7;
+	if (midi_bytes[0] < 0xf8) {
+		uint16_t cable_bit = BIT(cable_number);
+		if (atomic_get(&sysex_tx.in_progress) && sysex_tx.cable_num == cable_number) {
+			/* Transfers carry enqueued packets ahead of the sysex data, i.e inside the message. */
+			return -EBUSY;
+		}
+		if (is_sysex && midi_bytes[0] != 0xf0) {
+			if (!(tx_sysex_open_cables & cable_bit)) {
+				LOG_ERR("No sysex message to continue on cable %d", cable_number);
+				sysex_stats.num_tx_rejected++;
+				return -EINVAL;
+			}
+		} else if (tx_sysex_open_cables & cable_bit) {
+			/* Any other message ends the open message, like a status byte on a DIN cable. */
+			if (usb_midi_ring_space(ring) < 2) {
+				return -ENOBUFS;
+			}
+			uint8_t sysex_end[4] = {
+				(cable_number << 4) | USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE, 0xf7,
+				0, 0};
+			uint32_t sysex_end_item;
+			memcpy(&sysex_end_item, sysex_end, 4);
+			usb_midi_ring_put(ring, sysex_end_item);
+			tx_sysex_open_cables &= ~cable_bit;
+			sysex_stats.num_tx_truncated++;
+		}
+	}
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+	if (tx_coalesce(&packet, &item)) {
+		return 0;
+	}
+#endif
+	if (usb_midi_ring_put(ring, item) != 0) {
+		return -ENOBUFS;
+	}
+	if (is_sysex) {
+		if (packet.cin == USB_MIDI_CIN_SYSEX_START_OR_CONTINUE) {
+			tx_sysex_open_cables |= BIT(cable_number);
+		} else {
+			tx_sysex_open_cables &= ~BIT(cable_number);
+		}
+	}
+
+	uint32_t num_queued_packets = usb_midi_ring_count(ring);
+	if (num_queued_packets > tx_ring_high_water_mark) {
+		tx_ring_high_water_mark = num_queued_packets;
+	}
+	return 0;
+}
+
+/*
+ * Enqueues a message for any tx producer. The rings and the state shared by
+ * all cables, i.e the realtime lane, the sysex framing, the coalescing slots
+ * and the stats, are updated with the lock held, so e.g the DIN bridge's work
+ * queue and an app thread can enqueue at the same time.
+ */
+static int tx_enqueue(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_enqueue_lock);
+	int result = tx_enqueue_locked(cable_number, midi_bytes);
+	k_spin_unlock(&tx_enqueue_lock, key);
+	return result;
+}
+
+static int sysex_tx_pack(struct tx_transfer_t *transfer);
+
+/* Indicates if there are enqueued packets or unpacked sysex bytes. */
+static int tx_data_pending()
+{
+	for (int i = 0; i < CONFIG_USB_MIDI_NUM_OUTPUTS; i++) {
+		if (usb_midi_ring_count(&tx_rings[i]) > 0) {
+			return 1;
+		}
+	}
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+	if (usb_midi_ring_count(&tx_timed_ring) > 0) {
+		return 1;
+	}
+#endif
+	return usb_midi_ring_count(&tx_realtime_ring) > 0 ||
+	       (atomic_get(&sysex_tx.in_progress) && sysex_tx.num_packed_bytes < sysex_tx.num_bytes);
+}
+
+/**
+ * Moves packets from the tx rings to a transfer, until it's full or the rings are
+ * empty. A cable whose turn it is keeps it, with its remaining share, if the transfer
+ * fills up. A cable with an empty ring loses the rest of its share.
+ */
+static void tx_schedule(struct tx_transfer_t *transfer)
+{
+	int num_idle_cables = 0;
+	while (transfer->size < EP_MAX_PACKET_SIZE && num_idle_cables < CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		if (tx_sched_credit == 0) {
+			tx_sched_credit = tx_cable_shares[tx_sched_cable];
+		}
+		uint32_t num_free_packets = (EP_MAX_PACKET_SIZE - transfer->size) / 4;
+		uint32_t max_num_packets = MIN(num_free_packets, tx_sched_credit);
+		uint32_t *dst = &transfer->packets[transfer->size / 4];
+		uint32_t num_packets = usb_midi_ring_get(&tx_rings[tx_sched_cable], dst, max_num_packets);
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+		tx_coalesce_resolve(dst, num_packets);
+#endif
+		transfer->size += 4 * num_packets;
+		tx_sched_credit -= num_packets;
+		num_idle_cables = num_packets == 0 ? num_idle_cables + 1 : 0;
+		if (num_packets < max_num_packets || tx_sched_credit == 0) {
+			/* The ring is empty or the share is used up. Next cable's turn. */
+			if (++tx_sched_cable == CONFIG_USB_MIDI_NUM_OUTPUTS) {
+				tx_sched_cable = 0;
+			}
+			tx_sched_credit = 0;
+		}
+	}
+}
+
+/* Adds packets from the tx rings followed by outgoing sysex data to a transfer, until it's full. */
+static void tx_fill_transfer(struct tx_transfer_t *transfer)
+{
+	tx_schedule(transfer);
+
+	if (atomic_get(&sysex_tx.in_progress) && sysex_tx_pack(transfer)) {
+		transfer->ends_sysex = 1;
+	}
+}
+
+/**
+ * Fills the transfers following the one in flight, if any, with pending data.
+ * Must only be called by the owner of tx_busy.
+ */
+static void tx_fill()
+{
+	while (1) {
+		struct tx_transfer_t *transfer;
+		int num_used = tx_num_filled + (tx_in_flight_idx >= 0 &&
+						tx_in_flight_idx != TX_REALTIME_TRANSFER_IDX ? 1 : 0);
+		int last_filled_idx = (tx_next_idx + tx_num_filled - 1) % CONFIG_USB_MIDI_TX_NUM_BUFFERS;
+		if (tx_num_filled > 0 && tx_transfers[last_filled_idx].size < EP_MAX_PACKET_SIZE) {
+			/* Top up the last filled transfer */
+			transfer = &tx_transfers[last_filled_idx];
+		} else if (num_used < CONFIG_USB_MIDI_TX_NUM_BUFFERS) {
+			/* Start filling an unused transfer */
+			transfer = &tx_transfers[(tx_next_idx + tx_num_filled) % CONFIG_USB_MIDI_TX_NUM_BUFFERS];
+		} else {
+			/* All transfers are full */
+			break;
+		}
+
+		int was_unused = transfer->size == 0;
+		tx_fill_transfer(transfer);
+		if (transfer->size == 0) {
+			/* No more data */
+			break;
+		}
+		if (was_unused) {
+			tx_num_filled++;
+		}
+		if (transfer->size < EP_MAX_PACKET_SIZE) {
+			/* Ran out of data before the transfer was full */
+			break;
+		}
+	}
+}
+
+/* Gets up to max_num_packets realtime packets, followed by released timed packets. */
+static uint32_t tx_get_realtime(uint32_t *dest, uint32_t max_num_packets)
+{
+	uint32_t num_packets = usb_midi_ring_get(&tx_realtime_ring, dest, max_num_packets);
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+	num_packets += usb_midi_ring_get(&tx_timed_ring, &dest[num_packets],
+					 max_num_packets - num_packets);
+#endif
+	return num_packets;
+}
+
+/**
+ * Puts pending realtime and released timed packets in the transfer to write
+ * next. They go in front of the packets in the oldest filled transfer if they
+ * fit, otherwise in a transfer of their own, which is written before the filled ones.
+ * @return The index of the transfer to write next, or -1 if there is nothing to send.
+ */
+static int tx_take_realtime()
+{
+	struct tx_transfer_t *realtime_transfer = &tx_transfers[TX_REALTIME_TRANSFER_IDX];
+	if (realtime_transfer->size > 0) {
+		/* Left over from a write to a busy endpoint */
+		return TX_REALTIME_TRANSFER_IDX;
+	}
+
+	uint32_t num_realtime_packets = usb_midi_ring_count(&tx_realtime_ring);
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+	num_realtime_packets += usb_midi_ring_count(&tx_timed_ring);
+#endif
+	if (num_realtime_packets == 0) {
+		return tx_num_filled > 0 ? tx_next_idx : -1;
+	}
+
+	struct tx_transfer_t *transfer = &tx_transfers[tx_next_idx];
+	if (transfer->size + 4 * num_realtime_packets <= EP_MAX_PACKET_SIZE) {
+		memmove(&transfer->packets[num_realtime_packets], transfer->packets, transfer->size);
+		tx_get_realtime(transfer->packets, num_realtime_packets);
+		if (transfer->size == 0) {
+			tx_num_filled++;
+		}
+		transfer->size += 4 * num_realtime_packets;
+		return tx_next_idx;
+	}
+
+	realtime_transfer->size = 4 * tx_get_realtime(realtime_transfer->packets, EP_MAX_PACKET_SIZE / 4);
+	return TX_REALTIME_TRANSFER_IDX;
+}
+
+/**
+ * Writes pending realtime packets and the oldest filled transfer to the IN endpoint.
+ * Must only be called by the owner of tx_busy when no transfer is in flight.
+ * @return 0 if a transfer was started, -ENODATA if there was nothing to send,
+ * otherwise a negative error code.
+ */
+static int tx_write_next()
+{
+	int idx = tx_take_realtime();
+	if (idx < 0) {
+		return -ENODATA;
+	}
+
+	struct tx_transfer_t *transfer = &tx_transfers[idx];
+	int write_result = usb_midi_backend_write((uint8_t *)transfer->packets, transfer->size);
+	if (write_result == 0) {
+		tx_in_flight_idx = idx;
+		if (idx != TX_REALTIME_TRANSFER_IDX) {
+			tx_next_idx = (tx_next_idx + 1) % CONFIG_USB_MIDI_TX_NUM_BUFFERS;
+			tx_num_filled--;
+		}
+	} else if (write_result != -EAGAIN) {
+		/* Drop pending transfers. If the endpoint was just busy, they're sent later. */
+		LOG_ERR("Failed to write %d bytes to IN endpoint with error %d", transfer->size, write_result);
+		tx_drop_transfers();
+		if (atomic_get(&sysex_tx.in_progress)) {
+			sysex_tx_finish(write_result);
+		}
+	}
 	return write_result;
 }
 
+static int tx_kick();
+
+static void tx_retry_work_handler(struct k_work *work)
+{
+	tx_kick();
+}
+
+/* Writes again after the IN endpoint was busy, about a high speed frame later. */
+static K_WORK_DELAYABLE_DEFINE(tx_retry_work, tx_retry_work_handler);
+#define TX_RETRY_DELAY K_USEC(125)
+
+/**
+ * Starts a transfer, unless one is already in flight. If the IN endpoint is busy,
+ * writing is retried until it isn't.
+ * @return 0 if a transfer was started or is in flight, if there is nothing to send
+ * or if the IN endpoint was busy, otherwise a negative error code.
+ */
+static int tx_kick()
+{
+	while (atomic_cas(&tx_busy, 0, 1)) {
+		/*
+		 * Fill all transfer buffers up front. Once a transfer is written, its
+		 * completion callback may run at any time and takes over the buffers.
+		 */
+		tx_fill();
+		int write_result = tx_write_next();
+		if (write_result == 0) {
+			/* Transfer in flight. tx_busy is cleared when there is nothing more to send. */
+			return 0;
+		}
+		atomic_clear(&tx_busy);
+		if (write_result == -EAGAIN) {
+			k_work_schedule(&tx_retry_work, TX_RETRY_DELAY);
+			return 0;
+		}
+		if (write_result != -ENODATA) {
+			return write_result;
+		}
+		/*
+		 * Data enqueued after the transfers were filled but before tx_busy
+		 * was cleared would be stuck until the next kick. Check again.
+		 */
+		if (!tx_data_pending()) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Called when a transfer is done. Starts the next transfer, if there is anything to send. */
+static void tx_transfer_done()
+{
+	/* tx_busy is still set, i.e this context owns the transfer buffers. */
+	struct tx_transfer_t *done_transfer = &tx_transfers[tx_in_flight_idx];
+	int ends_sysex = done_transfer->ends_sysex;
+	done_transfer->size = 0;
+	done_transfer->ends_sysex = 0;
+	tx_in_flight_idx = -1;
+
+	/*
+	 * The next transfer was filled while this one was in flight. If it's the
+	 * last filled one, top it up with packets enqueued since. Then write it
+	 * right away, before doing anything else, to keep the bus busy.
+	 */
+	if (tx_num_filled <= 1) {
+		struct tx_transfer_t *next_transfer = &tx_transfers[tx_next_idx];
+		int was_unused = next_transfer->size == 0;
+		tx_fill_transfer(next_transfer);
+		if (was_unused && next_transfer->size > 0) {
+			tx_num_filled++;
+		}
+	}
+	int write_result = tx_write_next();
+
+	if (ends_sysex) {
+		sysex_tx_finish(0);
+	}
+
+	if (write_result == 0) {
+		/* Fill the following transfers while the next one is in flight. */
+		tx_fill();
+	} else {
+		atomic_clear(&tx_busy);
+		if (write_result == -ENODATA) {
+			tx_kick();
+		} else if (write_result == -EAGAIN) {
+			k_work_schedule(&tx_retry_work, TX_RETRY_DELAY);
+		}
+	}
+}
+
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+static void tx_flush_work_handler(struct k_work *work)
+{
+	tx_kick();
+}
+
+static K_WORK_DELAYABLE_DEFINE(tx_flush_work, tx_flush_work_handler);
+
+/*
+ * Sends enqueued packets right away if they fill a transfer or a realtime
+ * message was enqueued, otherwise once the latency budget of the oldest held
+ * packet has run out.
+ */
+static int tx_auto_flush(int has_realtime)
+{
+	if (has_realtime) {
+		return tx_kick();
+	}
+	uint32_t num_pending_packets = 0;
+	for (int i = 0; i < CONFIG_USB_MIDI_NUM_OUTPUTS; i++) {
+		num_pending_packets += usb_midi_ring_count(&tx_rings[i]);
+	}
+	if (num_pending_packets >= EP_MAX_PACKET_SIZE / 4) {
+		return tx_kick();
+	}
+	/* Does nothing if already scheduled, i.e the deadline is kept. */
+	k_work_schedule(&tx_flush_work, K_USEC(CONFIG_USB_MIDI_TX_AUTO_FLUSH_BUDGET_US));
+	return 0;
+}
+#endif
+
+int usb_midi_tx(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	int enqueue_result = tx_enqueue(cable_number, midi_bytes);
+	if (enqueue_result != 0) {
+		return enqueue_result;
+	}
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+	return tx_auto_flush(midi_bytes[0] >= 0xf8);
+#else
+	return tx_kick();
+#endif
+}
+
 int usb_midi_tx_buffer_is_full() {
-	return temp_tx_buffer_size == EP_MAX_PACKET_SIZE;
+	for (int i = 0; i < CONFIG_USB_MIDI_NUM_OUTPUTS; i++) {
+		if (usb_midi_ring_space(&tx_rings[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 int usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t* midi_bytes) {
-	if (usb_midi_tx_buffer_is_full()) {
-		return -1;
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+	int enqueue_result = tx_enqueue(cable_number, midi_bytes);
+	if (enqueue_result != 0) {
+		return enqueue_result;
 	}
+	return tx_auto_flush(midi_bytes[0] >= 0xf8);
+#else
+	return tx_enqueue(cable_number, midi_bytes);
+#endif
+}
 
-	struct usb_midi_packet_t packet;
-	enum usb_midi_error_t error = usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet);
-	if (error != USB_MIDI_SUCCESS)
-	{
-		LOG_ERR("Building packet from MIDI bytes %02x %02x %02x failed with error %d", midi_bytes[0], midi_bytes[1], midi_bytes[2], error);
+int usb_midi_tx_buffer_send() {
+	return tx_kick();
+}
+
+int usb_midi_tx_buffer_high_water_mark(int reset) {
+	int high_water_mark = tx_ring_high_water_mark;
+	if (reset) {
+		tx_ring_high_water_mark = 0;
+	}
+	return high_water_mark;
+}
+
+int usb_midi_tx_set_cable_share(uint8_t cable_number, uint8_t num_packets)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS || num_packets == 0 ||
+	    num_packets > EP_MAX_PACKET_SIZE / 4) {
 		return -EINVAL;
 	}
+	tx_cable_shares[cable_number] = num_packets;
+	return 0;
+}
+
+#ifdef CONFIG_USB_MIDI_SOF
+uint32_t usb_midi_frame()
+{
+	return atomic_get(&sof_frame);
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_USB_MIDI_TX_SCHEDULE_SIZE), "USB MIDI tx schedule size must be a power of two");
+
+/*
+ * Messages passed to usb_midi_tx_at, as pairs of items: the frame to send the
+ * message in, followed by the encoded packet. Producer is the app, consumer is
+ * the start of frame callback, which moves them to tx_sched_heap.
+ */
+USB_MIDI_RING_DEFINE(tx_sched_ring, 2 * CONFIG_USB_MIDI_TX_SCHEDULE_SIZE);
+
+/* A scheduled message waiting for its frame. */
+struct tx_sched_entry_t {
+	uint32_t frame;
+	/* Orders messages scheduled for the same frame by when they were scheduled. */
+	uint32_t seq;
+	uint32_t packet;
+};
+
+/*
+ * A binary min-heap of the scheduled messages by frame, then by seq. Only
+ * accessed from the start of frame callback and usb_midi_on_available, which
+ * the USB stack invokes from the same context.
+ */
+static struct tx_sched_entry_t tx_sched_heap[CONFIG_USB_MIDI_TX_SCHEDULE_SIZE];
+static uint32_t tx_sched_heap_size = 0;
+static uint32_t tx_sched_seq = 0;
+
+/* Indicates if entry a is due before entry b. Frame numbers are compared modulo 2^32. */
+static inline int tx_sched_before(const struct tx_sched_entry_t *a,
+				  const struct tx_sched_entry_t *b)
+{
+	int32_t frame_diff = (int32_t)(a->frame - b->frame);
+	return frame_diff < 0 || (frame_diff == 0 && (int32_t)(a->seq - b->seq) < 0);
+}
+
+static void tx_sched_heap_push(const struct tx_sched_entry_t *entry)
+{
+	uint32_t i = tx_sched_heap_size++;
+	while (i > 0 && tx_sched_before(entry, &tx_sched_heap[(i - 1) / 2])) {
+		tx_sched_heap[i] = tx_sched_heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	tx_sched_heap[i] = *entry;
+}
+
+static void tx_sched_heap_pop()
+{
+	struct tx_sched_entry_t last = tx_sched_heap[--tx_sched_heap_size];
+	uint32_t i = 0;
+	while (2 * i + 1 < tx_sched_heap_size) {
+		uint32_t child = 2 * i + 1;
+		if (child + 1 < tx_sched_heap_size &&
+		    tx_sched_before(&tx_sched_heap[child + 1], &tx_sched_heap[child])) {
+			child++;
+		}
+		if (!tx_sched_before(&tx_sched_heap[child], &last)) {
+			break;
+		}
+		tx_sched_heap[i] = tx_sched_heap[child];
+		i = child;
+	}
+	tx_sched_heap[i] = last;
+}
+
+static void tx_schedule_clear()
+{
+	usb_midi_ring_clear(&tx_sched_ring);
+	tx_sched_heap_size = 0;
+}
+
+/*
+ * Moves newly scheduled messages to the heap and releases the ones due in the
+ * given frame, or before, to tx_timed_ring. Called at the start of each frame.
+ * @return The number of released messages.
+ */
+static int tx_schedule_release(uint32_t frame)
+{
+	uint32_t items[2];
+	while (tx_sched_heap_size < CONFIG_USB_MIDI_TX_SCHEDULE_SIZE &&
+	       usb_midi_ring_count(&tx_sched_ring) >= 2) {
+		usb_midi_ring_get(&tx_sched_ring, items, 2);
+		struct tx_sched_entry_t entry = {
+			.frame = items[0], .seq = tx_sched_seq++, .packet = items[1]};
+		tx_sched_heap_push(&entry);
+	}
 
-	for (int i = 0; i < 4; i++) {
-		temp_tx_buffer[temp_tx_buffer_size] = packet.bytes[i];
-		temp_tx_buffer_size++;
+	int num_released = 0;
+	while (tx_sched_heap_size > 0 && (int32_t)(tx_sched_heap[0].frame - frame) <= 0) {
+		if (usb_midi_ring_put(&tx_timed_ring, tx_sched_heap[0].packet) != 0) {
+			/* The rest go in a later frame. */
+			break;
+		}
+		tx_sched_heap_pop();
+		num_released++;
+	}
+	return num_released;
+}
+
+int usb_midi_tx_at(uint8_t cable_number, uint8_t *midi_bytes, uint32_t frame)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+	if (midi_bytes[0] < 0x80 || midi_bytes[0] == 0xf0 || midi_bytes[0] == 0xf7) {
+		/* Sysex chunks would interleave with enqueued sysex messages. */
+		return -EINVAL;
+	}
+	if (midi_bytes[0] < 0xf8) {
+		/* The timed lane goes ahead of the rings and the sysex data, i.e inside open messages. */
+		k_spinlock_key_t key = k_spin_lock(&tx_enqueue_lock);
+		int in_sysex = (tx_sysex_open_cables & BIT(cable_number)) ||
+			       (atomic_get(&sysex_tx.in_progress) && sysex_tx.cable_num == cable_number);
+		k_spin_unlock(&tx_enqueue_lock, key);
+		if (in_sysex) {
+			return -EBUSY;
+		}
+	}
+	struct usb_midi_packet_t packet;
+	if (usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet) != USB_MIDI_SUCCESS) {
+		return -EINVAL;
 	}
+	if (usb_midi_ring_space(&tx_sched_ring) < 2) {
+		return -ENOBUFS;
+	}
+	uint32_t item;
+	memcpy(&item, packet.bytes, 4);
+	/* The consumer only takes complete pairs. */
+	usb_midi_ring_put(&tx_sched_ring, frame);
+	usb_midi_ring_put(&tx_sched_ring, item);
 	return 0;
 }
+#endif
 
-int usb_midi_tx_buffer_send() {
-	if (temp_tx_buffer_size > 0) {
-		int write_result = usb_write(0x81, temp_tx_buffer, temp_tx_buffer_size, NULL);
-		if (write_result == 0) {
-			temp_tx_buffer_size = 0;
+void usb_midi_on_sof()
+{
+#ifdef CONFIG_USB_MIDI_SOF
+	uint32_t frame = atomic_get(&sof_frame) + 1;
+#ifdef CONFIG_USB_MIDI_RX_TIMESTAMPS
+	rx_sof_cycles[frame & 1] = k_cycle_get_32();
+#endif
+	atomic_set(&sof_frame, frame);
+#ifdef CONFIG_USB_MIDI_TX_TIMED
+	int num_released = 0;
+#ifdef CONFIG_USB_MIDI_CLOCK
+	/* Clock messages go ahead of scheduled ones. */
+	uint32_t clock_packets[USB_MIDI_CLOCK_MAX_PACKETS_PER_FRAME];
+	uint32_t num_clock_packets = usb_midi_clock_on_sof(clock_packets);
+	for (uint32_t i = 0; i < num_clock_packets; i++) {
+		/* Late clock messages are useless, drop them if the lane is full. */
+		num_released += usb_midi_ring_put(&tx_timed_ring, clock_packets[i]) == 0;
+	}
+#endif
+#ifdef CONFIG_USB_MIDI_TX_SCHEDULE
+	num_released += tx_schedule_release(frame);
+#endif
+	if (num_released > 0 && usb_midi_is_available) {
+		tx_kick();
+	}
+#endif
+#endif
+}
+
+static void tx_stream_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	uint8_t midi_bytes[3] = {0, 0, 0};
+	memcpy(midi_bytes, bytes, num_bytes);
+	if (tx_enqueue(cable_num, midi_bytes) != 0) {
+		tx_streams[cable_num].num_dropped_bytes += num_bytes;
+	}
+}
+
+static void tx_stream_sysex_put(struct tx_stream_t *stream, uint8_t cable_num, uint8_t byte)
+{
+	stream->sysex_chunk[stream->sysex_chunk_size++] = byte;
+	if (stream->sysex_chunk_size == 3 || byte == 0xf7) {
+		/* The encoder picks the CIN from where F0 and F7 are in the chunk. */
+		for (int i = stream->sysex_chunk_size; i < 3; i++) {
+			stream->sysex_chunk[i] = 0;
+		}
+		if (tx_enqueue(cable_num, stream->sysex_chunk) != 0) {
+			stream->num_dropped_bytes += stream->sysex_chunk_size;
+		}
+		stream->sysex_chunk_size = 0;
+	}
+}
+
+static void tx_stream_sysex_start_cb(uint8_t cable_num)
+{
+	tx_streams[cable_num].sysex_chunk_size = 0;
+	tx_stream_sysex_put(&tx_streams[cable_num], cable_num, 0xf0);
+}
+
+static void tx_stream_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	for (int i = 0; i < num_data_bytes; i++) {
+		tx_stream_sysex_put(&tx_streams[cable_num], cable_num, data_bytes[i]);
+	}
+}
+
+static void tx_stream_sysex_end_cb(uint8_t cable_num)
+{
+	tx_stream_sysex_put(&tx_streams[cable_num], cable_num, 0xf7);
+}
+
+int usb_midi_tx_stream(uint8_t cable_number, const uint8_t *bytes, uint32_t num_bytes)
+{
+	static const struct usb_midi_parse_cb_t tx_stream_cb = {
+		.message_cb = tx_stream_message_cb,
+		.sysex_start_cb = tx_stream_sysex_start_cb,
+		.sysex_data_cb = tx_stream_sysex_data_cb,
+		.sysex_end_cb = tx_stream_sysex_end_cb};
+
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+
+	struct tx_stream_t *stream = &tx_streams[cable_number];
+	uint32_t num_consumed = 0;
+	int has_realtime = 0;
+	while (num_consumed < num_bytes) {
+		/*
+		 * A byte completes at most two packets: a status byte can both end
+		 * a sysex message and be a single byte message.
+		 */
+		if (usb_midi_ring_space(&tx_rings[cable_number]) < 2) {
+			break;
 		}
-		return write_result;
+		usb_midi_stream_parse_byte(&stream->parser, bytes[num_consumed], cable_number,
+					   &tx_stream_cb);
+		has_realtime |= bytes[num_consumed] >= 0xf8;
+		num_consumed++;
+	}
+
+#ifdef CONFIG_USB_MIDI_TX_AUTO_FLUSH
+	tx_auto_flush(has_realtime);
+#else
+	tx_kick();
+#endif
+	return num_consumed;
+}
+
+uint32_t usb_midi_tx_stream_num_dropped(uint8_t cable_number, int reset)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return 0;
+	}
+	uint32_t num_dropped_bytes = tx_streams[cable_number].num_dropped_bytes;
+	if (reset) {
+		tx_streams[cable_number].num_dropped_bytes = 0;
+	}
+	return num_dropped_bytes;
+}
+
+/**
+ * Puts as many bytes of the outgoing sysex message as fit in a transfer.
+ * Each three byte chunk goes in a packet with CIN 0x4 (SysEx starts or continues),
+ * except the last chunk of the message, whose CIN depends on its size.
+ * @return 1 if the last packet of the message was put in the transfer, otherwise 0.
+ */
+static int sysex_tx_pack(struct tx_transfer_t *transfer)
+{
+	uint32_t num_free_packets = (EP_MAX_PACKET_SIZE - transfer->size) / 4;
+	uint32_t num_remaining_bytes = sysex_tx.num_bytes - sysex_tx.num_packed_bytes;
+	uint32_t num_bytes = MIN(num_remaining_bytes, 3 * num_free_packets);
+	if (num_bytes == 0) {
+		return 0;
+	}
+
+	const uint8_t *src;
+	uint8_t pulled_bytes[3 * (EP_MAX_PACKET_SIZE / 4)];
+	if (sysex_tx.pull_cb) {
+		sysex_tx.pull_cb(pulled_bytes, sysex_tx.num_packed_bytes, num_bytes);
+		src = pulled_bytes;
+	} else {
+		src = &sysex_tx.bytes[sysex_tx.num_packed_bytes];
+	}
+
+	uint8_t *dst = (uint8_t *)transfer->packets + transfer->size;
+	uint8_t header = (sysex_tx.cable_num << 4) | USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+	uint32_t num_full_chunks = num_bytes / 3;
+	for (uint32_t i = 0; i < num_full_chunks; i++) {
+		dst[0] = header;
+		dst[1] = src[0];
+		dst[2] = src[1];
+		dst[3] = src[2];
+		dst += 4;
+		src += 3;
 	}
+
+	uint32_t last_chunk_size = num_bytes - 3 * num_full_chunks;
+	if (last_chunk_size > 0) {
+		dst[0] = header;
+		dst[1] = src[0];
+		dst[2] = last_chunk_size > 1 ? src[1] : 0;
+		dst[3] = 0;
+		dst += 4;
+	}
+
+	int is_last_packet = num_bytes == num_remaining_bytes;
+	if (is_last_packet) {
+		/*
+		 * The message ends in the last packet. Its CIN is
+		 * 0x5, 0x6 or 0x7 for 1, 2 or 3 bytes respectively.
+		 */
+		uint8_t last_packet_size = last_chunk_size > 0 ? last_chunk_size : 3;
+		dst[-4] = (sysex_tx.cable_num << 4) |
+			  (USB_MIDI_CIN_SYSEX_START_OR_CONTINUE + last_packet_size);
+	}
+
+	transfer->size = dst - (uint8_t *)transfer->packets;
+	sysex_tx.num_packed_bytes += num_bytes;
+	return is_last_packet;
+}
+
+static void sysex_tx_finish(int result)
+{
+	atomic_clear(&sysex_tx.in_progress);
+	if (result != 0) {
+		LOG_ERR("sysex tx on cable %d failed with error %d", sysex_tx.cable_num, result);
+	}
+	if (user_callbacks.sysex_tx_done_cb) {
+		user_callbacks.sysex_tx_done_cb(sysex_tx.cable_num, result);
+	}
+}
+
+static int sysex_tx_start(uint8_t cable_number, const uint8_t *bytes, uint32_t num_bytes,
+			  usb_midi_sysex_tx_pull_cb_t pull_cb)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS || num_bytes < 2) {
+		return -EINVAL;
+	}
+	if (!usb_midi_is_available) {
+		return -EIO;
+	}
+	/* Starting under the lock keeps enqueued messages out of the message on the cable. */
+	k_spinlock_key_t key = k_spin_lock(&tx_enqueue_lock);
+	if (atomic_get(&sysex_tx.in_progress) || (tx_sysex_open_cables & BIT(cable_number))) {
+		k_spin_unlock(&tx_enqueue_lock, key);
+		return -EBUSY;
+	}
+
+	sysex_tx.cable_num = cable_number;
+	sysex_tx.bytes = bytes;
+	sysex_tx.pull_cb = pull_cb;
+	sysex_tx.num_bytes = num_bytes;
+	sysex_tx.num_packed_bytes = 0;
+	atomic_set(&sysex_tx.in_progress, 1);
+	k_spin_unlock(&tx_enqueue_lock, key);
+
+	/*
+	 * If a transfer is in flight, packing starts when it's done.
+	 * Write errors are reported through sysex_tx_done_cb.
+	 */
+	tx_kick();
 	return 0;
 }
 
-USBD_DEFINE_CFG_DATA(usb_midi_config) = {
-	.usb_device_description = NULL,
-	.interface_config = NULL,
-	.interface_descriptor = &usb_midi_config_data.ac_if,
-	.cb_usb_status = usb_status_callback,
-	.interface = {
-		.class_handler = NULL,
-		.custom_handler = NULL,
-		.vendor_handler = NULL,
-	},
-	.num_endpoints = ARRAY_SIZE(midi_ep_cfg),
-	.endpoint = midi_ep_cfg,
-};
\ No newline at end of file
+int usb_midi_sysex_tx(uint8_t cable_number, const uint8_t *bytes, uint32_t num_bytes)
+{
+	if (num_bytes < 2 || bytes[0] != 0xf0 || bytes[num_bytes - 1] != 0xf7) {
+		LOG_ERR("sysex messages must start with F0 and end with F7");
+		return -EINVAL;
+	}
+	return sysex_tx_start(cable_number, bytes, num_bytes, NULL);
+}
+
+int usb_midi_sysex_tx_pull(uint8_t cable_number, uint32_t num_bytes,
+			   usb_midi_sysex_tx_pull_cb_t pull_cb)
+{
+	if (pull_cb == NULL) {
+		return -EINVAL;
+	}
+	return sysex_tx_start(cable_number, NULL, num_bytes, pull_cb);
+}
+
+int usb_midi_sysex_tx_in_progress()
+{
+	return atomic_get(&sysex_tx.in_progress);
+}
+
+void usb_midi_sysex_stats(struct usb_midi_sysex_stats_t *stats)
+{
+	*stats = sysex_stats;
+}
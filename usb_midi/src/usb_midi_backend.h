@@ -0,0 +1,44 @@
+#ifndef ZEPHYR_USB_MIDI_BACKEND_H_
+#define ZEPHYR_USB_MIDI_BACKEND_H_
+
+#include <stdint.h>
+
+/*
+ * The interface between the driver core (usb_midi.c) and the code moving
+ * transfers over the endpoints. usb_midi_usbd.c implements it on top of
+ * Zephyr's USB device stack. Other implementations, e.g an in-memory
+ * stand-in for running the driver on a PC, can be linked in its place.
+ */
+
+/* Max size in bytes of a transfer on the IN and OUT endpoints. */
+#define EP_MAX_PACKET_SIZE 0x0040
+
+/* Implemented by the backend, called by the driver core. */
+
+/**
+ * Starts writing a transfer to the IN endpoint. Completion is reported
+ * with usb_midi_on_in_done.
+ * @return 0 on success, -EAGAIN if the endpoint is busy, otherwise a negative error code.
+ */
+int usb_midi_backend_write(const uint8_t *data, uint32_t num_bytes);
+/**
+ * Reads a transfer received on the OUT endpoint, without making the endpoint
+ * ready to receive the next transfer. Until usb_midi_backend_read_continue is
+ * called, the host is NAKed.
+ */
+int usb_midi_backend_read_wait(uint8_t *data, uint32_t max_num_bytes, uint32_t *num_read_bytes);
+/** Makes the OUT endpoint ready to receive the next transfer. */
+int usb_midi_backend_read_continue();
+
+/* Implemented by the driver core, called by the backend. */
+
+/** Called when the device becomes available/unavailable to the host. */
+void usb_midi_on_available(int is_available);
+/** Called when a transfer written with usb_midi_backend_write is done. */
+void usb_midi_on_in_done();
+/** Called when a transfer has been received on the OUT endpoint. */
+void usb_midi_on_out_data();
+/** Called at each start of frame, if the backend gets start of frame events. */
+void usb_midi_on_sof();
+
+#endif
@@ -0,0 +1,145 @@
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi_clock.h>
+#include "usb_midi_clock_hooks.h"
+#include "usb_midi_packet.h"
+
+/* Clock messages per quarter note. */
+#define CLOCK_PPQN 24
+/* Start of frame events per second, at full speed. */
+#define CLOCK_FRAMES_PER_SEC 1000
+/*
+ * The phase accumulator gains the tempo in millibpm times CLOCK_PPQN each
+ * frame, and a clock message is due each time it reaches this.
+ */
+#define CLOCK_PHASE_PER_CLOCK (60 * CLOCK_FRAMES_PER_SEC * 1000)
+
+#define CLOCK_MIN_MILLIBPM 1000
+#define CLOCK_MAX_MILLIBPM 1000000
+
+BUILD_ASSERT(CLOCK_MAX_MILLIBPM * CLOCK_PPQN <= CLOCK_PHASE_PER_CLOCK, "USB MIDI clock must fit a message per frame");
+
+/*
+ * The command for the next frame, if any: the status byte of start, stop or
+ * continue in bits 0-7 and the cable number in bits 8-11. Written by the app,
+ * taken by the start of frame callback.
+ */
+static atomic_t clock_command = ATOMIC_INIT(0);
+/* The cable of the last start or continue command. Only accessed by the app. */
+static uint8_t clock_command_cable_num = 0;
+/* The phase gained per frame, i.e the tempo in millibpm times CLOCK_PPQN. */
+static atomic_t clock_phase_per_frame = ATOMIC_INIT(CONFIG_USB_MIDI_CLOCK_TEMPO * CLOCK_PPQN);
+
+/* Only accessed from the start of frame callback, except for reading the stats. */
+static uint8_t clock_cable_num = 0;
+static int clock_is_running = 0;
+static uint32_t clock_phase = 0;
+/* Set when clock_last_cycles holds the release time of the previous clock message at the current tempo. */
+static int clock_has_last = 0;
+static uint32_t clock_last_cycles = 0;
+static uint32_t clock_last_phase_per_frame = 0;
+static struct usb_midi_clock_stats_t clock_stats;
+static uint32_t clock_num_intervals = 0;
+static uint64_t clock_jitter_sum_us = 0;
+
+static uint32_t clock_packet(uint8_t cable_num, uint8_t status)
+{
+	uint8_t bytes[4] = {(cable_num << 4) | USB_MIDI_CIN_1BYTE_DATA, status, 0, 0};
+	uint32_t packet;
+	memcpy(&packet, bytes, 4);
+	return packet;
+}
+
+/* Updates the stats with the interval since the previous clock message. */
+static void clock_measure(uint32_t phase_per_frame)
+{
+	uint32_t cycles = k_cycle_get_32();
+	if (clock_has_last && phase_per_frame == clock_last_phase_per_frame) {
+		uint64_t cycles_per_sec = sys_clock_hw_cycles_per_sec();
+		uint64_t exact_interval =
+			cycles_per_sec * CLOCK_PHASE_PER_CLOCK / phase_per_frame / CLOCK_FRAMES_PER_SEC;
+		uint32_t interval = cycles - clock_last_cycles;
+		uint64_t deviation = interval > exact_interval ? interval - exact_interval
+							       : exact_interval - interval;
+		uint32_t jitter_us = deviation * 1000000 / cycles_per_sec;
+		clock_stats.max_jitter_us = MAX(clock_stats.max_jitter_us, jitter_us);
+		clock_jitter_sum_us += jitter_us;
+		clock_num_intervals++;
+	}
+	clock_has_last = 1;
+	clock_last_cycles = cycles;
+	clock_last_phase_per_frame = phase_per_frame;
+}
+
+uint32_t usb_midi_clock_on_sof(uint32_t *packets)
+{
+	uint32_t num_packets = 0;
+	uint32_t command = atomic_clear(&clock_command);
+	if (command) {
+		clock_cable_num = command >> 8;
+		uint8_t status = command & 0xff;
+		packets[num_packets++] = clock_packet(clock_cable_num, status);
+		clock_is_running = status != 0xfc;
+		clock_has_last = 0;
+		if (status == 0xfa) {
+			/* The first clock message goes right after start. */
+			clock_phase = CLOCK_PHASE_PER_CLOCK;
+			memset(&clock_stats, 0, sizeof(clock_stats));
+			clock_num_intervals = 0;
+			clock_jitter_sum_us = 0;
+		}
+	}
+	if (!clock_is_running) {
+		return num_packets;
+	}
+
+	uint32_t phase_per_frame = atomic_get(&clock_phase_per_frame);
+	if (clock_phase >= CLOCK_PHASE_PER_CLOCK) {
+		clock_phase -= CLOCK_PHASE_PER_CLOCK;
+		packets[num_packets++] = clock_packet(clock_cable_num, 0xf8);
+		clock_stats.num_clocks++;
+		clock_measure(phase_per_frame);
+	}
+	clock_phase += phase_per_frame;
+	return num_packets;
+}
+
+static int clock_send_command(uint8_t cable_number, uint8_t status)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+	clock_command_cable_num = cable_number;
+	atomic_set(&clock_command, (cable_number << 8) | status);
+	return 0;
+}
+
+int usb_midi_clock_start(uint8_t cable_number)
+{
+	return clock_send_command(cable_number, 0xfa);
+}
+
+void usb_midi_clock_stop()
+{
+	/* Stop goes on the cable of the last start or continue. */
+	clock_send_command(clock_command_cable_num, 0xfc);
+}
+
+int usb_midi_clock_continue(uint8_t cable_number)
+{
+	return clock_send_command(cable_number, 0xfb);
+}
+
+int usb_midi_clock_set_tempo(uint32_t millibpm)
+{
+	if (millibpm < CLOCK_MIN_MILLIBPM || millibpm > CLOCK_MAX_MILLIBPM) {
+		return -EINVAL;
+	}
+	atomic_set(&clock_phase_per_frame, millibpm * CLOCK_PPQN);
+	return 0;
+}
+
+void usb_midi_clock_stats(struct usb_midi_clock_stats_t *stats)
+{
+	*stats = clock_stats;
+	stats->mean_jitter_us = clock_num_intervals > 0 ? clock_jitter_sum_us / clock_num_intervals : 0;
+}
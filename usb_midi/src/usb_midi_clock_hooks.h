@@ -0,0 +1,22 @@
+#ifndef ZEPHYR_USB_MIDI_CLOCK_HOOKS_H_
+#define ZEPHYR_USB_MIDI_CLOCK_HOOKS_H_
+
+#include <stdint.h>
+
+/*
+ * Called by the driver core to drive the clock generator (usb_midi_clock.c),
+ * if CONFIG_USB_MIDI_CLOCK is set.
+ */
+
+/* The max number of packets usb_midi_clock_on_sof produces. */
+#define USB_MIDI_CLOCK_MAX_PACKETS_PER_FRAME 2
+
+/**
+ * Called at the start of each frame, from the start of frame callback.
+ * @param packets Set to the encoded packets to send in the frame, at most
+ * USB_MIDI_CLOCK_MAX_PACKETS_PER_FRAME.
+ * @return The number of packets.
+ */
+uint32_t usb_midi_clock_on_sof(uint32_t *packets);
+
+#endif
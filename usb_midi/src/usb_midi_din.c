@@ -0,0 +1,385 @@
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
+#include <usb_midi/usb_midi.h>
+#include <usb_midi/usb_midi_din.h>
+#include "usb_midi_din_hooks.h"
+#include "usb_midi_ring.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE), "USB MIDI DIN tx buffer size must be a power of two");
+
+#define DIN_BAUD_RATE 31250
+/* Idle time after which received bytes are reported, one byte at 31250 baud. */
+#define DIN_RX_TIMEOUT_US 320
+
+/*
+ * Spans of received bytes in the rx buffers, waiting to be sent to the host.
+ * Bits 0-7 hold the buffer index, bits 8-15 the offset and bits 16-23 the
+ * length. A span with DIN_RX_SPAN_RELEASED set marks the point after which
+ * the buffer can be reused.
+ */
+#define DIN_RX_SPAN_RING_SIZE 32
+#define DIN_RX_SPAN_RELEASED BIT(31)
+#define DIN_RX_SPAN(buf_idx, offset, len) ((buf_idx) | ((offset) << 8) | ((len) << 16))
+
+BUILD_ASSERT(DIN_RX_SPAN_RING_SIZE > 2 * CONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS, "USB MIDI DIN rx span ring too small");
+
+struct din_port_t {
+	const struct device *uart;
+	uint8_t cable_num;
+
+	/*
+	 * Host to DIN. Bytes are put in tx_bytes by the rx dispatch context and
+	 * written to the UART directly from there by the owner of tx_busy.
+	 */
+	uint8_t tx_bytes[CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE];
+	/* Free running counters, like in usb_midi_ring_t. */
+	uint32_t tx_head;
+	uint32_t tx_tail;
+	/* Set while a UART write is in flight. */
+	atomic_t tx_busy;
+	/* The status byte of the last channel message written, or 0 if none. */
+	uint8_t tx_running_status;
+
+	/*
+	 * DIN to host. The UART receives into the rx buffers, which are handed
+	 * out in order and taken back once all bytes in them have been enqueued.
+	 */
+	uint8_t rx_bufs[CONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS][CONFIG_USB_MIDI_DIN_RX_BUFFER_SIZE];
+	/* Set while a buffer is owned by the UART or holds bytes not yet enqueued. */
+	atomic_t rx_buf_in_use[CONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS];
+	/* The index of the next buffer to hand to the UART. */
+	int rx_next_buf_idx;
+	/* Set when the UART stopped receiving because no buffer was free. */
+	atomic_t rx_disabled;
+	/* Producer is the UART callback, consumer is din_rx_work. */
+	uint32_t rx_span_items[DIN_RX_SPAN_RING_SIZE];
+	struct usb_midi_ring_t rx_spans;
+	/* The number of bytes of the oldest span already enqueued. */
+	uint32_t rx_span_progress;
+
+	struct usb_midi_din_stats_t stats;
+};
+
+static struct din_port_t din_ports[CONFIG_USB_MIDI_DIN_NUM_PORTS];
+static int din_num_ports = 0;
+/* Ports by cable number. */
+static struct din_port_t *din_ports_by_cable[16];
+static atomic_t din_is_available = ATOMIC_INIT(0);
+
+static void din_rx_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(din_rx_work, din_rx_work_handler);
+
+static uint8_t din_rx_buf_idx(struct din_port_t *port, const uint8_t *buf)
+{
+	return (buf - &port->rx_bufs[0][0]) / CONFIG_USB_MIDI_DIN_RX_BUFFER_SIZE;
+}
+
+/* Hands the next rx buffer to the UART, if it is free. */
+static int din_rx_provide_buf(struct din_port_t *port, int enable)
+{
+	int idx = port->rx_next_buf_idx;
+	if (!atomic_cas(&port->rx_buf_in_use[idx], 0, 1)) {
+		return -ENOMEM;
+	}
+	port->rx_next_buf_idx = (idx + 1) % CONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS;
+	if (enable) {
+		return uart_rx_enable(port->uart, port->rx_bufs[idx], CONFIG_USB_MIDI_DIN_RX_BUFFER_SIZE,
+				      DIN_RX_TIMEOUT_US);
+	}
+	return uart_rx_buf_rsp(port->uart, port->rx_bufs[idx], CONFIG_USB_MIDI_DIN_RX_BUFFER_SIZE);
+}
+
+/**
+ * Writes the oldest contiguous bytes in tx_bytes to the UART. Must only be
+ * called by the owner of tx_busy.
+ * @return 0 if a write was started, -ENODATA if there was nothing to write,
+ * otherwise a negative error code.
+ */
+static int din_tx_start(struct din_port_t *port)
+{
+	uint32_t head = __atomic_load_n(&port->tx_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = port->tx_tail;
+	if (head == tail) {
+		return -ENODATA;
+	}
+	uint32_t offset = tail & (CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE - 1);
+	uint32_t num_bytes = MIN(head - tail, CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE - offset);
+	int result = uart_tx(port->uart, &port->tx_bytes[offset], num_bytes, SYS_FOREVER_US);
+	if (result != 0) {
+		LOG_ERR("Failed to write %d bytes to DIN port %d with error %d", num_bytes,
+			port->cable_num, result);
+		port->stats.num_uart_errors++;
+		port->stats.num_tx_dropped_bytes += num_bytes;
+		__atomic_store_n(&port->tx_tail, tail + num_bytes, __ATOMIC_RELEASE);
+	}
+	return result;
+}
+
+/* Starts writing to the UART, unless a write is already in flight. */
+static void din_tx_kick(struct din_port_t *port)
+{
+	while (atomic_cas(&port->tx_busy, 0, 1)) {
+		if (din_tx_start(port) == 0) {
+			return;
+		}
+		atomic_clear(&port->tx_busy);
+		/* Bytes may have been put in tx_bytes before tx_busy was cleared. */
+		if (__atomic_load_n(&port->tx_head, __ATOMIC_ACQUIRE) == port->tx_tail) {
+			break;
+		}
+	}
+}
+
+/* Called when a UART write is done or aborted. tx_busy is still set. */
+static void din_tx_done(struct din_port_t *port, uint32_t num_bytes)
+{
+	port->stats.num_tx_bytes += num_bytes;
+	__atomic_store_n(&port->tx_tail, port->tx_tail + num_bytes, __ATOMIC_RELEASE);
+	while (1) {
+		int result = din_tx_start(port);
+		if (result == 0) {
+			return;
+		}
+		if (result == -ENODATA) {
+			break;
+		}
+	}
+	atomic_clear(&port->tx_busy);
+	din_tx_kick(port);
+}
+
+/**
+ * Puts bytes in the port's tx buffer, dropping them all if they don't fit.
+ * @return 0 if the bytes were put, -ENOBUFS if they were dropped.
+ */
+static int din_tx_put(struct din_port_t *port, const uint8_t *bytes, uint32_t num_bytes)
+{
+	uint32_t head = port->tx_head;
+	uint32_t tail = __atomic_load_n(&port->tx_tail, __ATOMIC_ACQUIRE);
+	if (CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE - (head - tail) < num_bytes) {
+		port->stats.num_tx_dropped_bytes += num_bytes;
+		return -ENOBUFS;
+	}
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		port->tx_bytes[(head + i) & (CONFIG_USB_MIDI_DIN_TX_BUFFER_SIZE - 1)] = bytes[i];
+	}
+	__atomic_store_n(&port->tx_head, head + num_bytes, __ATOMIC_RELEASE);
+	din_tx_kick(port);
+	return 0;
+}
+
+void usb_midi_din_on_rx_message(uint8_t cable_num, const uint8_t *bytes, uint8_t num_bytes)
+{
+	struct din_port_t *port = din_ports_by_cable[cable_num];
+	if (!port) {
+		return;
+	}
+	uint8_t status = bytes[0];
+	uint8_t running_status = port->tx_running_status;
+	if (status < 0xf0) {
+#ifdef CONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS
+		if (status == running_status) {
+			bytes++;
+			num_bytes--;
+		}
+#endif
+		running_status = status;
+	} else if (status < 0xf8) {
+		/* System common messages cancel running status. */
+		running_status = 0;
+	}
+	/*
+	 * Only a written status byte becomes the running status. After a drop,
+	 * the next channel message is written with its status byte.
+	 */
+	port->tx_running_status = din_tx_put(port, bytes, num_bytes) == 0 ? running_status : 0;
+}
+
+void usb_midi_din_on_rx_sysex(uint8_t cable_num, const uint8_t *bytes, uint8_t num_bytes)
+{
+	struct din_port_t *port = din_ports_by_cable[cable_num];
+	if (!port) {
+		return;
+	}
+	din_tx_put(port, bytes, num_bytes);
+	/* Sysex bytes cancel running status, and so does dropping them. */
+	port->tx_running_status = 0;
+}
+
+static void din_uart_cb(const struct device *uart, struct uart_event *evt, void *user_data)
+{
+	struct din_port_t *port = user_data;
+	switch (evt->type) {
+	case UART_TX_ABORTED:
+		port->stats.num_uart_errors++;
+		/* Fall through */
+	case UART_TX_DONE:
+		din_tx_done(port, evt->data.tx.len);
+		break;
+	case UART_RX_RDY:
+		/* Keep room for the release markers of all buffers. */
+		if (usb_midi_ring_space(&port->rx_spans) > CONFIG_USB_MIDI_DIN_RX_NUM_BUFFERS) {
+			usb_midi_ring_put(&port->rx_spans,
+					  DIN_RX_SPAN(din_rx_buf_idx(port, evt->data.rx.buf),
+						      evt->data.rx.offset, evt->data.rx.len));
+			k_work_schedule(&din_rx_work, K_NO_WAIT);
+		} else {
+			port->stats.num_rx_dropped_bytes += evt->data.rx.len;
+		}
+		break;
+	case UART_RX_BUF_REQUEST:
+		/* If no buffer is free, the UART stops receiving once the current one is full. */
+		din_rx_provide_buf(port, 0);
+		break;
+	case UART_RX_BUF_RELEASED:
+		usb_midi_ring_put(&port->rx_spans,
+				  DIN_RX_SPAN(din_rx_buf_idx(port, evt->data.rx_buf.buf), 0, 0) |
+					  DIN_RX_SPAN_RELEASED);
+		k_work_schedule(&din_rx_work, K_NO_WAIT);
+		break;
+	case UART_RX_STOPPED:
+		LOG_WRN("DIN port %d stopped receiving, reason %d", port->cable_num,
+			evt->data.rx_stop.reason);
+		port->stats.num_uart_errors++;
+		break;
+	case UART_RX_DISABLED:
+		atomic_set(&port->rx_disabled, 1);
+		k_work_schedule(&din_rx_work, K_NO_WAIT);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Enqueues bytes received by a port's UART for the host and re-enables
+ * receiving once a buffer is free.
+ * @return 1 if the tx ring of the cable was full, i.e this should be retried.
+ */
+static int din_rx_process(struct din_port_t *port)
+{
+	uint32_t span;
+	while (usb_midi_ring_peek(&port->rx_spans, &span, 1) == 1) {
+		uint32_t buf_idx = span & 0xff;
+		if (span & DIN_RX_SPAN_RELEASED) {
+			atomic_clear(&port->rx_buf_in_use[buf_idx]);
+		} else {
+			uint32_t offset = (span >> 8) & 0xff;
+			uint32_t len = (span >> 16) & 0xff;
+			uint8_t *bytes = &port->rx_bufs[buf_idx][offset + port->rx_span_progress];
+			uint32_t num_bytes = len - port->rx_span_progress;
+			if (atomic_get(&din_is_available)) {
+				int num_enqueued = usb_midi_tx_stream(port->cable_num, bytes, num_bytes);
+				uint32_t num_dropped = usb_midi_tx_stream_num_dropped(port->cable_num, 1);
+				port->stats.num_rx_bytes += num_enqueued - num_dropped;
+				port->stats.num_rx_dropped_bytes += num_dropped;
+				port->rx_span_progress += num_enqueued;
+				if (num_enqueued < num_bytes) {
+					return 1;
+				}
+			} else {
+				port->stats.num_rx_dropped_bytes += num_bytes;
+			}
+			port->rx_span_progress = 0;
+		}
+		usb_midi_ring_skip(&port->rx_spans, 1);
+	}
+
+	if (atomic_get(&port->rx_disabled) && din_rx_provide_buf(port, 1) == 0) {
+		atomic_clear(&port->rx_disabled);
+	}
+	return 0;
+}
+
+static void din_rx_work_handler(struct k_work *work)
+{
+	int retry = 0;
+	for (int i = 0; i < din_num_ports; i++) {
+		if (din_ports[i].cable_num < CONFIG_USB_MIDI_NUM_OUTPUTS) {
+			retry |= din_rx_process(&din_ports[i]);
+		}
+	}
+	if (retry) {
+		/* Wait for transfers to make room in the tx rings. */
+		k_work_schedule(&din_rx_work, K_MSEC(1));
+	}
+}
+
+void usb_midi_din_on_available(int is_available)
+{
+	atomic_set(&din_is_available, is_available);
+	k_work_schedule(&din_rx_work, K_NO_WAIT);
+}
+
+int usb_midi_din_add_port(uint8_t cable_number, const struct device *uart)
+{
+	if (cable_number >= MAX(CONFIG_USB_MIDI_NUM_INPUTS, CONFIG_USB_MIDI_NUM_OUTPUTS)) {
+		return -EINVAL;
+	}
+	/* din_ports_by_cable only has the ports of input cables. */
+	for (int i = 0; i < din_num_ports; i++) {
+		if (din_ports[i].cable_num == cable_number) {
+			return -EINVAL;
+		}
+	}
+	if (din_num_ports == CONFIG_USB_MIDI_DIN_NUM_PORTS) {
+		return -ENOMEM;
+	}
+	if (!device_is_ready(uart)) {
+		return -ENODEV;
+	}
+
+	const struct uart_config config = {.baudrate = DIN_BAUD_RATE,
+					   .parity = UART_CFG_PARITY_NONE,
+					   .stop_bits = UART_CFG_STOP_BITS_1,
+					   .data_bits = UART_CFG_DATA_BITS_8,
+					   .flow_ctrl = UART_CFG_FLOW_CTRL_NONE};
+	int result = uart_configure(uart, &config);
+	if (result != 0) {
+		LOG_ERR("Failed to configure DIN port UART with error %d", result);
+		return result;
+	}
+
+	struct din_port_t *port = &din_ports[din_num_ports];
+	port->uart = uart;
+	port->cable_num = cable_number;
+	port->rx_spans = (struct usb_midi_ring_t)USB_MIDI_RING_INITIALIZER(port->rx_span_items);
+	result = uart_callback_set(uart, din_uart_cb, port);
+	if (result != 0) {
+		LOG_ERR("Failed to set DIN port UART callback with error %d", result);
+		memset(port, 0, sizeof(*port));
+		return result;
+	}
+
+	if (cable_number < CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		result = din_rx_provide_buf(port, 1);
+		if (result != 0) {
+			LOG_ERR("Failed to enable DIN port UART rx with error %d", result);
+			/* Release the claimed rx buffer, so adding the port can be retried. */
+			memset(port, 0, sizeof(*port));
+			return result;
+		}
+	}
+
+	din_num_ports++;
+	if (cable_number < CONFIG_USB_MIDI_NUM_INPUTS) {
+		/* Start forwarding bytes from the host only once the port is set up. */
+		din_ports_by_cable[cable_number] = port;
+	}
+	return 0;
+}
+
+int usb_midi_din_port_stats(uint8_t cable_number, struct usb_midi_din_stats_t *stats)
+{
+	for (int i = 0; i < din_num_ports; i++) {
+		if (din_ports[i].cable_num == cable_number) {
+			*stats = din_ports[i].stats;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
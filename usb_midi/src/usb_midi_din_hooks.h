@@ -0,0 +1,18 @@
+#ifndef ZEPHYR_USB_MIDI_DIN_HOOKS_H_
+#define ZEPHYR_USB_MIDI_DIN_HOOKS_H_
+
+#include <stdint.h>
+
+/*
+ * Called by the driver core to feed the DIN bridge (usb_midi_din.c),
+ * if CONFIG_USB_MIDI_DIN_BRIDGE is set.
+ */
+
+/** Called when the device becomes available or unavailable. */
+void usb_midi_din_on_available(int is_available);
+/** Called from the rx dispatch context with each received non-sysex message. */
+void usb_midi_din_on_rx_message(uint8_t cable_num, const uint8_t *bytes, uint8_t num_bytes);
+/** Called from the rx dispatch context with received sysex bytes, including F0 and F7. */
+void usb_midi_din_on_rx_sysex(uint8_t cable_num, const uint8_t *bytes, uint8_t num_bytes);
+
+#endif
@@ -2,12 +2,11 @@
 #define ZEPHYR_USB_MIDI_MACROS_H_
 
 #include <zephyr/init.h>
+#include "usb_midi_backend.h"
 
 /* Require at least one jack */
 BUILD_ASSERT((CONFIG_USB_MIDI_NUM_INPUTS + CONFIG_USB_MIDI_NUM_OUTPUTS > 0), "USB MIDI device must have more than 0 jacks");
 
-#define EP_MAX_PACKET_SIZE 0x0040
-
 #ifdef CONFIG_USB_MIDI_USE_CUSTOM_JACK_NAMES
 
 #define OUTPUT_JACK_STRING_DESCR_IDX(jack_idx) (4 + jack_idx)
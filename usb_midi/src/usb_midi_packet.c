@@ -5,127 +5,115 @@
 #define IS_DATA_BYTE(b) (b < 0x80)
 #define IS_STATUS_BYTE(b) (b >= 0x80)
 
-static enum usb_midi_error_t channel_msg_cin(uint8_t first_byte, uint8_t *cin)
-{
-	uint8_t high_nibble = first_byte >> 4;
+/*
+ * The code index number (CIN) and MIDI byte count of a packet are looked up in
+ * the tables below instead of being derived by successive switch statements.
+ */
 
-	switch (high_nibble) {
-	case 0x8: /* Note off */
-	case 0x9: /* Note on */
-	case 0xa: /* Poly KeyPress */
-	case 0xb: /* Control Change */
-	case 0xe: /* PitchBend Change */
-		/* Three byte channel Voice Message */
-		*cin = high_nibble;
-		break;
-	case 0xc: /* Program Change */
-	case 0xd: /* Channel Pressure */
-		/* Two byte channel Voice Message */
-		*cin = high_nibble;
-		break;
-	default:
-		/* Invalid status byte */
-		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
-	}
+/* Marks status table entries for bytes that do not determine the CIN on their own. */
+#define STATUS_ENTRY_SYSEX_PATTERN 0xff
+/* A status table entry holding a CIN in the low nibble and a MIDI byte count in the high nibble. */
+#define STATUS_ENTRY(cin, num_bytes) (((num_bytes) << 4) | (cin))
+#define STATUS_ENTRY_CIN(entry)	      ((entry)&0xf)
+#define STATUS_ENTRY_NUM_BYTES(entry) ((entry) >> 4)
 
-	/* Valid status byte */
-	return USB_MIDI_SUCCESS;
-}
+/* Number of MIDI bytes in a packet, indexed by CIN. Zero for reserved CINs. */
+static const uint8_t cin_num_midi_bytes[16] = {
+	[USB_MIDI_CIN_MISC] = 0,
+	[USB_MIDI_CIN_CABLE_EVENT] = 0,
+	[USB_MIDI_CIN_SYSCOM_2BYTE] = 2,
+	[USB_MIDI_CIN_SYSCOM_3BYTE] = 3,
+	[USB_MIDI_CIN_SYSEX_START_OR_CONTINUE] = 3,
+	[USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE] = 1,
+	[USB_MIDI_CIN_SYSEX_END_2BYTE] = 2,
+	[USB_MIDI_CIN_SYSEX_END_3BYTE] = 3,
+	[USB_MIDI_CIN_NOTE_ON] = 3,
+	[USB_MIDI_CIN_NOTE_OFF] = 3,
+	[USB_MIDI_CIN_POLY_KEYPRESS] = 3,
+	[USB_MIDI_CIN_CONTROL_CHANGE] = 3,
+	[USB_MIDI_CIN_PROGRAM_CHANGE] = 2,
+	[USB_MIDI_CIN_CHANNEL_PRESSURE] = 2,
+	[USB_MIDI_CIN_PITCH_BEND_CHANGE] = 3,
+	[USB_MIDI_CIN_1BYTE_DATA] = 1,
+};
 
-static enum usb_midi_error_t non_sysex_system_msg_cin(uint8_t first_byte, uint8_t *cin)
-{
-	switch (first_byte) {
-	case 0xf1: /* MIDI Time Code Quarter Frame */
-	case 0xf3: /* Song Select */
-		/* 2 byte System Common message */
-		*cin = USB_MIDI_CIN_SYSCOM_2BYTE;
-		break;
-	case 0xf2: /* Song Position Pointer */
-		/* 3 byte System Common message */
-		*cin = USB_MIDI_CIN_SYSCOM_3BYTE;
-		break;
-	case 0xf6: /* Tune request */
-		/* Single-byte System Common Message */
-		*cin = USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE;
-		break;
-	case 0xf8: /* Timing Clock */
-	case 0xfa: /* Start */
-	case 0xfb: /* Continue */
-	case 0xfc: /* Stop */
-	case 0xfe: /* Active Sensing */
-	case 0xff: /* System Reset */
-		/* 1 byte system real time */
-		*cin = USB_MIDI_CIN_1BYTE_DATA;
-		break;
-	default:
-		/* Invalid status byte */
-		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
-	}
+/*
+ * CIN and MIDI byte count of a message, indexed by its first byte. Entries
+ * with both fields set to zero are invalid first bytes. Data bytes and F0
+ * start (partial) sysex messages whose CIN depends on the following bytes.
+ */
+static const uint8_t status_byte_table[256] = {
+	[0x00 ... 0x7f] = STATUS_ENTRY_SYSEX_PATTERN,
+	/* Channel messages */
+	[0x80 ... 0x8f] = STATUS_ENTRY(USB_MIDI_CIN_NOTE_ON, 3),
+	[0x90 ... 0x9f] = STATUS_ENTRY(USB_MIDI_CIN_NOTE_OFF, 3),
+	[0xa0 ... 0xaf] = STATUS_ENTRY(USB_MIDI_CIN_POLY_KEYPRESS, 3),
+	[0xb0 ... 0xbf] = STATUS_ENTRY(USB_MIDI_CIN_CONTROL_CHANGE, 3),
+	[0xc0 ... 0xcf] = STATUS_ENTRY(USB_MIDI_CIN_PROGRAM_CHANGE, 2),
+	[0xd0 ... 0xdf] = STATUS_ENTRY(USB_MIDI_CIN_CHANNEL_PRESSURE, 2),
+	[0xe0 ... 0xef] = STATUS_ENTRY(USB_MIDI_CIN_PITCH_BEND_CHANGE, 3),
+	/* System common messages */
+	[0xf0] = STATUS_ENTRY_SYSEX_PATTERN,
+	[0xf1] = STATUS_ENTRY(USB_MIDI_CIN_SYSCOM_2BYTE, 2), /* MIDI Time Code Quarter Frame */
+	[0xf2] = STATUS_ENTRY(USB_MIDI_CIN_SYSCOM_3BYTE, 3), /* Song Position Pointer */
+	[0xf3] = STATUS_ENTRY(USB_MIDI_CIN_SYSCOM_2BYTE, 2), /* Song Select */
+	[0xf6] = STATUS_ENTRY(USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE, 1), /* Tune request */
+	[0xf7] = STATUS_ENTRY(USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE, 1), /* Sysex end */
+	/* System real time messages */
+	[0xf8] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* Timing Clock */
+	[0xfa] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* Start */
+	[0xfb] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* Continue */
+	[0xfc] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* Stop */
+	[0xfe] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* Active Sensing */
+	[0xff] = STATUS_ENTRY(USB_MIDI_CIN_1BYTE_DATA, 1), /* System Reset */
+};
 
-	/* Valid status byte */
-	return USB_MIDI_SUCCESS;
-}
+/* Classes of the second and third byte of a (partial) sysex message. */
+enum sysex_byte_class_t {
+	SYSEX_BYTE_DATA = 0,
+	SYSEX_BYTE_END = 1,
+	SYSEX_BYTE_OTHER = 2
+};
 
-static enum usb_midi_error_t sysex_msg_cin(uint8_t *midi_bytes, uint8_t *cin)
+static inline uint8_t sysex_byte_class(uint8_t byte)
 {
-	int is_data_byte[3] = {IS_DATA_BYTE(midi_bytes[0]), IS_DATA_BYTE(midi_bytes[1]), IS_DATA_BYTE(midi_bytes[2])};
-
-	if (midi_bytes[0] == SYSEX_START_BYTE) {
-		if (midi_bytes[1] == SYSEX_END_BYTE) {
-			/* Sysex case 1: F0 F7 */
-			*cin = USB_MIDI_CIN_SYSEX_END_2BYTE;
-		} else if (is_data_byte[1]) {
-			if (midi_bytes[2] == SYSEX_END_BYTE) {
-				/* Sysex case 2: F0 d F7 */
-				*cin = USB_MIDI_CIN_SYSEX_END_3BYTE;
-			} else if (is_data_byte[2]) {
-				/* Sysex case 3: F0 d d */
-				*cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
-			}
-		}
-	} else if (is_data_byte[0]) {
-		if (is_data_byte[1]) {
-			if (is_data_byte[2]) {
-				/* Sysex case 4: d d d */
-				*cin = USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
-			} else if (midi_bytes[2] == SYSEX_END_BYTE) {
-				/* Sysex case 5: d d F7 */
-				*cin = USB_MIDI_CIN_SYSEX_END_3BYTE;
-			}
-		} else if (midi_bytes[1] == SYSEX_END_BYTE) {
-			/* Sysex case 6: d F7 */
-			*cin = USB_MIDI_CIN_SYSEX_END_2BYTE;
-		}
-	} else if (midi_bytes[0] == SYSEX_END_BYTE) {
-		/* Sysex case 7: F7 */
-		*cin = USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE;
-	} else {
-		/* Invalid sysex sequence */
-		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	if (IS_DATA_BYTE(byte)) {
+		return SYSEX_BYTE_DATA;
 	}
-
-	/* Valid sysex sequence */
-	return USB_MIDI_SUCCESS;
+	return byte == SYSEX_END_BYTE ? SYSEX_BYTE_END : SYSEX_BYTE_OTHER;
 }
 
-static uint8_t num_midi_bytes_for_cin(uint8_t cin)
+/*
+ * CIN of a (partial) sysex message starting with a data byte or F0, indexed by
+ * [first byte is F0][class of second byte][class of third byte].
+ * Zero (USB_MIDI_CIN_MISC) marks invalid sequences.
+ */
+static const uint8_t sysex_pattern_cin[2][3][3] = {
+	/* First byte is a data byte */
+	{
+		/* d, d, x */
+		{USB_MIDI_CIN_SYSEX_START_OR_CONTINUE, USB_MIDI_CIN_SYSEX_END_3BYTE, 0},
+		/* d, F7 */
+		{USB_MIDI_CIN_SYSEX_END_2BYTE, USB_MIDI_CIN_SYSEX_END_2BYTE,
+		 USB_MIDI_CIN_SYSEX_END_2BYTE},
+		/* d, status other than F7 */
+		{0, 0, 0},
+	},
+	/* First byte is F0 */
+	{
+		/* F0, d, x */
+		{USB_MIDI_CIN_SYSEX_START_OR_CONTINUE, USB_MIDI_CIN_SYSEX_END_3BYTE, 0},
+		/* F0, F7 */
+		{USB_MIDI_CIN_SYSEX_END_2BYTE, USB_MIDI_CIN_SYSEX_END_2BYTE,
+		 USB_MIDI_CIN_SYSEX_END_2BYTE},
+		/* F0, status other than F7 */
+		{0, 0, 0},
+	},
+};
+
+uint8_t usb_midi_cin_num_midi_bytes(uint8_t cin)
 {
-	switch (cin) {
-	case USB_MIDI_CIN_MISC:
-	case USB_MIDI_CIN_CABLE_EVENT:
-		/* Reserved for future expansion. Ignore. */
-		return 0;
-	case USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE:
-	case USB_MIDI_CIN_1BYTE_DATA:
-		return 1;
-	case USB_MIDI_CIN_SYSCOM_2BYTE:
-	case USB_MIDI_CIN_SYSEX_END_2BYTE:
-	case USB_MIDI_CIN_PROGRAM_CHANGE:
-	case USB_MIDI_CIN_CHANNEL_PRESSURE:
-		return 2;
-	default:
-		return 3;
-	}
+	return cin_num_midi_bytes[cin & 0xf];
 }
 
 enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8_t cable_num,
@@ -181,20 +169,19 @@ enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8
 	}
 
 	packet->cable_num = cable_num;
-	packet->cin = 0;
-	packet->num_midi_bytes = 0;
 
-	enum usb_midi_error_t cin_error = channel_msg_cin(midi_bytes[0], &packet->cin);
-	if (cin_error != USB_MIDI_SUCCESS) {
-		cin_error = non_sysex_system_msg_cin(midi_bytes[0], &packet->cin);
-	}
-	if (cin_error != USB_MIDI_SUCCESS) {
-		cin_error = sysex_msg_cin(midi_bytes, &packet->cin);
+	uint8_t entry = status_byte_table[midi_bytes[0]];
+	if (entry == STATUS_ENTRY_SYSEX_PATTERN) {
+		packet->cin = sysex_pattern_cin[midi_bytes[0] == SYSEX_START_BYTE]
+					       [sysex_byte_class(midi_bytes[1])]
+					       [sysex_byte_class(midi_bytes[2])];
+		packet->num_midi_bytes = cin_num_midi_bytes[packet->cin];
+	} else {
+		packet->cin = STATUS_ENTRY_CIN(entry);
+		packet->num_midi_bytes = STATUS_ENTRY_NUM_BYTES(entry);
 	}
 
-	packet->num_midi_bytes = num_midi_bytes_for_cin(packet->cin);
-
-	if (cin_error != USB_MIDI_SUCCESS || packet->num_midi_bytes == 0) {
+	if (packet->num_midi_bytes == 0) {
 		/* Invalid MIDI message. */
 		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
 	}
@@ -203,12 +190,9 @@ enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8
 	packet->bytes[0] = (packet->cable_num << 4) | packet->cin;
 
 	/* Fill packet bytes 1,2 and 3 with zero padded midi bytes. */
-	packet->bytes[1] = 0;
-	packet->bytes[2] = 0;
-	packet->bytes[3] = 0;
-	for (int i = 0; i < packet->num_midi_bytes; i++) {
-		packet->bytes[i + 1] = midi_bytes[i];
-	}
+	packet->bytes[1] = midi_bytes[0];
+	packet->bytes[2] = packet->num_midi_bytes > 1 ? midi_bytes[1] : 0;
+	packet->bytes[3] = packet->num_midi_bytes > 2 ? midi_bytes[2] : 0;
 
 	/* No errors */
 	return USB_MIDI_SUCCESS;
@@ -230,7 +214,7 @@ enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
 
 	packet->cable_num = packet_bytes[0] >> 4;
 	packet->cin = packet_bytes[0] & 0xf;
-	packet->num_midi_bytes = num_midi_bytes_for_cin(packet->cin);
+	packet->num_midi_bytes = cin_num_midi_bytes[packet->cin];
 
 	if (packet->num_midi_bytes == 0) {
 		return USB_MIDI_ERROR_INVALID_CIN;
@@ -243,13 +227,19 @@ enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
 enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 					    struct usb_midi_parse_cb_t *parse_cb)
 {
-	struct usb_midi_packet_t packet;
-	enum usb_midi_error_t rc = usb_midi_packet_from_usb_bytes(packet_bytes, &packet);
-	if (rc != USB_MIDI_SUCCESS) {
-		return rc;
+	/*
+	 * The packet is parsed in place, without first copying it into a
+	 * struct usb_midi_packet_t. Callbacks receive pointers into packet_bytes.
+	 */
+	uint8_t cable_num = packet_bytes[0] >> 4;
+	uint8_t cin = packet_bytes[0] & 0xf;
+	uint8_t num_midi_bytes = cin_num_midi_bytes[cin];
+
+	if (num_midi_bytes == 0) {
+		return USB_MIDI_ERROR_INVALID_CIN;
 	}
 
-	switch (packet.cin) {
+	switch (cin) {
 	case USB_MIDI_CIN_SYSCOM_2BYTE:
 	case USB_MIDI_CIN_SYSCOM_3BYTE:
 	case USB_MIDI_CIN_NOTE_ON:
@@ -260,7 +250,7 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 	case USB_MIDI_CIN_CHANNEL_PRESSURE:
 	case USB_MIDI_CIN_PITCH_BEND_CHANGE:
 		if (parse_cb->message_cb) {
-			parse_cb->message_cb(&packet.bytes[1], packet.num_midi_bytes, packet.cable_num);
+			parse_cb->message_cb(&packet_bytes[1], num_midi_bytes, cable_num);
 		}
 		break;
 	case USB_MIDI_CIN_1BYTE_DATA: {
@@ -279,27 +269,26 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 		 *   USB-MIDI Event Packet. This way, any MIDI data may be 
 		 *   transferred without being parsed. "
 		 * which seems to imply that a class compliant driver
-		 * should also be able to parse a stream of single MIDI bytes? 
-		 * Or at least deliver these single bytes somehow?
-		 * Ignoring this for now.
-		 * 
-		 * TODO: Understand this better.
+		 * should also be able to parse a stream of single MIDI bytes.
+		 * Doing that requires state across packets, see usb_midi_stream.h,
+		 * which the driver uses for these packets. This stateless fallback
+		 * guesses instead.
 		 * 
 		 * See https://forum.pjrc.com/index.php?threads/midi-sysex-single-byte-message-issue.23786/
 		 */
-		uint8_t byte = packet.bytes[1];
-		
-		if (IS_STATUS_BYTE(byte)) {
+		uint8_t *byte = &packet_bytes[1];
+
+		if (IS_STATUS_BYTE(*byte)) {
 			/* 
 			 * We got a single status byte, assume it's a single byte MIDI message.
 			 */
 			if (parse_cb->message_cb) {
-				parse_cb->message_cb(&byte, 1, packet.cable_num);
+				parse_cb->message_cb(byte, 1, cable_num);
 			}
 		} else {
 			/* We got a data byte. Assume it's part of an ongoing sysex message. */
 			if (parse_cb->sysex_data_cb) {
-				parse_cb->sysex_data_cb(&byte, 1, packet.cable_num);
+				parse_cb->sysex_data_cb(byte, 1, cable_num);
 			}
 		}
 		break;
@@ -312,29 +301,29 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 		 */
 		int first_data_byte_idx = 1;
 		int last_data_byte_idx = 3;
-		if (packet.bytes[1] == SYSEX_START_BYTE) {
+		if (packet_bytes[1] == SYSEX_START_BYTE) {
 			if (parse_cb->sysex_start_cb) {
-				parse_cb->sysex_start_cb(packet.cable_num);
+				parse_cb->sysex_start_cb(cable_num);
 			}
 			first_data_byte_idx++;
 		}
 
 		int num_data_bytes = 1 + last_data_byte_idx - first_data_byte_idx;
 		if (parse_cb->sysex_data_cb) {
-			parse_cb->sysex_data_cb(&packet.bytes[first_data_byte_idx], num_data_bytes,
-						packet.cable_num);
+			parse_cb->sysex_data_cb(&packet_bytes[first_data_byte_idx], num_data_bytes,
+						cable_num);
 		}
 		break;
 	}
 	case USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE:
-		if (packet.bytes[1] != SYSEX_END_BYTE) {
+		if (packet_bytes[1] != SYSEX_END_BYTE) {
 			/* Single byte system common */
 			if (parse_cb->message_cb) {
-				parse_cb->message_cb(&packet.bytes[1], 1, packet.cable_num);
+				parse_cb->message_cb(&packet_bytes[1], 1, cable_num);
 			}
 		} else if (parse_cb->sysex_end_cb) {
 			/* Sysex end */
-			parse_cb->sysex_end_cb(packet.cable_num);
+			parse_cb->sysex_end_cb(cable_num);
 		}
 		break;
 	case USB_MIDI_CIN_SYSEX_END_2BYTE:
@@ -342,15 +331,15 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 			F0, F7
 			d, F7
 		*/
-		if (packet.bytes[1] == SYSEX_START_BYTE) {
+		if (packet_bytes[1] == SYSEX_START_BYTE) {
 			if (parse_cb->sysex_start_cb) {
-				parse_cb->sysex_start_cb(packet.cable_num);
+				parse_cb->sysex_start_cb(cable_num);
 			}
 		} else if (parse_cb->sysex_data_cb) {
-			parse_cb->sysex_data_cb(&packet.bytes[1], 1, packet.cable_num);
+			parse_cb->sysex_data_cb(&packet_bytes[1], 1, cable_num);
 		}
 		if (parse_cb->sysex_end_cb) {
-			parse_cb->sysex_end_cb(packet.cable_num);
+			parse_cb->sysex_end_cb(cable_num);
 		}
 		break;
 	case USB_MIDI_CIN_SYSEX_END_3BYTE: {
@@ -360,19 +349,19 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 		 */
 		int first_data_byte_idx = 1;
 		int last_data_byte_idx = 2;
-		if (packet.bytes[1] == SYSEX_START_BYTE) {
+		if (packet_bytes[1] == SYSEX_START_BYTE) {
 			if (parse_cb->sysex_start_cb) {
-				parse_cb->sysex_start_cb(packet.cable_num);
+				parse_cb->sysex_start_cb(cable_num);
 			}
 			first_data_byte_idx++;
 		}
 		int num_data_bytes = 1 + last_data_byte_idx - first_data_byte_idx;
 		if (parse_cb->sysex_data_cb) {
-			parse_cb->sysex_data_cb(&packet.bytes[first_data_byte_idx], num_data_bytes,
-						packet.cable_num);
+			parse_cb->sysex_data_cb(&packet_bytes[first_data_byte_idx], num_data_bytes,
+						cable_num);
 		}
 		if (parse_cb->sysex_end_cb) {
-			parse_cb->sysex_end_cb(packet.cable_num);
+			parse_cb->sysex_end_cb(cable_num);
 		}
 		break;
 	}
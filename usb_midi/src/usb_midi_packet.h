@@ -64,7 +64,9 @@ struct usb_midi_parse_cb_t {
 };
 
 /**
- * Parses a USB MIDI packet and invokes the appropriate callback.
+ * Parses a USB MIDI packet and invokes the appropriate callback. The packet
+ * is parsed in place and the MIDI bytes passed to the callbacks point into
+ * packet_bytes.
  */
 enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 					    struct usb_midi_parse_cb_t *parse_cb);
@@ -77,6 +79,9 @@ struct usb_midi_packet_t {
 	uint8_t num_midi_bytes;
 };
 
+/* Returns the number of MIDI bytes in a packet with a given CIN, or 0 if the CIN is reserved. */
+uint8_t usb_midi_cin_num_midi_bytes(uint8_t cin);
+
 enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8_t cable_num,
 						      struct usb_midi_packet_t *packet);
 enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
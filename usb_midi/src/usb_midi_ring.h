@@ -0,0 +1,117 @@
+#ifndef ZEPHYR_USB_MIDI_RING_H_
+#define ZEPHYR_USB_MIDI_RING_H_
+
+#include <stdint.h>
+
+/**
+ * A lock-free single-producer/single-consumer ring buffer of 32 bit items,
+ * e.g encoded USB MIDI packets. One thread (or ISR) may put items while
+ * another thread (or ISR) gets them, without any locking.
+ *
+ * head and tail are free running counters. The number of items in the
+ * ring is head - tail, which is correct also when the counters wrap around
+ * since the ring size is a power of two.
+ */
+struct usb_midi_ring_t {
+	uint32_t *items;
+	/* Number of items the ring can hold. Must be a power of two. */
+	uint32_t size;
+	/* Only written by the producer */
+	uint32_t head;
+	/* Only written by the consumer */
+	uint32_t tail;
+};
+
+/* Initializer for an empty ring storing its items in the array items_array. */
+#define USB_MIDI_RING_INITIALIZER(items_array)                                                     \
+	{                                                                                          \
+		.items = items_array, .size = sizeof(items_array) / sizeof(uint32_t), .head = 0,   \
+		.tail = 0                                                                          \
+	}
+
+/* Defines a static ring named name holding at most size items. */
+#define USB_MIDI_RING_DEFINE(name, num_items)                                                      \
+	static uint32_t name##_items[num_items];                                                   \
+	static struct usb_midi_ring_t name = USB_MIDI_RING_INITIALIZER(name##_items)
+
+/** Returns the number of items in the ring. Can be called from either side. */
+static inline uint32_t usb_midi_ring_count(struct usb_midi_ring_t *ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return head - tail;
+}
+
+/** Returns the number of items that can be put in the ring. Can be called from either side. */
+static inline uint32_t usb_midi_ring_space(struct usb_midi_ring_t *ring)
+{
+	return ring->size - usb_midi_ring_count(ring);
+}
+
+/**
+ * Puts an item in the ring. Producer side only.
+ * @return 0 on success, -1 if the ring is full.
+ */
+static inline int usb_midi_ring_put(struct usb_midi_ring_t *ring, uint32_t item)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == ring->size) {
+		return -1;
+	}
+	ring->items[head & (ring->size - 1)] = item;
+	/* Publish the item before advancing head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Copies up to max_num_items items from the ring to dest, without removing
+ * them. Consumer side only.
+ * @return The number of items written to dest.
+ */
+static inline uint32_t usb_midi_ring_peek(struct usb_midi_ring_t *ring, uint32_t *dest,
+					  uint32_t max_num_items)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t num_items = head - tail;
+	if (num_items > max_num_items) {
+		num_items = max_num_items;
+	}
+	for (uint32_t i = 0; i < num_items; i++) {
+		dest[i] = ring->items[(tail + i) & (ring->size - 1)];
+	}
+	return num_items;
+}
+
+/**
+ * Removes the num_items oldest items, which must have been peeked. Consumer side only.
+ */
+static inline void usb_midi_ring_skip(struct usb_midi_ring_t *ring, uint32_t num_items)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	/* Release the slots only after the items have been read */
+	__atomic_store_n(&ring->tail, tail + num_items, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gets up to max_num_items items from the ring. Consumer side only.
+ * @return The number of items written to dest.
+ */
+static inline uint32_t usb_midi_ring_get(struct usb_midi_ring_t *ring, uint32_t *dest,
+					 uint32_t max_num_items)
+{
+	uint32_t num_items = usb_midi_ring_peek(ring, dest, max_num_items);
+	usb_midi_ring_skip(ring, num_items);
+	return num_items;
+}
+
+/** Discards all items in the ring. Consumer side only. */
+static inline void usb_midi_ring_clear(struct usb_midi_ring_t *ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+#endif
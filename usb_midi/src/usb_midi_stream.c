@@ -0,0 +1,111 @@
+#include "usb_midi_stream.h"
+
+#define SYSEX_START_BYTE 0xF0
+#define SYSEX_END_BYTE	 0xF7
+#define IS_REALTIME_BYTE(b) (b >= 0xF8)
+#define IS_STATUS_BYTE(b) (b >= 0x80)
+
+/* The number of bytes of messages starting with a given status byte (0x80-0xF7), 0 if undefined. */
+static uint8_t msg_size(uint8_t status_byte)
+{
+	switch (status_byte >> 4) {
+	case 0xc:
+	case 0xd:
+		return 2;
+	case 0xf:
+		break;
+	default:
+		return 3;
+	}
+
+	switch (status_byte) {
+	case 0xf1:
+	case 0xf3:
+		return 2;
+	case 0xf2:
+		return 3;
+	case 0xf6:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+void usb_midi_stream_parser_init(struct usb_midi_stream_parser_t *parser)
+{
+	parser->bytes[0] = 0;
+	parser->num_bytes = 0;
+	parser->msg_size = 0;
+	parser->in_sysex = 0;
+}
+
+static void emit_message(struct usb_midi_stream_parser_t *parser, uint8_t cable_num,
+			 const struct usb_midi_parse_cb_t *parse_cb)
+{
+	if (parse_cb->message_cb) {
+		parse_cb->message_cb(parser->bytes, parser->num_bytes, cable_num);
+	}
+	if (parser->bytes[0] < 0xf0) {
+		/* Running status. The next data byte starts a message with the same status byte. */
+		parser->num_bytes = 1;
+	} else {
+		/* System common messages cancel running status */
+		parser->bytes[0] = 0;
+		parser->num_bytes = 0;
+	}
+}
+
+void usb_midi_stream_parse_byte(struct usb_midi_stream_parser_t *parser, uint8_t byte,
+				uint8_t cable_num, const struct usb_midi_parse_cb_t *parse_cb)
+{
+	if (IS_REALTIME_BYTE(byte)) {
+		/* May appear anywhere, without affecting the message being assembled. */
+		if (byte != 0xf9 && byte != 0xfd && parse_cb->message_cb) {
+			parse_cb->message_cb(&byte, 1, cable_num);
+		}
+		return;
+	}
+
+	if (!IS_STATUS_BYTE(byte)) {
+		if (parser->in_sysex) {
+			if (parse_cb->sysex_data_cb) {
+				parse_cb->sysex_data_cb(&byte, 1, cable_num);
+			}
+		} else if (parser->num_bytes > 0) {
+			parser->bytes[parser->num_bytes++] = byte;
+			if (parser->num_bytes == parser->msg_size) {
+				emit_message(parser, cable_num, parse_cb);
+			}
+		}
+		return;
+	}
+
+	/* Any other status byte ends an ongoing sysex message */
+	if (parser->in_sysex) {
+		parser->in_sysex = 0;
+		if (parse_cb->sysex_end_cb) {
+			parse_cb->sysex_end_cb(cable_num);
+		}
+	}
+	parser->bytes[0] = 0;
+	parser->num_bytes = 0;
+
+	if (byte == SYSEX_START_BYTE) {
+		parser->in_sysex = 1;
+		if (parse_cb->sysex_start_cb) {
+			parse_cb->sysex_start_cb(cable_num);
+		}
+		return;
+	}
+
+	parser->msg_size = msg_size(byte);
+	if (parser->msg_size == 0) {
+		/* F7 outside of sysex or an undefined status byte */
+		return;
+	}
+	parser->bytes[0] = byte;
+	parser->num_bytes = 1;
+	if (parser->msg_size == 1) {
+		emit_message(parser, cable_num, parse_cb);
+	}
+}
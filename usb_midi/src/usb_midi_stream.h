@@ -0,0 +1,38 @@
+#ifndef ZEPHYR_USB_MIDI_STREAM_H_
+#define ZEPHYR_USB_MIDI_STREAM_H_
+
+#include <stdint.h>
+#include "usb_midi_packet.h"
+
+/*
+ * A parser turning a raw MIDI byte stream, e.g single bytes received in CIN 0xF
+ * packets or bytes from a UART, into complete messages. Handles running status,
+ * system realtime bytes interleaved with other messages and sysex messages of
+ * any length, at a constant cost per byte and without allocating memory.
+ * Use one parser per cable.
+ */
+struct usb_midi_stream_parser_t {
+	/* The message being assembled. bytes[0] is its status byte, or 0 if there is none. */
+	uint8_t bytes[3];
+	/* The number of bytes of the message assembled so far, including the status byte. */
+	uint8_t num_bytes;
+	/* The total number of bytes of the message being assembled. */
+	uint8_t msg_size;
+	/* Non-zero while receiving a sysex message. */
+	uint8_t in_sysex;
+};
+
+void usb_midi_stream_parser_init(struct usb_midi_stream_parser_t *parser);
+
+/**
+ * Feeds a byte to a stream parser. Complete non-sysex messages are passed to
+ * message_cb, system realtime messages as soon as they are received. Sysex data
+ * bytes are passed to sysex_data_cb one at a time. A sysex message interrupted
+ * by a status byte other than system realtime is ended (sysex_end_cb is called)
+ * as if F7 had been received. Data bytes without a preceding status byte and
+ * undefined status bytes are ignored.
+ */
+void usb_midi_stream_parse_byte(struct usb_midi_stream_parser_t *parser, uint8_t byte,
+				uint8_t cable_num, const struct usb_midi_parse_cb_t *parse_cb);
+
+#endif
@@ -0,0 +1,141 @@
+#include <zephyr/init.h>
+#include <zephyr/usb/usb_device.h>
+#include <usb_descriptor.h>
+#include "usb_midi_types.h"
+#include "usb_midi_macros.h"
+#include "usb_midi_backend.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+/* The USB MIDI backend for Zephyr's USB device stack. */
+
+USBD_CLASS_DESCR_DEFINE(primary, 0)
+struct usb_midi_config usb_midi_config_data = {
+	.ac_if = INIT_AC_IF,
+	.ac_cs_if = INIT_AC_CS_IF,
+	.ms_if = INIT_MS_IF,
+	.ms_cs_if = INIT_MS_CS_IF,
+	.out_jacks_emb = {
+		LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, INIT_OUT_JACK, (, ), 0)},
+	.in_jacks_emb = {LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, INIT_IN_JACK, (, ), CONFIG_USB_MIDI_NUM_OUTPUTS)},
+	.element = INIT_ELEMENT,
+	.in_ep = INIT_IN_EP,
+	.in_cs_ep = {.bLength = sizeof(struct usb_midi_bulk_in_ep_descriptor), .bDescriptorType = USB_DESC_CS_ENDPOINT, .bDescriptorSubtype = 0x01, .bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_OUTPUTS, .BaAssocJackID = {LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, IDX_WITH_OFFSET, (, ), 1)}},
+	.out_ep = INIT_OUT_EP,
+	.out_cs_ep = {.bLength = sizeof(struct usb_midi_bulk_out_ep_descriptor), .bDescriptorType = USB_DESC_CS_ENDPOINT, .bDescriptorSubtype = 0x01, .bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_INPUTS, .BaAssocJackID = {LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, IDX_WITH_OFFSET, (, ), 1 + CONFIG_USB_MIDI_NUM_OUTPUTS)}}};
+
+#define MIDI_IN_EP_IDX 0
+#define MIDI_OUT_EP_IDX 1
+
+static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_OUT) {
+		usb_midi_on_out_data();
+	}
+}
+
+static void midi_in_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_IN) {
+		usb_midi_on_in_done();
+	}
+}
+
+static struct usb_ep_cfg_data midi_ep_cfg[] = {
+	[MIDI_IN_EP_IDX] = {
+		.ep_cb = midi_in_ep_cb,
+		.ep_addr = 0x81,
+	},
+	[MIDI_OUT_EP_IDX] = {
+		.ep_cb = midi_out_ep_cb,
+		.ep_addr = 0x01,
+	}};
+
+int usb_midi_backend_write(const uint8_t *data, uint32_t num_bytes)
+{
+	return usb_write(midi_ep_cfg[MIDI_IN_EP_IDX].ep_addr, data, num_bytes, NULL);
+}
+
+int usb_midi_backend_read_wait(uint8_t *data, uint32_t max_num_bytes, uint32_t *num_read_bytes)
+{
+	return usb_ep_read_wait(midi_ep_cfg[MIDI_OUT_EP_IDX].ep_addr, data, max_num_bytes,
+				num_read_bytes);
+}
+
+int usb_midi_backend_read_continue()
+{
+	return usb_ep_read_continue(midi_ep_cfg[MIDI_OUT_EP_IDX].ep_addr);
+}
+
+void usb_status_callback(struct usb_cfg_data *cfg,
+						 enum usb_dc_status_code cb_status,
+						 const uint8_t *param)
+{
+	switch (cb_status)
+	{
+	/** USB error reported by the controller */
+	case USB_DC_ERROR:
+		LOG_DBG("USB_DC_ERROR");
+		break;
+	/** USB reset */
+	case USB_DC_RESET:
+		LOG_DBG("USB_DC_RESET");
+		break;
+	/** USB connection established, hardware enumeration is completed */
+	case USB_DC_CONNECTED:
+		LOG_DBG("USB_DC_CONNECTED");
+		break;
+	/** USB configuration done */
+	case USB_DC_CONFIGURED:
+		LOG_DBG("USB_DC_CONFIGURED");
+		usb_midi_on_available(1);
+		break;
+	/** USB connection lost */
+	case USB_DC_DISCONNECTED:
+		LOG_DBG("USB_DC_DISCONNECTED");
+		break;
+	/** USB connection suspended by the HOST */
+	case USB_DC_SUSPEND:
+		usb_midi_on_available(0);
+		break;
+	/** USB connection resumed by the HOST */
+	case USB_DC_RESUME:
+		LOG_DBG("USB_DC_RESUME");
+		break;
+	/** USB interface selected */
+	case USB_DC_INTERFACE:
+		LOG_DBG("USB_DC_INTERFACE");
+		break;
+	/** Set Feature ENDPOINT_HALT received */
+	case USB_DC_SET_HALT:
+		LOG_DBG("USB_DC_SET_HALT");
+		break;
+	/** Clear Feature ENDPOINT_HALT received */
+	case USB_DC_CLEAR_HALT:
+		LOG_DBG("USB_DC_CLEAR_HALT");
+		break;
+	/** Start of Frame received */
+	case USB_DC_SOF:
+		usb_midi_on_sof();
+		break;
+	/** Initial USB connection status */
+	case USB_DC_UNKNOWN:
+		LOG_DBG("USB_DC_UNKNOWN");
+		break;
+	}
+}
+
+USBD_DEFINE_CFG_DATA(usb_midi_config) = {
+	.usb_device_description = NULL,
+	.interface_config = NULL,
+	.interface_descriptor = &usb_midi_config_data.ac_if,
+	.cb_usb_status = usb_status_callback,
+	.interface = {
+		.class_handler = NULL,
+		.custom_handler = NULL,
+		.vendor_handler = NULL,
+	},
+	.num_endpoints = ARRAY_SIZE(midi_ep_cfg),
+	.endpoint = midi_ep_cfg,
+};
\ No newline at end of file